@@ -2,18 +2,34 @@
 #include "pbrt_parser/parser.h"
 #include "scene.h"
 #include "render.h"
+#include "tile_farm.h"
+#include "parallel.h"
+#include "memory_tracker.h"
+#include "pbrt/hash.h"
 
-#include <embree4/rtcore.h>
 #include <stdio.h>
 #include <math.h>
 #include <limits>
 #include <stdio.h>
+#include <chrono>
+#include <fstream>
+#include <iterator>
 
 #if defined(_WIN32)
 #  include <conio.h>
 #  include <windows.h>
 #endif
 
+// Identifies the render for checkpoints: the bytes of the scene file and the
+// options that change the sampling. Included files and meshes are added once
+// the scene is parsed, see CAlpa7XScene::hashSourceFiles.
+static uint64_t hashRender(const std::string& scene_path, const SProgressiveSettings& settings)
+{
+	std::ifstream scene_file(scene_path, std::ios::binary);
+	std::vector<char> scene_bytes((std::istreambuf_iterator<char>(scene_file)), std::istreambuf_iterator<char>());
+	uint64_t scene_hash = pbrt::HashBuffer(scene_bytes.data(), scene_bytes.size());
+	return pbrt::Hash(scene_hash, settings.target_spp, settings.adaptive_threshold, settings.adaptive_min_spp);
+}
 
 int main(int argc, char* argv[])
 {
@@ -22,25 +38,288 @@ int main(int argc, char* argv[])
 	opts.add_options()
 		("i,input_pbrt_scene", "Input pbrt scene path", cxxopts::value<std::string>())
 		("o,output_image", "output image path", cxxopts::value<std::string>())
+		("stream_scene", "Build geometry while parsing and release parsed shape data early")
+		("no_mesh_dedup", "Give every shape its own mesh buffers, even if the payloads are identical")
+		("compact_geometry", "Quantized light mesh attributes, 16 bit indices and a compact BVH")
+		("accelerator", "Ray tracing backend: embree (default) or bvh, the in-tree wide BVH", cxxopts::value<std::string>())
+		("accelerator_benchmark", "Build the scene with both backends and compare their build time and rays per second instead of rendering")
+		("numa", "Pin render threads to NUMA nodes and give every node its own copy of the scene")
+		("thread_affinity", "Pin each render thread to one logical processor: compact, scatter or physical_cores", cxxopts::value<std::string>())
+		("huge_pages", "Back the BVH, mesh, film and SPPM buffers with 2 MB pages")
+		("memory_budget", "Memory budget in MB; the BVH falls back to a compact build and the render stops cleanly when it is exceeded", cxxopts::value<size_t>())
+		("tone_map", "Tone operator of the output image: clamp, reinhard or aces", cxxopts::value<std::string>())
+		("srgb", "Encode the output image with the sRGB curve instead of gamma 2.2")
+		("exr_float", "Write 32 bit float EXR channels instead of half")
+		("exr_compression", "EXR compression: none, rle or zip", cxxopts::value<std::string>())
+		("spp", "Samples per pixel, overrides the sampler; with a time budget the default is no limit", cxxopts::value<int>())
+		("time_budget", "Wall clock seconds for rendering; stops after the last pass that fits", cxxopts::value<float>())
+		("preview_interval", "Seconds between intermediate images written to the output file", cxxopts::value<float>())
+		("preview_stream", "Stream the passes to a tev image viewer at host:port (default 127.0.0.1:14158)", cxxopts::value<std::string>()->implicit_value("127.0.0.1:14158"))
+		("preview_stream_interval", "Minimum seconds between streamed updates (default 0.5)", cxxopts::value<float>())
+		("adaptive_threshold", "Relative error at which a pixel stops receiving samples, enables adaptive sampling in the path integrator", cxxopts::value<float>())
+		("adaptive_min_spp", "Samples every pixel gets before adaptive sampling may stop it (default 16)", cxxopts::value<int>())
+		("checkpoint_interval", "Seconds between checkpoints of the render state, written next to the output image as <name>.ckpt", cxxopts::value<float>())
+		("resume", "Continue from the checkpoint of an interrupted render of the same scene")
+		("spp_range", "Render only the sample indices start:end and write them to <output>.shard", cxxopts::value<std::string>())
+		("merge_shards", "Combine the .shard files of one scene into the output image instead of rendering", cxxopts::value<std::vector<std::string>>())
+		("coordinator", "Hand out the tiles of the frame to workers connecting to host:port or unix:<path> and write the image", cxxopts::value<std::string>())
+		("tile_size", "Edge length of the coordinator's tiles in pixels (default 64)", cxxopts::value<uint32_t>())
+		("session", "Keep the scene loaded and apply the edit and render commands read from standard input, see render.h")
+		("worker", "Render tiles for the coordinator at host:port or unix:<path> instead of the whole image", cxxopts::value<std::string>())
+		("batch", "Render the listed pbrt files in order, loading the next frame while the current one renders; each frame writes to its Film filename", cxxopts::value<std::vector<std::string>>())
 		("h,help", "Print help message.");
 
 	auto opt_result = opts.parse(argc, argv);
-	if (opt_result.count("h") || argc < 2 || opt_result.count("i") == 0)
+	// neither mode loads a scene, a batch loads its own
+	const bool merge_shards = opt_result.count("merge_shards") != 0;
+	const bool coordinator = opt_result.count("coordinator") != 0;
+	const bool batch = opt_result.count("batch") != 0;
+	if (opt_result.count("h") || argc < 2 || (opt_result.count("i") == 0 && !merge_shards && !coordinator && !batch))
 	{
 		printf(opts.help().c_str());
 		printf("\n");
 		exit(-1);
 	}
 
-	std::string input_pbrt_scene_path = opt_result["i"].as<std::string>();
+	std::string input_pbrt_scene_path = opt_result.count("i") ? opt_result["i"].as<std::string>() : std::string();
+
+	if (opt_result.count("memory_budget"))
+	{
+		setMemoryBudget(opt_result["memory_budget"].as<size_t>() * 1024 * 1024);
+	}
 	
+	if (opt_result.count("huge_pages"))
+	{
+		enableHugePages();
+	}
+
+	EThreadAffinity thread_affinity = TA_None;
+	if (opt_result.count("thread_affinity"))
+	{
+		std::string affinity_name = opt_result["thread_affinity"].as<std::string>();
+		if (affinity_name == "compact")
+		{
+			thread_affinity = TA_Compact;
+		}
+		else if (affinity_name == "scatter")
+		{
+			thread_affinity = TA_Scatter;
+		}
+		else if (affinity_name == "physical_cores")
+		{
+			thread_affinity = TA_PhysicalCores;
+		}
+		else
+		{
+			printf("unknown thread affinity %s, threads are not pinned\n", affinity_name.c_str());
+		}
+	}
+
+	parallelInit(0, opt_result.count("numa") != 0, thread_affinity);
+
+	SFilmResolveSettings film_settings;
+	if (opt_result.count("tone_map"))
+	{
+		std::string tone_map_name = opt_result["tone_map"].as<std::string>();
+		if (tone_map_name == "reinhard")
+		{
+			film_settings.tone_operator = TO_Reinhard;
+		}
+		else if (tone_map_name == "aces")
+		{
+			film_settings.tone_operator = TO_ACES;
+		}
+		else if (tone_map_name != "clamp")
+		{
+			printf("unknown tone operator %s, clamping instead\n", tone_map_name.c_str());
+		}
+	}
+	if (opt_result.count("srgb"))
+	{
+		film_settings.encoding = OE_sRGB;
+	}
+
+	SImageOutputSettings output_settings;
+	if (opt_result.count("o") && batch)
+	{
+		printf("-o is ignored in batch mode, every frame is written to its Film filename\n");
+	}
+	else if (opt_result.count("o"))
+	{
+		output_settings.file_name = opt_result["o"].as<std::string>();
+	}
+	output_settings.exr_half = opt_result.count("exr_float") == 0;
+	if (opt_result.count("preview_stream"))
+	{
+		output_settings.preview_stream_address = opt_result["preview_stream"].as<std::string>();
+	}
+	if (opt_result.count("preview_stream_interval"))
+	{
+		output_settings.preview_stream_interval = opt_result["preview_stream_interval"].as<float>();
+	}
+	if (opt_result.count("exr_compression"))
+	{
+		std::string compression_name = opt_result["exr_compression"].as<std::string>();
+		if (compression_name == "none")
+		{
+			output_settings.exr_compression = EC_None;
+		}
+		else if (compression_name == "rle")
+		{
+			output_settings.exr_compression = EC_RLE;
+		}
+		else if (compression_name != "zip")
+		{
+			printf("unknown EXR compression %s, using zip\n", compression_name.c_str());
+		}
+	}
+
+	if (merge_shards)
+	{
+		bool merged = mergeFilmShards(opt_result["merge_shards"].as<std::vector<std::string>>(), film_settings, output_settings);
+		parallelCleanup();
+		return merged ? 0 : -1;
+	}
+
+	if (coordinator)
+	{
+		STileCoordinatorSettings coordinator_settings;
+		coordinator_settings.address = opt_result["coordinator"].as<std::string>();
+		if (opt_result.count("tile_size"))
+		{
+			coordinator_settings.tile_size = (std::max)(opt_result["tile_size"].as<uint32_t>(), 1u);
+		}
+		installInterruptHandler();
+		bool rendered = runTileCoordinator(coordinator_settings, film_settings, output_settings);
+		parallelCleanup();
+		return rendered ? 0 : -1;
+	}
+
+	SProgressiveSettings progressive_settings;
+	if (opt_result.count("spp"))
+	{
+		progressive_settings.target_spp = opt_result["spp"].as<int>();
+	}
+	if (opt_result.count("time_budget"))
+	{
+		progressive_settings.time_budget = opt_result["time_budget"].as<float>();
+	}
+	if (opt_result.count("preview_interval"))
+	{
+		progressive_settings.preview_interval = opt_result["preview_interval"].as<float>();
+	}
+	if (opt_result.count("adaptive_threshold"))
+	{
+		progressive_settings.adaptive_threshold = opt_result["adaptive_threshold"].as<float>();
+	}
+	if (opt_result.count("adaptive_min_spp"))
+	{
+		progressive_settings.adaptive_min_spp = opt_result["adaptive_min_spp"].as<int>();
+	}
+	if (opt_result.count("checkpoint_interval"))
+	{
+		progressive_settings.checkpoint_interval = opt_result["checkpoint_interval"].as<float>();
+	}
+	progressive_settings.resume = opt_result.count("resume") > 0;
+	if (opt_result.count("spp_range"))
+	{
+		std::string spp_range = opt_result["spp_range"].as<std::string>();
+		int spp_begin = 0;
+		int spp_end = 0;
+		if (sscanf(spp_range.c_str(), "%d:%d", &spp_begin, &spp_end) == 2 && spp_begin >= 0 && spp_end > spp_begin)
+		{
+			progressive_settings.spp_range_begin = spp_begin;
+			progressive_settings.spp_range_end = spp_end;
+		}
+		else
+		{
+			printf("invalid spp range %s, expected start:end, rendering every sample\n", spp_range.c_str());
+		}
+	}
+	const bool worker = opt_result.count("worker") != 0;
+	EAcceleratorBackend accelerator_backend = AB_Embree;
+	if (opt_result.count("accelerator"))
+	{
+		std::string backend_name = opt_result["accelerator"].as<std::string>();
+		if (backend_name == "bvh")
+		{
+			accelerator_backend = AB_WideBVH;
+		}
+		else if (backend_name != "embree")
+		{
+			printf("unknown accelerator %s, using embree\n", backend_name.c_str());
+		}
+	}
+
+	const bool hash_scene = progressive_settings.checkpoint_interval > 0.0f || progressive_settings.resume || progressive_settings.hasSppRange() || worker;
+
+	auto configureScene = [&](CAlpa7XScene& scene, const std::string& scene_path) {
+		if (opt_result.count("stream_scene"))
+		{
+			scene.enableStreamingBuild();
+		}
+		if (opt_result.count("no_mesh_dedup"))
+		{
+			scene.disableMeshDedup();
+		}
+		if (opt_result.count("compact_geometry"))
+		{
+			scene.enableCompactGeometry();
+		}
+		scene.setAcceleratorBackend(accelerator_backend);
+		scene.setFilmResolveSettings(film_settings);
+		scene.setImageOutputSettings(output_settings);
+
+		SProgressiveSettings scene_settings = progressive_settings;
+		if (hash_scene)
+		{
+			scene_settings.scene_hash = hashRender(scene_path, scene_settings);
+		}
+		scene.setProgressiveSettings(scene_settings);
+	};
+	installInterruptHandler();
+
+	if (batch)
+	{
+		renderBatch(opt_result["batch"].as<std::vector<std::string>>(), configureScene);
+		printMemoryReport();
+		parallelCleanup();
+		return 0;
+	}
+
+	if (opt_result.count("accelerator_benchmark"))
+	{
+		benchmarkAccelerators(input_pbrt_scene_path, configureScene);
+		printMemoryReport();
+		parallelCleanup();
+		return 0;
+	}
+
 	CAlpa7XScene scene;
+	configureScene(scene, input_pbrt_scene_path);
+
+	auto parse_begin = std::chrono::steady_clock::now();
 	Alpha7XSceneBuilder builder(&scene);
 	pbrt::ParseFile(&builder, input_pbrt_scene_path);
+	printf("scene parse: %.3f s\n", std::chrono::duration<float>(std::chrono::steady_clock::now() - parse_begin).count());
 
+	bool rendered = true;
+	if (worker)
+	{
+		rendered = runTileWorker(opt_result["worker"].as<std::string>(), scene, scene.getProgressiveSettings().scene_hash);
+	}
+	else if (opt_result.count("session"))
+	{
+		CRenderSession session(scene);
+		runSessionCommands(session, stdin);
+	}
+	else
 	{
 		renderScene(scene);
 	}
 
-	return 0;
+	printMemoryReport();
+
+	parallelCleanup();
+	return rendered ? 0 : -1;
 }
\ No newline at end of file
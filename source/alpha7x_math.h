@@ -2,6 +2,7 @@
 #include <glm/vec3.hpp>
 #include <glm/geometric.hpp>
 #include <glm/trigonometric.hpp>
+#include <glm/packing.hpp>
 
 static constexpr float float_one_minus_epsilon = 0x1.fffffep-1;
 
@@ -85,3 +86,34 @@ public:
 
 	glm::vec3 x, y, z;
 };
+
+// octahedral normal encoding: the unit sphere is folded onto [-1,1]^2 and
+// stored as two 16 bit snorms
+inline uint32_t encodeOctahedral(glm::vec3 n)
+{
+	float l1_norm = glm::abs(n.x) + glm::abs(n.y) + glm::abs(n.z);
+	if (l1_norm == 0)
+	{
+		return glm::packSnorm2x16(glm::vec2(0, 0));
+	}
+	n /= l1_norm;
+	glm::vec2 oct(n.x, n.y);
+	if (n.z < 0)
+	{
+		oct = (1.0f - glm::abs(glm::vec2(n.y, n.x))) * glm::vec2(n.x >= 0 ? 1.0f : -1.0f, n.y >= 0 ? 1.0f : -1.0f);
+	}
+	return glm::packSnorm2x16(oct);
+}
+
+inline glm::vec3 decodeOctahedral(uint32_t encoded)
+{
+	glm::vec2 oct = glm::unpackSnorm2x16(encoded);
+	glm::vec3 n(oct.x, oct.y, 1.0f - glm::abs(oct.x) - glm::abs(oct.y));
+	if (n.z < 0)
+	{
+		float x = n.x;
+		n.x = (1.0f - glm::abs(n.y)) * (x >= 0 ? 1.0f : -1.0f);
+		n.y = (1.0f - glm::abs(x)) * (n.y >= 0 ? 1.0f : -1.0f);
+	}
+	return glm::normalize(n);
+}
@@ -0,0 +1,610 @@
+#include "bvh.h"
+#include "parallel.h"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <glm/geometric.hpp>
+
+// leaves hold up to this many primitives, bigger ranges are split further
+static constexpr uint32_t max_leaf_prims = 4;
+static constexpr int sah_bin_num = 16;
+
+// below this depth splits go through the SAH, deeper ones halve the largest
+// child so that the traversal stack cannot overflow
+static constexpr int max_sah_depth = 32;
+static constexpr int max_stack_size = (max_sah_depth + 40) * (bvh_width - 1) + 1;
+
+// subtrees with more primitives are built as separate thread pool jobs
+static constexpr uint32_t parallel_build_prims = 4096;
+
+struct SBVHChildRange
+{
+	uint32_t prim_begin;
+	uint32_t prim_end;
+	glm::vec3 bounds_min;
+	glm::vec3 bounds_max;
+
+	inline uint32_t count()const { return prim_end - prim_begin; }
+};
+
+struct SBVHBin
+{
+	glm::vec3 bounds_min = glm::vec3(std::numeric_limits<float>::max());
+	glm::vec3 bounds_max = glm::vec3(-std::numeric_limits<float>::max());
+	uint32_t count = 0;
+};
+
+static inline float halfArea(const glm::vec3& bounds_min, const glm::vec3& bounds_max)
+{
+	glm::vec3 extent = glm::max(bounds_max - bounds_min, glm::vec3(0.0f));
+	return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+}
+
+static inline glm::vec3 centroid(const SBVHBuildPrim& prim)
+{
+	return prim.bounds_min + prim.bounds_max;
+}
+
+static void rangeBounds(const SBVHBuildPrim* prims, SBVHChildRange& range)
+{
+	range.bounds_min = glm::vec3(std::numeric_limits<float>::max());
+	range.bounds_max = glm::vec3(-std::numeric_limits<float>::max());
+	for (uint32_t prim_idx = range.prim_begin; prim_idx < range.prim_end; prim_idx++)
+	{
+		range.bounds_min = glm::min(range.bounds_min, prims[prim_idx].bounds_min);
+		range.bounds_max = glm::max(range.bounds_max, prims[prim_idx].bounds_max);
+	}
+}
+
+// the middle element by centroid along the widest centroid axis, used when binning cannot separate the range
+static void medianSplit(SBVHBuildPrim* prims, const SBVHChildRange& range, SBVHChildRange& left, SBVHChildRange& right)
+{
+	glm::vec3 centroid_min(std::numeric_limits<float>::max());
+	glm::vec3 centroid_max(-std::numeric_limits<float>::max());
+	for (uint32_t prim_idx = range.prim_begin; prim_idx < range.prim_end; prim_idx++)
+	{
+		centroid_min = glm::min(centroid_min, centroid(prims[prim_idx]));
+		centroid_max = glm::max(centroid_max, centroid(prims[prim_idx]));
+	}
+	glm::vec3 extent = centroid_max - centroid_min;
+	int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+	uint32_t prim_mid = range.prim_begin + range.count() / 2;
+	std::nth_element(prims + range.prim_begin, prims + prim_mid, prims + range.prim_end, [axis](const SBVHBuildPrim& a, const SBVHBuildPrim& b) {
+		return centroid(a)[axis] < centroid(b)[axis];
+		});
+
+	left.prim_begin = range.prim_begin;
+	left.prim_end = prim_mid;
+	right.prim_begin = prim_mid;
+	right.prim_end = range.prim_end;
+	rangeBounds(prims, left);
+	rangeBounds(prims, right);
+}
+
+// Bins the centroids along the widest axis and partitions at the bin border
+// with the lowest surface area heuristic cost.
+static void sahSplit(SBVHBuildPrim* prims, const SBVHChildRange& range, SBVHChildRange& left, SBVHChildRange& right)
+{
+	glm::vec3 centroid_min(std::numeric_limits<float>::max());
+	glm::vec3 centroid_max(-std::numeric_limits<float>::max());
+	for (uint32_t prim_idx = range.prim_begin; prim_idx < range.prim_end; prim_idx++)
+	{
+		centroid_min = glm::min(centroid_min, centroid(prims[prim_idx]));
+		centroid_max = glm::max(centroid_max, centroid(prims[prim_idx]));
+	}
+	glm::vec3 extent = centroid_max - centroid_min;
+	int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+	if (!(extent[axis] > 0.0f))
+	{
+		medianSplit(prims, range, left, right);
+		return;
+	}
+
+	float bin_scale = sah_bin_num / extent[axis] * 0.9999f;
+	auto binIndex = [&](const SBVHBuildPrim& prim) {
+		return (std::min)(int((centroid(prim)[axis] - centroid_min[axis]) * bin_scale), sah_bin_num - 1);
+	};
+
+	SBVHBin bins[sah_bin_num];
+	for (uint32_t prim_idx = range.prim_begin; prim_idx < range.prim_end; prim_idx++)
+	{
+		SBVHBin& bin = bins[binIndex(prims[prim_idx])];
+		bin.bounds_min = glm::min(bin.bounds_min, prims[prim_idx].bounds_min);
+		bin.bounds_max = glm::max(bin.bounds_max, prims[prim_idx].bounds_max);
+		bin.count++;
+	}
+
+	// right to left sweep for the right side costs, then left to right for the split
+	float right_cost[sah_bin_num];
+	SBVHBin right_bin;
+	for (int bin_idx = sah_bin_num - 1; bin_idx > 0; bin_idx--)
+	{
+		right_bin.bounds_min = glm::min(right_bin.bounds_min, bins[bin_idx].bounds_min);
+		right_bin.bounds_max = glm::max(right_bin.bounds_max, bins[bin_idx].bounds_max);
+		right_bin.count += bins[bin_idx].count;
+		right_cost[bin_idx] = right_bin.count ? halfArea(right_bin.bounds_min, right_bin.bounds_max) * right_bin.count : 0.0f;
+	}
+
+	int best_split = -1;
+	float best_cost = std::numeric_limits<float>::max();
+	SBVHBin left_bin;
+	for (int bin_idx = 0; bin_idx < sah_bin_num - 1; bin_idx++)
+	{
+		left_bin.bounds_min = glm::min(left_bin.bounds_min, bins[bin_idx].bounds_min);
+		left_bin.bounds_max = glm::max(left_bin.bounds_max, bins[bin_idx].bounds_max);
+		left_bin.count += bins[bin_idx].count;
+		if (left_bin.count == 0 || left_bin.count == range.count())
+		{
+			continue;
+		}
+
+		float cost = halfArea(left_bin.bounds_min, left_bin.bounds_max) * left_bin.count + right_cost[bin_idx + 1];
+		if (cost < best_cost)
+		{
+			best_cost = cost;
+			best_split = bin_idx;
+		}
+	}
+
+	if (best_split < 0)
+	{
+		medianSplit(prims, range, left, right);
+		return;
+	}
+
+	SBVHBuildPrim* prim_mid = std::partition(prims + range.prim_begin, prims + range.prim_end, [&](const SBVHBuildPrim& prim) {
+		return binIndex(prim) <= best_split;
+		});
+
+	left.prim_begin = range.prim_begin;
+	left.prim_end = uint32_t(prim_mid - prims);
+	right.prim_begin = left.prim_end;
+	right.prim_end = range.prim_end;
+	rangeBounds(prims, left);
+	rangeBounds(prims, right);
+}
+
+void CWideBVH::addTriangles(uint32_t geom_id, const glm::vec3* positions, const uint32_t* indices, size_t triangle_count)
+{
+	for (size_t tri_idx = 0; tri_idx < triangle_count; tri_idx++)
+	{
+		glm::vec3 v0 = positions[indices[tri_idx * 3 + 0]];
+		glm::vec3 v1 = positions[indices[tri_idx * 3 + 1]];
+		glm::vec3 v2 = positions[indices[tri_idx * 3 + 2]];
+
+		SBVHBuildPrim build_prim;
+		build_prim.bounds_min = glm::min(v0, glm::min(v1, v2));
+		build_prim.bounds_max = glm::max(v0, glm::max(v1, v2));
+		build_prim.prim_idx = uint32_t(input_prims.size());
+		build_prim.pad = 0;
+
+		// Embree skips triangles with non finite vertices as well
+		if (!std::isfinite(build_prim.bounds_min.x + build_prim.bounds_min.y + build_prim.bounds_min.z + build_prim.bounds_max.x + build_prim.bounds_max.y + build_prim.bounds_max.z))
+		{
+			continue;
+		}
+
+		SLeafPrim leaf_prim;
+		leaf_prim.v0 = v0;
+		leaf_prim.geom_id = geom_id;
+		leaf_prim.edge1 = v1 - v0;
+		leaf_prim.prim_id = uint32_t(tri_idx);
+		leaf_prim.edge2 = v2 - v0;
+		leaf_prim.pad = 0;
+
+		build_prims.push_back(build_prim);
+		input_prims.push_back(leaf_prim);
+	}
+}
+
+uint32_t CWideBVH::addProcedural(const glm::vec3& prim_bounds_min, const glm::vec3& prim_bounds_max)
+{
+	uint32_t prim_id = procedural_num++;
+
+	SBVHBuildPrim build_prim;
+	build_prim.bounds_min = prim_bounds_min;
+	build_prim.bounds_max = prim_bounds_max;
+	build_prim.prim_idx = uint32_t(input_prims.size());
+	build_prim.pad = 0;
+	build_prims.push_back(build_prim);
+
+	SLeafPrim leaf_prim = {};
+	leaf_prim.geom_id = procedural_geom_id;
+	leaf_prim.prim_id = prim_id;
+	input_prims.push_back(leaf_prim);
+	return prim_id;
+}
+
+void CWideBVH::setProceduralFunctions(void* user_ptr, SIntersectFunc intersect_func, SOccludedFunc occluded_func)
+{
+	procedural_user_ptr = user_ptr;
+	procedural_intersect = intersect_func;
+	procedural_occluded = occluded_func;
+}
+
+void CWideBVH::build(bool parallel)
+{
+	uint32_t prim_count = uint32_t(build_prims.size());
+	if (prim_count == 0)
+	{
+		return;
+	}
+
+	// every node but the root holds more than max_leaf_prims primitives in at least two children
+	node_chunks.resize(prim_count / node_chunk_size + 2);
+	node_num = 0;
+	buildNode(allocateNode(), 0, prim_count, 0, parallel);
+
+	nodes.resize(node_num);
+	for (uint32_t node_idx = 0; node_idx < node_num; node_idx += node_chunk_size)
+	{
+		const TrackedVector<SNode, MC_BVH>& node_chunk = node_chunks[node_idx / node_chunk_size];
+		std::copy(node_chunk.begin(), node_chunk.begin() + (std::min)(node_chunk_size, node_num - node_idx), nodes.begin() + node_idx);
+	}
+	std::vector<TrackedVector<SNode, MC_BVH>>().swap(node_chunks);
+
+	leaf_prims.resize(prim_count);
+	for (uint32_t prim_idx = 0; prim_idx < prim_count; prim_idx++)
+	{
+		leaf_prims[prim_idx] = input_prims[build_prims[prim_idx].prim_idx];
+	}
+	TrackedVector<SBVHBuildPrim, MC_BVH>().swap(build_prims);
+	TrackedVector<SLeafPrim, MC_BVH>().swap(input_prims);
+}
+
+uint32_t CWideBVH::allocateNode()
+{
+	uint32_t node_idx = node_num.fetch_add(1);
+	std::lock_guard<std::mutex> lock(node_chunk_mutex);
+	TrackedVector<SNode, MC_BVH>& node_chunk = node_chunks[node_idx / node_chunk_size];
+	if (node_chunk.empty())
+	{
+		node_chunk.resize(node_chunk_size);
+	}
+	return node_idx;
+}
+
+void CWideBVH::buildNode(uint32_t node_idx, uint32_t prim_begin, uint32_t prim_end, int depth, bool parallel)
+{
+	SBVHChildRange child_ranges[bvh_width];
+	int child_num = 1;
+	child_ranges[0].prim_begin = prim_begin;
+	child_ranges[0].prim_end = prim_end;
+	rangeBounds(build_prims.data(), child_ranges[0]);
+
+	bool use_sah = depth < max_sah_depth;
+	while (child_num < bvh_width)
+	{
+		// the largest child by surface area, or by count past the SAH depth
+		int split_idx = -1;
+		float split_priority = -1.0f;
+		for (int child_idx = 0; child_idx < child_num; child_idx++)
+		{
+			const SBVHChildRange& child_range = child_ranges[child_idx];
+			float priority = use_sah ? halfArea(child_range.bounds_min, child_range.bounds_max) : float(child_range.count());
+			if (child_range.count() > max_leaf_prims && priority > split_priority)
+			{
+				split_idx = child_idx;
+				split_priority = priority;
+			}
+		}
+		if (split_idx < 0)
+		{
+			break;
+		}
+
+		SBVHChildRange left, right;
+		if (use_sah)
+		{
+			sahSplit(build_prims.data(), child_ranges[split_idx], left, right);
+		}
+		else
+		{
+			medianSplit(build_prims.data(), child_ranges[split_idx], left, right);
+		}
+		child_ranges[split_idx] = left;
+		child_ranges[child_num++] = right;
+	}
+
+	SNode& node = buildNodeAt(node_idx);
+	std::vector<std::unique_ptr<CAsyncJob>> subtree_jobs;
+	for (int child_idx = 0; child_idx < bvh_width; child_idx++)
+	{
+		if (child_idx >= child_num)
+		{
+			node.lower_x[child_idx] = node.lower_y[child_idx] = node.lower_z[child_idx] = std::numeric_limits<float>::infinity();
+			node.upper_x[child_idx] = node.upper_y[child_idx] = node.upper_z[child_idx] = -std::numeric_limits<float>::infinity();
+			node.children[child_idx] = empty_child;
+			node.prim_count[child_idx] = 0;
+			continue;
+		}
+
+		const SBVHChildRange& child_range = child_ranges[child_idx];
+		node.lower_x[child_idx] = child_range.bounds_min.x;
+		node.lower_y[child_idx] = child_range.bounds_min.y;
+		node.lower_z[child_idx] = child_range.bounds_min.z;
+		node.upper_x[child_idx] = child_range.bounds_max.x;
+		node.upper_y[child_idx] = child_range.bounds_max.y;
+		node.upper_z[child_idx] = child_range.bounds_max.z;
+
+		if (child_range.count() <= max_leaf_prims)
+		{
+			node.children[child_idx] = child_range.prim_begin;
+			node.prim_count[child_idx] = child_range.count();
+			continue;
+		}
+
+		uint32_t child_node_idx = allocateNode();
+		node.children[child_idx] = child_node_idx;
+		node.prim_count[child_idx] = 0;
+		if (parallel && child_range.count() > parallel_build_prims)
+		{
+			subtree_jobs.push_back(runAsync([this, child_node_idx, child_range, depth, parallel]() {
+				buildNode(child_node_idx, child_range.prim_begin, child_range.prim_end, depth + 1, parallel);
+				}));
+		}
+		else
+		{
+			buildNode(child_node_idx, child_range.prim_begin, child_range.prim_end, depth + 1, parallel);
+		}
+	}
+
+	for (std::unique_ptr<CAsyncJob>& subtree_job : subtree_jobs)
+	{
+		subtree_job->wait();
+	}
+}
+
+size_t CWideBVH::memoryBytes()const
+{
+	return nodes.capacity() * sizeof(SNode) + leaf_prims.capacity() * sizeof(SLeafPrim);
+}
+
+// The slab test of all children at once. The near plane of each axis is the
+// lower bound for a positive direction, so no min/max per axis is needed.
+struct CWideBVH::SRayBoxTest
+{
+	int near_x, near_y, near_z; // offset of the near bounds from lower_x, lower_y, lower_z
+	float tnear;
+#if defined(A7X_BVH_AVX2)
+	__m256 origin_x, origin_y, origin_z;
+	__m256 inv_x, inv_y, inv_z;
+#elif defined(A7X_BVH_SSE)
+	__m128 origin_x, origin_y, origin_z;
+	__m128 inv_x, inv_y, inv_z;
+#else
+	glm::vec3 origin;
+	glm::vec3 inv_direction;
+#endif
+
+	SRayBoxTest(const SBVHRay& ray)
+	{
+		// a zero component would give 0 * inf = NaN for a ray starting on a slab
+		glm::vec3 inv_direction;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float direction = ray.direction[axis];
+			inv_direction[axis] = 1.0f / (std::abs(direction) > 1e-20f ? direction : std::copysign(1e-20f, direction));
+		}
+		near_x = inv_direction.x >= 0.0f ? 0 : bvh_width;
+		near_y = inv_direction.y >= 0.0f ? 0 : bvh_width;
+		near_z = inv_direction.z >= 0.0f ? 0 : bvh_width;
+		tnear = ray.tnear;
+#if defined(A7X_BVH_AVX2)
+		origin_x = _mm256_set1_ps(ray.origin.x);
+		origin_y = _mm256_set1_ps(ray.origin.y);
+		origin_z = _mm256_set1_ps(ray.origin.z);
+		inv_x = _mm256_set1_ps(inv_direction.x);
+		inv_y = _mm256_set1_ps(inv_direction.y);
+		inv_z = _mm256_set1_ps(inv_direction.z);
+#elif defined(A7X_BVH_SSE)
+		origin_x = _mm_set1_ps(ray.origin.x);
+		origin_y = _mm_set1_ps(ray.origin.y);
+		origin_z = _mm_set1_ps(ray.origin.z);
+		inv_x = _mm_set1_ps(inv_direction.x);
+		inv_y = _mm_set1_ps(inv_direction.y);
+		inv_z = _mm_set1_ps(inv_direction.z);
+#else
+		origin = ray.origin;
+		this->inv_direction = inv_direction;
+#endif
+	}
+};
+
+uint32_t CWideBVH::childHitMask(const SNode& node, const SRayBoxTest& box_test, float tfar, float child_tnear[bvh_width])
+{
+	const float* near_x = node.lower_x + box_test.near_x;
+	const float* far_x = node.lower_x + (bvh_width - box_test.near_x);
+	const float* near_y = node.lower_y + box_test.near_y;
+	const float* far_y = node.lower_y + (bvh_width - box_test.near_y);
+	const float* near_z = node.lower_z + box_test.near_z;
+	const float* far_z = node.lower_z + (bvh_width - box_test.near_z);
+
+#if defined(A7X_BVH_AVX2)
+	__m256 tnear_x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_x), box_test.origin_x), box_test.inv_x);
+	__m256 tnear_y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_y), box_test.origin_y), box_test.inv_y);
+	__m256 tnear_z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_z), box_test.origin_z), box_test.inv_z);
+	__m256 tfar_x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_x), box_test.origin_x), box_test.inv_x);
+	__m256 tfar_y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_y), box_test.origin_y), box_test.inv_y);
+	__m256 tfar_z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_z), box_test.origin_z), box_test.inv_z);
+	__m256 box_tnear = _mm256_max_ps(_mm256_max_ps(tnear_x, tnear_y), _mm256_max_ps(tnear_z, _mm256_set1_ps(box_test.tnear)));
+	__m256 box_tfar = _mm256_min_ps(_mm256_min_ps(tfar_x, tfar_y), _mm256_min_ps(tfar_z, _mm256_set1_ps(tfar)));
+	_mm256_storeu_ps(child_tnear, box_tnear);
+	return uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(box_tnear, box_tfar, _CMP_LE_OQ)));
+#elif defined(A7X_BVH_SSE)
+	__m128 tnear_x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_x), box_test.origin_x), box_test.inv_x);
+	__m128 tnear_y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_y), box_test.origin_y), box_test.inv_y);
+	__m128 tnear_z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_z), box_test.origin_z), box_test.inv_z);
+	__m128 tfar_x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_x), box_test.origin_x), box_test.inv_x);
+	__m128 tfar_y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_y), box_test.origin_y), box_test.inv_y);
+	__m128 tfar_z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_z), box_test.origin_z), box_test.inv_z);
+	__m128 box_tnear = _mm_max_ps(_mm_max_ps(tnear_x, tnear_y), _mm_max_ps(tnear_z, _mm_set1_ps(box_test.tnear)));
+	__m128 box_tfar = _mm_min_ps(_mm_min_ps(tfar_x, tfar_y), _mm_min_ps(tfar_z, _mm_set1_ps(tfar)));
+	_mm_storeu_ps(child_tnear, box_tnear);
+	return uint32_t(_mm_movemask_ps(_mm_cmple_ps(box_tnear, box_tfar)));
+#else
+	uint32_t hit_mask = 0;
+	for (int child_idx = 0; child_idx < bvh_width; child_idx++)
+	{
+		float box_tnear = (std::max)((std::max)((near_x[child_idx] - box_test.origin.x) * box_test.inv_direction.x, (near_y[child_idx] - box_test.origin.y) * box_test.inv_direction.y),
+			(std::max)((near_z[child_idx] - box_test.origin.z) * box_test.inv_direction.z, box_test.tnear));
+		float box_tfar = (std::min)((std::min)((far_x[child_idx] - box_test.origin.x) * box_test.inv_direction.x, (far_y[child_idx] - box_test.origin.y) * box_test.inv_direction.y),
+			(std::min)((far_z[child_idx] - box_test.origin.z) * box_test.inv_direction.z, tfar));
+		child_tnear[child_idx] = box_tnear;
+		hit_mask |= box_tnear <= box_tfar ? (1u << child_idx) : 0u;
+	}
+	return hit_mask;
+#endif
+}
+
+// Moller-Trumbore, t has to lie strictly between tnear and tfar
+static inline bool intersectTriangle(const glm::vec3& v0, const glm::vec3& edge1, const glm::vec3& edge2, const SBVHRay& ray, float& hit_t)
+{
+	glm::vec3 p = glm::cross(ray.direction, edge2);
+	float det = glm::dot(edge1, p);
+	if (det == 0.0f)
+	{
+		return false;
+	}
+
+	float inv_det = 1.0f / det;
+	glm::vec3 s = ray.origin - v0;
+	float u = glm::dot(s, p) * inv_det;
+	if (u < 0.0f || u > 1.0f)
+	{
+		return false;
+	}
+
+	glm::vec3 q = glm::cross(s, edge1);
+	float v = glm::dot(ray.direction, q) * inv_det;
+	if (v < 0.0f || u + v > 1.0f)
+	{
+		return false;
+	}
+
+	hit_t = glm::dot(edge2, q) * inv_det;
+	return hit_t > ray.tnear && hit_t < ray.tfar;
+}
+
+struct SBVHStackEntry
+{
+	uint32_t child;
+	uint32_t prim_count;
+	float tnear;
+};
+
+bool CWideBVH::intersect(SBVHRay& ray, SBVHHit& hit)const
+{
+	if (nodes.empty())
+	{
+		return false;
+	}
+
+	SRayBoxTest box_test(ray);
+	SBVHStackEntry stack[max_stack_size];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, 0, ray.tnear };
+
+	bool found_hit = false;
+	while (stack_size > 0)
+	{
+		SBVHStackEntry entry = stack[--stack_size];
+		if (entry.tnear > ray.tfar)
+		{
+			continue;
+		}
+
+		if (entry.prim_count == 0)
+		{
+			const SNode& node = nodes[entry.child];
+			float child_tnear[bvh_width];
+			uint32_t hit_mask = childHitMask(node, box_test, ray.tfar, child_tnear);
+
+			// sorted so that the nearest child is on top of the stack
+			int first_pushed = stack_size;
+			while (hit_mask != 0)
+			{
+				int child_idx = std::countr_zero(hit_mask);
+				hit_mask &= hit_mask - 1;
+
+				SBVHStackEntry child_entry = { node.children[child_idx], node.prim_count[child_idx], child_tnear[child_idx] };
+				int insert_idx = stack_size++;
+				while (insert_idx > first_pushed && stack[insert_idx - 1].tnear < child_entry.tnear)
+				{
+					stack[insert_idx] = stack[insert_idx - 1];
+					insert_idx--;
+				}
+				stack[insert_idx] = child_entry;
+			}
+			continue;
+		}
+
+		for (uint32_t prim_idx = entry.child; prim_idx < entry.child + entry.prim_count; prim_idx++)
+		{
+			const SLeafPrim& leaf_prim = leaf_prims[prim_idx];
+			if (leaf_prim.geom_id == procedural_geom_id)
+			{
+				found_hit |= procedural_intersect(procedural_user_ptr, leaf_prim.prim_id, ray, hit);
+				continue;
+			}
+
+			float hit_t;
+			if (intersectTriangle(leaf_prim.v0, leaf_prim.edge1, leaf_prim.edge2, ray, hit_t))
+			{
+				ray.tfar = hit_t;
+				hit.t = hit_t;
+				hit.geom_id = leaf_prim.geom_id;
+				hit.prim_id = leaf_prim.prim_id;
+				hit.inst_id = SBVHHit::invalid_id;
+				hit.ng = glm::cross(leaf_prim.edge1, leaf_prim.edge2);
+				found_hit = true;
+			}
+		}
+	}
+	return found_hit;
+}
+
+bool CWideBVH::occluded(const SBVHRay& ray)const
+{
+	if (nodes.empty())
+	{
+		return false;
+	}
+
+	SRayBoxTest box_test(ray);
+	SBVHStackEntry stack[max_stack_size];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, 0, ray.tnear };
+
+	// any hit ends the traversal, so the order does not matter
+	while (stack_size > 0)
+	{
+		SBVHStackEntry entry = stack[--stack_size];
+		if (entry.prim_count == 0)
+		{
+			const SNode& node = nodes[entry.child];
+			float child_tnear[bvh_width];
+			uint32_t hit_mask = childHitMask(node, box_test, ray.tfar, child_tnear);
+			while (hit_mask != 0)
+			{
+				int child_idx = std::countr_zero(hit_mask);
+				hit_mask &= hit_mask - 1;
+				stack[stack_size++] = { node.children[child_idx], node.prim_count[child_idx], child_tnear[child_idx] };
+			}
+			continue;
+		}
+
+		for (uint32_t prim_idx = entry.child; prim_idx < entry.child + entry.prim_count; prim_idx++)
+		{
+			const SLeafPrim& leaf_prim = leaf_prims[prim_idx];
+			float hit_t;
+			if (leaf_prim.geom_id == procedural_geom_id ? procedural_occluded(procedural_user_ptr, leaf_prim.prim_id, ray) :
+				intersectTriangle(leaf_prim.v0, leaf_prim.edge1, leaf_prim.edge2, ray, hit_t))
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
@@ -0,0 +1,141 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <vector>
+#include <glm/vec3.hpp>
+
+#include "memory_tracker.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define A7X_BVH_AVX2
+#elif defined(_M_X64) || defined(__SSE2__)
+#include <xmmintrin.h>
+#define A7X_BVH_SSE
+#endif
+
+// 8 children per node where a ray can test them with one AVX2 instruction, 4 otherwise
+#if defined(A7X_BVH_AVX2)
+constexpr int bvh_width = 8;
+#else
+constexpr int bvh_width = 4;
+#endif
+
+struct SBVHRay
+{
+	glm::vec3 origin;
+	glm::vec3 direction;
+	float tnear;
+	float tfar; // shortened to the closest hit by intersect
+};
+
+struct SBVHHit
+{
+	float t;
+	uint32_t geom_id;
+	uint32_t prim_id;
+	uint32_t inst_id = invalid_id; // the procedural primitive the hit was forwarded through
+	glm::vec3 ng; // unnormalized geometric normal, in the space of the triangle's mesh
+
+	static constexpr uint32_t invalid_id = 0xFFFFFFFF;
+};
+
+// bounds of one primitive while the BVH is built
+struct SBVHBuildPrim
+{
+	glm::vec3 bounds_min;
+	uint32_t prim_idx;
+	glm::vec3 bounds_max;
+	uint32_t pad;
+};
+
+// A wide BVH over triangle meshes and procedural primitives, the in-tree
+// alternative to Embree. The build bins the primitive centroids along the
+// widest axis and takes the SAH cheapest split; a node gets its bvh_width
+// children by splitting the child with the largest surface area until it has
+// enough. Large subtrees are built as thread pool jobs. Triangles are copied
+// into leaf order, so the mesh buffers are only read during the build.
+class CWideBVH
+{
+public:
+	// procedural primitives are intersected by callbacks; intersect shortens
+	// ray.tfar and fills the hit when it finds a closer one
+	using SIntersectFunc = bool (*)(void* user_ptr, uint32_t prim_id, SBVHRay& ray, SBVHHit& hit);
+	using SOccludedFunc = bool (*)(void* user_ptr, uint32_t prim_id, const SBVHRay& ray);
+
+	// three indices per triangle; the geometry ID is returned in the hits
+	void addTriangles(uint32_t geom_id, const glm::vec3* positions, const uint32_t* indices, size_t triangle_count);
+
+	// returns the prim_id the callbacks receive
+	uint32_t addProcedural(const glm::vec3& bounds_min, const glm::vec3& bounds_max);
+	void setProceduralFunctions(void* user_ptr, SIntersectFunc intersect_func, SOccludedFunc occluded_func);
+
+	// parallel: subtrees are built on the thread pool; not from inside a job
+	// that holds a lock other jobs may need
+	void build(bool parallel);
+
+	bool intersect(SBVHRay& ray, SBVHHit& hit)const;
+	bool occluded(const SBVHRay& ray)const;
+
+	inline size_t primitiveCount()const { return leaf_prims.size(); }
+	inline size_t nodeCount()const { return nodes.size(); }
+	size_t memoryBytes()const;
+
+private:
+	// SoA child bounds; empty slots have inverted bounds, which no ray hits
+	struct alignas(32) SNode
+	{
+		float lower_x[bvh_width];
+		float upper_x[bvh_width];
+		float lower_y[bvh_width];
+		float upper_y[bvh_width];
+		float lower_z[bvh_width];
+		float upper_z[bvh_width];
+
+		// a node index, or for a leaf the first of prim_count primitives in leaf_prims
+		uint32_t children[bvh_width];
+		uint32_t prim_count[bvh_width];
+	};
+
+	// a triangle as its first vertex and two edges, ready for the intersection test;
+	// procedural primitives have geom_id == procedural_geom_id
+	struct SLeafPrim
+	{
+		glm::vec3 v0;
+		uint32_t geom_id;
+		glm::vec3 edge1;
+		uint32_t prim_id;
+		glm::vec3 edge2;
+		uint32_t pad;
+	};
+
+	// the ray's SIMD constants, defined with the traversal
+	struct SRayBoxTest;
+
+	static constexpr uint32_t procedural_geom_id = 0xFFFFFFFF;
+	static constexpr uint32_t empty_child = 0xFFFFFFFF;
+
+	void buildNode(uint32_t node_idx, uint32_t prim_begin, uint32_t prim_end, int depth, bool parallel);
+	uint32_t allocateNode();
+	inline SNode& buildNodeAt(uint32_t node_idx) { return node_chunks[node_idx / node_chunk_size][node_idx % node_chunk_size]; }
+	static uint32_t childHitMask(const SNode& node, const SRayBoxTest& box_test, float tfar, float child_tnear[bvh_width]);
+
+	TrackedVector<SBVHBuildPrim, MC_BVH> build_prims;
+	TrackedVector<SLeafPrim, MC_BVH> input_prims;
+	TrackedVector<SLeafPrim, MC_BVH> leaf_prims;
+	TrackedVector<SNode, MC_BVH> nodes;
+
+	// The build allocates nodes in chunks, so parallel subtrees never move each
+	// other's nodes; they are copied into nodes at the end.
+	static constexpr uint32_t node_chunk_size = 4096;
+	std::vector<TrackedVector<SNode, MC_BVH>> node_chunks;
+	std::atomic<uint32_t> node_num = 0;
+	std::mutex node_chunk_mutex;
+
+	uint32_t procedural_num = 0;
+	void* procedural_user_ptr = nullptr;
+	SIntersectFunc procedural_intersect = nullptr;
+	SOccludedFunc procedural_occluded = nullptr;
+};
@@ -7,10 +7,16 @@ class CPerspectiveCamera
 {
 public:
 	CPerspectiveCamera(glm::mat4x4 tran_mat, float ipt_fov, CRGBFilm* ipt_rgb_film)
-		:camera_to_world(tran_mat)
-		, fov(ipt_fov)
-		, rgb_film(ipt_rgb_film) 
+		: rgb_film(ipt_rgb_film)
 	{
+		setTransform(tran_mat, ipt_fov);
+	}
+
+	// moves the camera, e.g. between renders of a session
+	void setTransform(glm::mat4x4 tran_mat, float ipt_fov)
+	{
+		camera_to_world = tran_mat;
+		fov = ipt_fov;
 
 		// tran_mat = camera from world
 		glm::mat4 world_from_camera = glm::inverse(tran_mat);
@@ -0,0 +1,137 @@
+#include "checkpoint.h"
+#include <cstring>
+#include <filesystem>
+
+static const char checkpoint_magic[8] = { 'A', '7', 'X', 'C', 'K', 'P', 'T', '1' };
+
+CCheckpointWriter::CCheckpointWriter(const std::string& file_name, const SCheckpointHeader& header, int completed_passes)
+	: file_name(file_name)
+	, temp_file_name(file_name + ".tmp")
+{
+	file = fopen(temp_file_name.c_str(), "wb");
+	failed = (file == nullptr);
+
+	int32_t passes = completed_passes;
+	write(checkpoint_magic, sizeof(checkpoint_magic));
+	write(&header.integrator_type, sizeof(header.integrator_type));
+	write(&header.scene_hash, sizeof(header.scene_hash));
+	write(&header.width, sizeof(header.width));
+	write(&header.height, sizeof(header.height));
+	write(&passes, sizeof(passes));
+}
+
+CCheckpointWriter::~CCheckpointWriter()
+{
+	if (file)
+	{
+		fclose(file);
+		std::error_code error;
+		std::filesystem::remove(temp_file_name, error);
+	}
+}
+
+void CCheckpointWriter::write(const void* data, size_t bytes)
+{
+	if (!failed && fwrite(data, 1, bytes, file) != bytes)
+	{
+		failed = true;
+	}
+}
+
+bool CCheckpointWriter::commit()
+{
+	if (!file)
+	{
+		printf("cannot write checkpoint %s\n", temp_file_name.c_str());
+		return false;
+	}
+
+	failed |= (fflush(file) != 0);
+	failed |= (fclose(file) != 0);
+	file = nullptr;
+
+	std::error_code error;
+	if (!failed)
+	{
+		// replaces the old checkpoint in one step
+		std::filesystem::rename(temp_file_name, file_name, error);
+	}
+	if (failed || error)
+	{
+		printf("cannot write checkpoint %s\n", file_name.c_str());
+		std::filesystem::remove(temp_file_name, error);
+		return false;
+	}
+	return true;
+}
+
+CCheckpointReader::~CCheckpointReader()
+{
+	if (file)
+	{
+		fclose(file);
+	}
+}
+
+bool CCheckpointReader::open(const std::string& file_name, const SCheckpointHeader& expected_header, int& completed_passes)
+{
+	if (!std::filesystem::exists(file_name))
+	{
+		printf("no checkpoint %s, starting from the beginning\n", file_name.c_str());
+		return false;
+	}
+
+	SCheckpointHeader header;
+	if (!readHeader(file_name, header, completed_passes) ||
+		header.integrator_type != expected_header.integrator_type ||
+		header.scene_hash != expected_header.scene_hash ||
+		header.width != expected_header.width ||
+		header.height != expected_header.height)
+	{
+		printf("checkpoint %s belongs to another scene or integrator, starting from the beginning\n", file_name.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool CCheckpointReader::readHeader(const std::string& file_name, SCheckpointHeader& header, int& completed_passes)
+{
+	file = fopen(file_name.c_str(), "rb");
+	if (!file)
+	{
+		return false;
+	}
+
+	char magic[sizeof(checkpoint_magic)];
+	int32_t passes = 0;
+	bool header_read = read(magic, sizeof(magic)) &&
+		read(&header.integrator_type, sizeof(header.integrator_type)) &&
+		read(&header.scene_hash, sizeof(header.scene_hash)) &&
+		read(&header.width, sizeof(header.width)) &&
+		read(&header.height, sizeof(header.height)) &&
+		read(&passes, sizeof(passes));
+	if (!header_read || memcmp(magic, checkpoint_magic, sizeof(magic)) != 0)
+	{
+		return false;
+	}
+
+	completed_passes = passes;
+	return true;
+}
+
+bool CCheckpointReader::read(void* data, size_t bytes)
+{
+	return fread(data, 1, bytes, file) == bytes;
+}
+
+bool CCheckpointReader::finish()
+{
+	char extra_byte;
+	return fread(&extra_byte, 1, 1, file) == 0 && feof(file);
+}
+
+void removeCheckpoint(const std::string& file_name)
+{
+	std::error_code error;
+	std::filesystem::remove(file_name, error);
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+enum ECheckpointIntegrator
+{
+	CI_Path,
+	CI_SPPM,
+	CI_FilmShard, // accumulated samples of an --spp_range, combined by --merge_shards
+};
+
+// identifies the render a checkpoint belongs to
+struct SCheckpointHeader
+{
+	uint32_t integrator_type;
+	uint64_t scene_hash;
+	uint32_t width;
+	uint32_t height;
+};
+
+// Writes to <file_name>.tmp and renames it over the checkpoint on commit, so a
+// node preempted while writing still leaves the previous checkpoint intact.
+class CCheckpointWriter
+{
+public:
+	CCheckpointWriter(const std::string& file_name, const SCheckpointHeader& header, int completed_passes);
+	~CCheckpointWriter();
+
+	void write(const void* data, size_t bytes);
+
+	template<typename T, typename Alloc>
+	void writeVector(const std::vector<T, Alloc>& values) { write(values.data(), values.size() * sizeof(T)); }
+
+	bool commit();
+
+private:
+	std::string file_name;
+	std::string temp_file_name;
+	FILE* file;
+	bool failed = false;
+};
+
+// Reads a checkpoint written by CCheckpointWriter; the vectors must already
+// have the size they were written with.
+class CCheckpointReader
+{
+public:
+	~CCheckpointReader();
+
+	// fails if the file is missing, truncated or belongs to another render
+	bool open(const std::string& file_name, const SCheckpointHeader& expected_header, int& completed_passes);
+
+	// reads the header of any checkpoint, for callers that check it themselves
+	bool readHeader(const std::string& file_name, SCheckpointHeader& header, int& completed_passes);
+
+	bool read(void* data, size_t bytes);
+
+	template<typename T, typename Alloc>
+	bool readVector(std::vector<T, Alloc>& values) { return read(values.data(), values.size() * sizeof(T)); }
+
+	// true if everything was read and nothing is left over
+	bool finish();
+
+private:
+	FILE* file = nullptr;
+};
+
+void removeCheckpoint(const std::string& file_name);
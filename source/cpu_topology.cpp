@@ -0,0 +1,393 @@
+#include "cpu_topology.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(__linux__)
+// parses a sysfs cpu list such as "0-7,16-23"
+static std::vector<int> parseCpuList(const std::string& cpu_list)
+{
+	std::vector<int> cpus;
+	size_t pos = 0;
+	while (pos < cpu_list.size())
+	{
+		size_t end = cpu_list.find(',', pos);
+		if (end == std::string::npos)
+		{
+			end = cpu_list.size();
+		}
+
+		std::string range = cpu_list.substr(pos, end - pos);
+		size_t dash = range.find('-');
+		if (!range.empty() && isdigit(range[0]))
+		{
+			int first_cpu = std::stoi(range);
+			int last_cpu = dash == std::string::npos ? first_cpu : std::stoi(range.substr(dash + 1));
+			for (int cpu = first_cpu; cpu <= last_cpu; cpu++)
+			{
+				cpus.push_back(cpu);
+			}
+		}
+		pos = end + 1;
+	}
+	return cpus;
+}
+#endif
+
+static int findCpuNode(const SCpuTopology& topology, int cpu)
+{
+	for (size_t node = 0; node < topology.node_cpus.size(); node++)
+	{
+		const std::vector<int>& cpus = topology.node_cpus[node];
+		if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end())
+		{
+			return int(node);
+		}
+	}
+	return 0;
+}
+
+// groups the logical processors of the nodes into physical cores
+static void detectCores(SCpuTopology& topology)
+{
+	std::vector<int> all_cpus;
+	for (const std::vector<int>& cpus : topology.node_cpus)
+	{
+		all_cpus.insert(all_cpus.end(), cpus.begin(), cpus.end());
+	}
+
+#if defined(_WIN32)
+	DWORD buffer_size = 0;
+	GetLogicalProcessorInformationEx(RelationProcessorCore, nullptr, &buffer_size);
+	std::vector<char> buffer(buffer_size);
+	if (buffer_size > 0 && GetLogicalProcessorInformationEx(RelationProcessorCore, (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)buffer.data(), &buffer_size))
+	{
+		for (DWORD offset = 0; offset < buffer_size;)
+		{
+			const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX* info = (const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)(buffer.data() + offset);
+			std::vector<int> siblings;
+			for (WORD group_idx = 0; group_idx < info->Processor.GroupCount; group_idx++)
+			{
+				const GROUP_AFFINITY& group_affinity = info->Processor.GroupMask[group_idx];
+				for (int bit = 0; bit < 64; bit++)
+				{
+					int cpu = group_affinity.Group * 64 + bit;
+					if ((group_affinity.Mask & (KAFFINITY(1) << bit)) && std::find(all_cpus.begin(), all_cpus.end(), cpu) != all_cpus.end())
+					{
+						siblings.push_back(cpu);
+					}
+				}
+			}
+			if (!siblings.empty())
+			{
+				topology.core_cpus.push_back(siblings);
+			}
+			offset += info->Size;
+		}
+	}
+#elif defined(__linux__)
+	std::vector<bool> assigned;
+	for (int cpu : all_cpus)
+	{
+		if (size_t(cpu) < assigned.size() && assigned[cpu])
+		{
+			continue;
+		}
+
+		std::ifstream siblings_file("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list");
+		std::string sibling_list;
+		std::getline(siblings_file, sibling_list);
+
+		std::vector<int> siblings;
+		for (int sibling : parseCpuList(sibling_list))
+		{
+			// offline siblings and siblings outside of the process affinity mask are skipped
+			if (std::find(all_cpus.begin(), all_cpus.end(), sibling) != all_cpus.end())
+			{
+				siblings.push_back(sibling);
+			}
+		}
+		if (siblings.empty())
+		{
+			siblings.push_back(cpu);
+		}
+
+		for (int sibling : siblings)
+		{
+			if (size_t(sibling) >= assigned.size())
+			{
+				assigned.resize(sibling + 1, false);
+			}
+			assigned[sibling] = true;
+		}
+		topology.core_cpus.push_back(siblings);
+	}
+#endif
+
+	// no SMT information: every logical processor is its own core
+	if (topology.core_cpus.empty())
+	{
+		for (int cpu : all_cpus)
+		{
+			topology.core_cpus.push_back({ cpu });
+		}
+	}
+
+	std::stable_sort(topology.core_cpus.begin(), topology.core_cpus.end(), [&](const std::vector<int>& a, const std::vector<int>& b)
+		{
+			int node_a = findCpuNode(topology, a[0]);
+			int node_b = findCpuNode(topology, b[0]);
+			return node_a != node_b ? node_a < node_b : a[0] < b[0];
+		});
+}
+
+// Drops the processors the process may not run on, e.g. under taskset, numactl
+// or a container cpuset, and the nodes left without any processor.
+static void applyProcessAffinity(SCpuTopology& topology)
+{
+	std::vector<bool> allowed;
+#if defined(_WIN32)
+	USHORT group_count = 0;
+	GetProcessGroupAffinity(GetCurrentProcess(), &group_count, nullptr);
+	std::vector<USHORT> groups(group_count);
+	if (group_count == 0 || !GetProcessGroupAffinity(GetCurrentProcess(), &group_count, groups.data()))
+	{
+		return;
+	}
+
+	// the process affinity mask is only defined while the process is in one group
+	DWORD_PTR process_mask = 0, system_mask = 0;
+	if (group_count > 1 || !GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+	{
+		process_mask = ~DWORD_PTR(0);
+	}
+	for (USHORT group : groups)
+	{
+		for (int bit = 0; bit < 64; bit++)
+		{
+			if (process_mask & (DWORD_PTR(1) << bit))
+			{
+				size_t cpu = size_t(group) * 64 + bit;
+				if (cpu >= allowed.size())
+				{
+					allowed.resize(cpu + 1, false);
+				}
+				allowed[cpu] = true;
+			}
+		}
+	}
+#elif defined(__linux__)
+	cpu_set_t cpu_set;
+	CPU_ZERO(&cpu_set);
+	if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) != 0)
+	{
+		return;
+	}
+	allowed.resize(CPU_SETSIZE, false);
+	for (size_t cpu = 0; cpu < allowed.size(); cpu++)
+	{
+		allowed[cpu] = CPU_ISSET(cpu, &cpu_set);
+	}
+#else
+	return;
+#endif
+
+	std::vector<std::vector<int>> node_cpus;
+	for (const std::vector<int>& cpus : topology.node_cpus)
+	{
+		std::vector<int> allowed_cpus;
+		for (int cpu : cpus)
+		{
+			if (size_t(cpu) < allowed.size() && allowed[cpu])
+			{
+				allowed_cpus.push_back(cpu);
+			}
+		}
+		if (!allowed_cpus.empty())
+		{
+			node_cpus.push_back(allowed_cpus);
+		}
+	}
+
+	// keep the detected processors rather than none if the mask matches nothing
+	if (!node_cpus.empty())
+	{
+		topology.node_cpus = node_cpus;
+	}
+}
+
+static SCpuTopology detectCpuTopology()
+{
+	SCpuTopology topology;
+
+#if defined(_WIN32)
+	ULONG highest_node = 0;
+	if (GetNumaHighestNodeNumber(&highest_node))
+	{
+		for (USHORT node = 0; node <= highest_node; node++)
+		{
+			GROUP_AFFINITY group_affinity = {};
+			if (!GetNumaNodeProcessorMaskEx(node, &group_affinity))
+			{
+				continue;
+			}
+
+			std::vector<int> cpus;
+			for (int bit = 0; bit < 64; bit++)
+			{
+				if (group_affinity.Mask & (KAFFINITY(1) << bit))
+				{
+					cpus.push_back(group_affinity.Group * 64 + bit);
+				}
+			}
+			if (!cpus.empty())
+			{
+				topology.node_cpus.push_back(cpus);
+			}
+		}
+	}
+#elif defined(__linux__)
+	// node directories are not necessarily numbered contiguously
+	std::vector<int> nodes;
+	std::error_code error;
+	for (const auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node", error))
+	{
+		std::string name = entry.path().filename().string();
+		if (name.size() > 4 && name.compare(0, 4, "node") == 0 && isdigit(name[4]))
+		{
+			nodes.push_back(std::stoi(name.substr(4)));
+		}
+	}
+	std::sort(nodes.begin(), nodes.end());
+
+	for (int node : nodes)
+	{
+		std::ifstream cpu_list_file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+		std::string cpu_list;
+		std::getline(cpu_list_file, cpu_list);
+		std::vector<int> cpus = parseCpuList(cpu_list);
+		if (!cpus.empty())
+		{
+			topology.node_cpus.push_back(cpus);
+		}
+	}
+#endif
+
+	if (topology.node_cpus.empty())
+	{
+		std::vector<int> cpus((std::max)(int(std::thread::hardware_concurrency()), 1));
+		for (size_t cpu = 0; cpu < cpus.size(); cpu++)
+		{
+			cpus[cpu] = int(cpu);
+		}
+		topology.node_cpus.push_back(cpus);
+	}
+
+	applyProcessAffinity(topology);
+	detectCores(topology);
+	return topology;
+}
+
+const SCpuTopology& getCpuTopology()
+{
+	static SCpuTopology topology = detectCpuTopology();
+	return topology;
+}
+
+std::vector<int> getAffinityCpuOrder(EThreadAffinity affinity)
+{
+	const SCpuTopology& topology = getCpuTopology();
+	std::vector<int> cpu_order;
+	switch (affinity)
+	{
+	case TA_Compact:
+		for (const std::vector<int>& siblings : topology.core_cpus)
+		{
+			cpu_order.insert(cpu_order.end(), siblings.begin(), siblings.end());
+		}
+		break;
+	case TA_PhysicalCores:
+		for (const std::vector<int>& siblings : topology.core_cpus)
+		{
+			cpu_order.push_back(siblings[0]);
+		}
+		break;
+	case TA_Scatter:
+	{
+		// cores are sorted by node, so each node is a contiguous range of cores
+		std::vector<std::vector<const std::vector<int>*>> node_cores(topology.node_cpus.size());
+		size_t max_siblings = 0, max_cores = 0;
+		for (const std::vector<int>& siblings : topology.core_cpus)
+		{
+			std::vector<const std::vector<int>*>& cores = node_cores[findCpuNode(topology, siblings[0])];
+			cores.push_back(&siblings);
+			max_siblings = (std::max)(max_siblings, siblings.size());
+			max_cores = (std::max)(max_cores, cores.size());
+		}
+
+		for (size_t sibling_idx = 0; sibling_idx < max_siblings; sibling_idx++)
+		{
+			for (size_t core_idx = 0; core_idx < max_cores; core_idx++)
+			{
+				for (const std::vector<const std::vector<int>*>& cores : node_cores)
+				{
+					if (core_idx < cores.size() && sibling_idx < cores[core_idx]->size())
+					{
+						cpu_order.push_back((*cores[core_idx])[sibling_idx]);
+					}
+				}
+			}
+		}
+		break;
+	}
+	default:
+		break;
+	}
+	return cpu_order;
+}
+
+int getCpuNumaNode(int cpu)
+{
+	return findCpuNode(getCpuTopology(), cpu);
+}
+
+bool pinCurrentThread(const std::vector<int>& cpus)
+{
+	if (cpus.empty())
+	{
+		return false;
+	}
+
+#if defined(_WIN32)
+	// a thread can only run in one processor group
+	GROUP_AFFINITY group_affinity = {};
+	group_affinity.Group = WORD(cpus[0] / 64);
+	for (int cpu : cpus)
+	{
+		if (cpu / 64 == group_affinity.Group)
+		{
+			group_affinity.Mask |= KAFFINITY(1) << (cpu % 64);
+		}
+	}
+	return SetThreadGroupAffinity(GetCurrentThread(), &group_affinity, nullptr) != 0;
+#elif defined(__linux__)
+	cpu_set_t cpu_set;
+	CPU_ZERO(&cpu_set);
+	for (int cpu : cpus)
+	{
+		CPU_SET(cpu, &cpu_set);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) == 0;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <vector>
+
+// logical processors grouped by NUMA node and by physical core, detected once
+struct SCpuTopology
+{
+	std::vector<std::vector<int>> node_cpus;
+
+	// SMT siblings of each physical core, sorted by node and core
+	std::vector<std::vector<int>> core_cpus;
+};
+
+enum EThreadAffinity
+{
+	TA_None,	// the OS places and migrates the threads
+	TA_Compact,	// fill every SMT sibling of a core before moving to the next core
+	TA_Scatter,	// one thread per core round robin over the nodes, SMT siblings last
+	TA_PhysicalCores, // one thread per physical core, SMT siblings stay idle
+};
+
+const SCpuTopology& getCpuTopology();
+
+// order in which the thread pool assigns logical processors to its threads
+std::vector<int> getAffinityCpuOrder(EThreadAffinity affinity);
+
+// NUMA node of a logical processor, 0 if unknown
+int getCpuNumaNode(int cpu);
+
+// restricts the calling thread to the given logical processors
+bool pinCurrentThread(const std::vector<int>& cpus);
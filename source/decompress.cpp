@@ -0,0 +1,337 @@
+#include "decompress.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(A7X_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+#if defined(A7X_HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+static constexpr size_t decompress_chunk_size = 4 << 20;
+static constexpr size_t compressed_read_size = 1 << 20;
+
+// bounds the decompressed data waiting for the consumer
+static constexpr size_t max_ready_chunks = 4;
+
+ECompression detectCompression(const std::string& file_name)
+{
+	FILE* file = fopen(file_name.c_str(), "rb");
+	if (!file)
+	{
+		return CP_None;
+	}
+
+	unsigned char magic[4] = {};
+	size_t magic_size = fread(magic, 1, 4, file);
+	fclose(file);
+
+	if (magic_size >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+	{
+		return CP_Gzip;
+	}
+	if (magic_size == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+	{
+		return CP_Zstd;
+	}
+	return CP_None;
+}
+
+std::unique_ptr<CDecompressStream> CDecompressStream::open(const std::string& file_name, bool line_aligned)
+{
+	ECompression compression = detectCompression(file_name);
+
+#if !defined(A7X_HAVE_ZLIB)
+	if (compression == CP_Gzip)
+	{
+		printf("%s: gzip input requires building with zlib\n", file_name.c_str());
+		return nullptr;
+	}
+#endif
+
+#if !defined(A7X_HAVE_ZSTD)
+	if (compression == CP_Zstd)
+	{
+		printf("%s: zstd input requires building with zstd\n", file_name.c_str());
+		return nullptr;
+	}
+#endif
+
+	FILE* file = fopen(file_name.c_str(), "rb");
+	if (!file)
+	{
+		return nullptr;
+	}
+	return std::unique_ptr<CDecompressStream>(new CDecompressStream(file, compression, line_aligned));
+}
+
+CDecompressStream::CDecompressStream(FILE* file, ECompression compression, bool line_aligned)
+	: file(file)
+	, compression(compression)
+	, line_aligned(line_aligned)
+{
+	decompress_thread = std::thread(&CDecompressStream::decompress, this);
+}
+
+CDecompressStream::~CDecompressStream()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		cancelled = true;
+		condition.notify_all();
+	}
+	decompress_thread.join();
+	fclose(file);
+}
+
+std::vector<char> CDecompressStream::nextChunk()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	condition.wait(lock, [&]() { return !ready_chunks.empty() || finished; });
+	if (ready_chunks.empty())
+	{
+		return std::vector<char>();
+	}
+
+	std::vector<char> chunk = std::move(ready_chunks.front());
+	ready_chunks.pop_front();
+	condition.notify_all();
+	return chunk;
+}
+
+bool CDecompressStream::failed()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return data_error;
+}
+
+size_t CDecompressStream::read(void* dst, size_t size)
+{
+	size_t read_size = 0;
+	while (read_size < size)
+	{
+		if (read_pos == read_chunk.size())
+		{
+			read_chunk = nextChunk();
+			read_pos = 0;
+			if (read_chunk.empty())
+			{
+				break;
+			}
+		}
+
+		size_t copy_size = (std::min)(size - read_size, read_chunk.size() - read_pos);
+		memcpy((char*)dst + read_size, read_chunk.data() + read_pos, copy_size);
+		read_pos += copy_size;
+		read_size += copy_size;
+	}
+	return read_size;
+}
+
+// Hands the complete lines of block to the consumer and keeps the unfinished
+// last line in block. Returns false once the consumer has gone away.
+bool CDecompressStream::pushOutput(std::vector<char>& block, bool final_block)
+{
+	std::vector<char> chunk;
+	if (final_block || !line_aligned)
+	{
+		chunk = std::move(block);
+		block.clear();
+	}
+	else
+	{
+		auto line_end = std::find(block.rbegin(), block.rend(), '\n');
+		if (line_end == block.rend())
+		{
+			return true;
+		}
+
+		size_t split = block.rend() - line_end;
+		chunk = std::move(block);
+		block.assign(chunk.begin() + split, chunk.end());
+		chunk.resize(split);
+	}
+
+	if (chunk.empty())
+	{
+		return true;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	condition.wait(lock, [&]() { return ready_chunks.size() < max_ready_chunks || cancelled; });
+	if (cancelled)
+	{
+		return false;
+	}
+	ready_chunks.push_back(std::move(chunk));
+	condition.notify_all();
+	return true;
+}
+
+void CDecompressStream::decompress()
+{
+	std::vector<char> input(compressed_read_size);
+	size_t input_size = 0;
+	size_t input_pos = 0;
+	bool input_end = false;
+
+	std::vector<char> block(decompress_chunk_size);
+	size_t block_size = 0;
+
+#if defined(A7X_HAVE_ZLIB)
+	z_stream z_strm = {};
+	if (compression == CP_Gzip)
+	{
+		// 15 + 32: zlib or gzip header, detected automatically
+		inflateInit2(&z_strm, 15 + 32);
+	}
+#endif
+
+#if defined(A7X_HAVE_ZSTD)
+	ZSTD_DStream* zstd_strm = nullptr;
+	if (compression == CP_Zstd)
+	{
+		zstd_strm = ZSTD_createDStream();
+		ZSTD_initDStream(zstd_strm);
+	}
+#endif
+
+	bool output_full = false;
+	bool stream_end = false;
+	bool decode_error = false;
+
+	// the decoder has taken data of a gzip member or zstd frame it has not finished
+	bool frame_open = false;
+	while (!stream_end)
+	{
+		// the decoder may still hold output for the current input when it filled the block
+		if (input_pos == input_size && !output_full)
+		{
+			input_size = input_end ? 0 : fread(input.data(), 1, input.size(), file);
+			input_pos = 0;
+			input_end = input_size == 0;
+		}
+
+		if (block_size == block.size())
+		{
+			block.resize(block_size);
+			if (!pushOutput(block, false))
+			{
+				break;
+			}
+
+			// a line longer than a chunk keeps growing the block
+			block_size = block.size();
+			block.resize((std::max)(decompress_chunk_size, block_size * 2));
+		}
+
+		char* output = block.data() + block_size;
+		size_t output_capacity = block.size() - block_size;
+		size_t output_size = 0;
+
+		switch (compression)
+		{
+		case CP_None:
+		{
+			output_size = (std::min)(output_capacity, input_size - input_pos);
+			memcpy(output, input.data() + input_pos, output_size);
+			input_pos += output_size;
+			stream_end = input_end;
+			break;
+		}
+#if defined(A7X_HAVE_ZLIB)
+		case CP_Gzip:
+		{
+			z_strm.next_in = (Bytef*)input.data() + input_pos;
+			z_strm.avail_in = uInt(input_size - input_pos);
+			z_strm.next_out = (Bytef*)output;
+			z_strm.avail_out = uInt((std::min)(output_capacity, size_t(1) << 30));
+			size_t input_begin = input_pos;
+			int ret = inflate(&z_strm, Z_NO_FLUSH);
+			input_pos = input_size - z_strm.avail_in;
+			output_size = (char*)z_strm.next_out - output;
+
+			if (ret == Z_STREAM_END)
+			{
+				// concatenated gzip members
+				inflateReset(&z_strm);
+				frame_open = false;
+			}
+			else if (ret != Z_OK && ret != Z_BUF_ERROR)
+			{
+				printf("gzip error: %s\n", z_strm.msg ? z_strm.msg : "corrupt data");
+				decode_error = true;
+				stream_end = true;
+			}
+			else if (input_pos != input_begin || output_size > 0)
+			{
+				frame_open = true;
+			}
+			stream_end |= input_end && input_pos == input_size && output_size == 0;
+			break;
+		}
+#endif
+#if defined(A7X_HAVE_ZSTD)
+		case CP_Zstd:
+		{
+			ZSTD_inBuffer zstd_in = { input.data(), input_size, input_pos };
+			ZSTD_outBuffer zstd_out = { output, output_capacity, 0 };
+			size_t input_begin = input_pos;
+			size_t ret = ZSTD_decompressStream(zstd_strm, &zstd_out, &zstd_in);
+			input_pos = zstd_in.pos;
+			output_size = zstd_out.pos;
+
+			if (ZSTD_isError(ret))
+			{
+				printf("zstd error: %s\n", ZSTD_getErrorName(ret));
+				decode_error = true;
+				stream_end = true;
+			}
+			else if (input_pos != input_begin || output_size > 0)
+			{
+				// 0 once a frame is decoded and flushed completely
+				frame_open = ret != 0;
+			}
+			stream_end |= input_end && input_pos == input_size && output_size == 0;
+			break;
+		}
+#endif
+		default:
+			stream_end = true;
+			break;
+		}
+
+		block_size += output_size;
+		output_full = block_size == block.size();
+	}
+
+	if (stream_end && !decode_error && (frame_open || ferror(file)))
+	{
+		printf("%s\n", ferror(file) ? "read error in compressed file" : "compressed file is truncated");
+		decode_error = true;
+	}
+
+	block.resize(block_size);
+	pushOutput(block, true);
+
+#if defined(A7X_HAVE_ZLIB)
+	if (compression == CP_Gzip)
+	{
+		inflateEnd(&z_strm);
+	}
+#endif
+
+#if defined(A7X_HAVE_ZSTD)
+	if (zstd_strm)
+	{
+		ZSTD_freeDStream(zstd_strm);
+	}
+#endif
+
+	std::lock_guard<std::mutex> lock(mutex);
+	data_error = decode_error;
+	finished = true;
+	condition.notify_all();
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+enum ECompression
+{
+	CP_None,
+	CP_Gzip,
+	CP_Zstd,
+};
+
+// detected from the magic bytes, so the file extension does not matter
+ECompression detectCompression(const std::string& file_name);
+
+// Decompresses a gzip/zstd file on a background thread. The output is handed
+// out in chunks that always end right after a '\n' (or at the end of the data),
+// so a tokenizer never sees a token split across two chunks.
+class CDecompressStream
+{
+public:
+	// returns nullptr if the file can not be opened or the codec is not built in;
+	// line_aligned = false hands out plain blocks, for binary data
+	static std::unique_ptr<CDecompressStream> open(const std::string& file_name, bool line_aligned = true);
+
+	~CDecompressStream();
+
+	// blocks until the next chunk is ready; an empty chunk marks the end of the stream
+	std::vector<char> nextChunk();
+
+	// byte stream interface, e.g. for rply
+	size_t read(void* dst, size_t size);
+
+	// true if the data ended in a decoder error or a truncated gzip member or
+	// zstd frame; valid once nextChunk returned the empty chunk
+	bool failed();
+
+private:
+	CDecompressStream(FILE* file, ECompression compression, bool line_aligned);
+
+	void decompress();
+	bool pushOutput(std::vector<char>& block, bool final_block);
+
+	FILE* file;
+	ECompression compression;
+	bool line_aligned;
+	std::thread decompress_thread;
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque<std::vector<char>> ready_chunks;
+	bool finished = false;
+	bool cancelled = false;
+	bool data_error = false;
+
+	// partially consumed chunk of read()
+	std::vector<char> read_chunk;
+	size_t read_pos = 0;
+};
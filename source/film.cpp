@@ -1 +1,449 @@
-#include "film.h"
\ No newline at end of file
+#include "film.h"
+#include "parallel.h"
+#include <bit>
+#include <cmath>
+#include <filesystem>
+#include <limits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define A7X_FILM_AVX2
+#endif
+
+// same math as the former per pixel loop: curve, clamp, scale and truncate
+static int encodeValue(float value, EOutputEncoding encoding)
+{
+	float encoded;
+	if (encoding == OE_sRGB)
+	{
+		encoded = value <= 0.0031308f ? 12.92f * value : 1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f;
+	}
+	else
+	{
+		encoded = std::pow(value, 1.0f / 2.2f);
+	}
+	return int(glm::clamp(encoded, 0.0f, 1.0f) * 255.0f);
+}
+
+static inline float toneMap(float value, EToneOperator tone_operator)
+{
+	switch (tone_operator)
+	{
+	case TO_Reinhard:
+		value = (std::max)(value, 0.0f);
+		return value / (1.0f + value);
+	case TO_ACES:
+		value = (std::max)(value, 0.0f);
+		return (value * (2.51f * value + 0.03f)) / (value * (2.43f * value + 0.59f) + 0.14f);
+	default:
+		return value;
+	}
+}
+
+void CRGBFilm::setResolveSettings(const SFilmResolveSettings& settings)
+{
+	resolve_settings = settings;
+
+	// non-negative floats sort like their bit patterns, so each threshold is
+	// found by a binary search over the bits of [0, 1]
+	const uint32_t one_bits = std::bit_cast<uint32_t>(1.0f);
+	encode_thresholds[0] = -std::numeric_limits<float>::infinity();
+	encode_thresholds[256] = std::numeric_limits<float>::infinity();
+	for (int code = 1; code < 256; code++)
+	{
+		uint32_t low_bits = 0;
+		uint32_t high_bits = one_bits;
+		while (low_bits < high_bits)
+		{
+			uint32_t mid_bits = low_bits + (high_bits - low_bits) / 2;
+			if (encodeValue(std::bit_cast<float>(mid_bits), settings.encoding) >= code)
+			{
+				high_bits = mid_bits;
+			}
+			else
+			{
+				low_bits = mid_bits + 1;
+			}
+		}
+		encode_thresholds[code] = std::bit_cast<float>(low_bits);
+	}
+
+	// 3 bytes of padding, the AVX2 path gathers 32 bit words at byte offsets
+	int bucket_num = int(one_bits >> 16) + 1;
+	encode_buckets.assign(bucket_num + 3, 0);
+	encode_refine_steps = 1;
+	int code = 0;
+	for (int bucket_idx = 0; bucket_idx < bucket_num; bucket_idx++)
+	{
+		float bucket_begin = std::bit_cast<float>(uint32_t(bucket_idx) << 16);
+		float bucket_end = std::bit_cast<float>((std::min)((uint32_t(bucket_idx) << 16) | 0xFFFF, one_bits));
+		while (encode_thresholds[code + 1] <= bucket_begin)
+		{
+			code++;
+		}
+		encode_buckets[bucket_idx] = uint8_t(code);
+
+		int end_code = code;
+		while (encode_thresholds[end_code + 1] <= bucket_end)
+		{
+			end_code++;
+		}
+		encode_refine_steps = (std::max)(encode_refine_steps, end_code - code);
+	}
+}
+
+void CRGBFilm::resolveRow(int row_idx, int x_begin, int x_end, float spp)
+{
+	// the pixels of a row are contiguous, so the row is resolved as a flat array of channels
+	const float* src = &output_img[row_idx * image_size.x + x_begin].x;
+	uint8_t* dst = &out_tga_data[row_idx * image_size.x + x_begin].x;
+	int channel_num = (x_end - x_begin) * 3;
+	EToneOperator tone_operator = resolve_settings.tone_operator;
+
+	// with sample statistics every channel is divided by the count of its pixel
+	thread_local std::vector<float> channel_spp;
+	const float* spp_per_channel = nullptr;
+	if (!sample_counts.empty())
+	{
+		channel_spp.resize(channel_num);
+		const uint32_t* counts = &sample_counts[row_idx * image_size.x + x_begin];
+		for (int pixel_idx = 0; pixel_idx < x_end - x_begin; pixel_idx++)
+		{
+			float count = float((std::max)(counts[pixel_idx], 1u));
+			channel_spp[pixel_idx * 3 + 0] = count;
+			channel_spp[pixel_idx * 3 + 1] = count;
+			channel_spp[pixel_idx * 3 + 2] = count;
+		}
+		spp_per_channel = channel_spp.data();
+	}
+
+	int idx = 0;
+#if defined(A7X_FILM_AVX2)
+	const __m256 spp_v = _mm256_set1_ps(spp);
+	const __m256 zero_v = _mm256_setzero_ps();
+	const __m256 one_v = _mm256_set1_ps(1.0f);
+	const __m256i one_i = _mm256_set1_epi32(1);
+	for (; idx + 8 <= channel_num; idx += 8)
+	{
+		__m256 value = _mm256_div_ps(_mm256_loadu_ps(src + idx), spp_per_channel ? _mm256_loadu_ps(spp_per_channel + idx) : spp_v);
+		if (tone_operator == TO_Reinhard)
+		{
+			value = _mm256_max_ps(value, zero_v);
+			value = _mm256_div_ps(value, _mm256_add_ps(one_v, value));
+		}
+		else if (tone_operator == TO_ACES)
+		{
+			value = _mm256_max_ps(value, zero_v);
+			__m256 numerator = _mm256_mul_ps(value, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.51f), value), _mm256_set1_ps(0.03f)));
+			__m256 denominator = _mm256_add_ps(_mm256_mul_ps(value, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.43f), value), _mm256_set1_ps(0.59f))), _mm256_set1_ps(0.14f));
+			value = _mm256_div_ps(numerator, denominator);
+		}
+
+		// max_ps returns its second operand for NaN
+		value = _mm256_min_ps(_mm256_max_ps(value, zero_v), one_v);
+
+		__m256i bucket_idx = _mm256_srli_epi32(_mm256_castps_si256(value), 16);
+		__m256i code = _mm256_and_si256(_mm256_i32gather_epi32((const int*)encode_buckets.data(), bucket_idx, 1), _mm256_set1_epi32(0xFF));
+		for (int step = 0; step < encode_refine_steps; step++)
+		{
+			__m256 threshold = _mm256_i32gather_ps(encode_thresholds + 1, code, 4);
+			__m256i above = _mm256_castps_si256(_mm256_cmp_ps(value, threshold, _CMP_GE_OQ));
+			code = _mm256_add_epi32(code, _mm256_and_si256(above, one_i));
+		}
+
+		alignas(32) int32_t codes[8];
+		_mm256_store_si256((__m256i*)codes, code);
+		for (int lane = 0; lane < 8; lane++)
+		{
+			dst[idx + lane] = uint8_t(codes[lane]);
+		}
+	}
+#endif
+	for (; idx < channel_num; idx++)
+	{
+		float value = toneMap(src[idx] / (spp_per_channel ? spp_per_channel[idx] : spp), tone_operator);
+		value = (std::min)(value >= 0.0f ? value : 0.0f, 1.0f);
+
+		int code = encode_buckets[std::bit_cast<uint32_t>(value) >> 16];
+		for (int step = 0; step < encode_refine_steps; step++)
+		{
+			code += value >= encode_thresholds[code + 1] ? 1 : 0;
+		}
+		dst[idx] = uint8_t(code);
+	}
+}
+
+void CRGBFilm::finalizeRender(float spp)
+{
+	if (out_tga_data.size() != output_img.size())
+	{
+		out_tga_data.resize(output_img.size());
+	}
+
+	parallelFor2D(glm::u32vec2(0, 0), image_size, [&](glm::u32vec2 bound_min, glm::u32vec2 bound_max)
+		{
+			bound_max = glm::min(bound_max, image_size);
+			for (glm::uint32 row_idx = bound_min.y; row_idx < bound_max.y; row_idx++)
+			{
+				resolveRow(row_idx, bound_min.x, bound_max.x, spp);
+			}
+		});
+}
+
+void CRGBFilm::snapshotLinear(float spp, TrackedVector<float, MC_Film>& dst)
+{
+	dst.resize(output_img.size() * 3);
+	parallelFor2D(glm::u32vec2(0, 0), image_size, [&](glm::u32vec2 bound_min, glm::u32vec2 bound_max)
+		{
+			bound_max = glm::min(bound_max, image_size);
+			for (glm::uint32 row_idx = bound_min.y; row_idx < bound_max.y; row_idx++)
+			{
+				for (glm::uint32 pixel_x = bound_min.x; pixel_x < bound_max.x; pixel_x++)
+				{
+					size_t pixel_idx = row_idx * image_size.x + pixel_x;
+					float pixel_spp = sample_counts.empty() ? spp : float((std::max)(sample_counts[pixel_idx], 1u));
+					glm::vec3 L = output_img[pixel_idx] / pixel_spp;
+					dst[pixel_idx * 3 + 0] = L.x;
+					dst[pixel_idx * 3 + 1] = L.y;
+					dst[pixel_idx * 3 + 2] = L.z;
+				}
+			}
+		});
+}
+
+void CRGBFilm::writeImage(float spp)
+{
+	SImageOutputJob job;
+	job.file_name = output_settings.file_name;
+	job.format = getImageFormat(output_settings.file_name);
+	job.width = image_size.x;
+	job.height = image_size.y;
+	job.exr_half = output_settings.exr_half;
+	job.exr_compression = output_settings.exr_compression;
+
+	if (isFloatImageFormat(job.format))
+	{
+		// linear radiance, tone mapping is left to the viewer
+		snapshotLinear(spp, job.hdr_pixels);
+	}
+	else
+	{
+		finalizeRender(spp);
+		const uint8_t* ldr_data = &out_tga_data[0].x;
+		job.ldr_pixels.assign(ldr_data, ldr_data + out_tga_data.size() * 3);
+	}
+
+	if (!image_writer)
+	{
+		image_writer = std::make_unique<CImageWriter>();
+	}
+	image_writer->submit(std::move(job));
+}
+
+bool CRGBFilm::previewStreamDue()
+{
+	if (output_settings.preview_stream_address.empty())
+	{
+		return false;
+	}
+	if (!preview_stream)
+	{
+		preview_stream = std::make_unique<CPreviewStream>(output_settings.preview_stream_address, std::filesystem::path(output_settings.file_name).filename().string(),
+			image_size.x, image_size.y, output_settings.preview_stream_interval);
+	}
+	return preview_stream->ready();
+}
+
+void CRGBFilm::streamPreview(float spp)
+{
+	if (!preview_stream)
+	{
+		return;
+	}
+	TrackedVector<float, MC_Film> pixels;
+	snapshotLinear(spp, pixels);
+	preview_stream->submit(std::move(pixels));
+}
+
+void CRGBFilm::enableSampleStatistics()
+{
+	sample_counts.assign(output_img.size(), 0u);
+	luminance_sq_sums.assign(output_img.size(), 0.0f);
+}
+
+float CRGBFilm::relativeError(glm::u32vec2 pos)const
+{
+	int pixel_idx = pos.x + pos.y * image_size.x;
+	uint32_t count = sample_counts[pixel_idx];
+	if (count < 2)
+	{
+		return std::numeric_limits<float>::infinity();
+	}
+
+	float mean = pixelLuminance(output_img[pixel_idx]) / count;
+	float variance = (std::max)((luminance_sq_sums[pixel_idx] - count * mean * mean) / (count - 1), 0.0f);
+
+	// the small floor keeps black pixels from never converging
+	return std::sqrt(variance / count) / (std::max)(mean, 1e-3f);
+}
+
+void CRGBFilm::writeSampleCountImage()
+{
+	if (sample_counts.empty())
+	{
+		return;
+	}
+
+	std::filesystem::path output_path(output_settings.file_name);
+	SImageOutputJob job;
+	job.file_name = (output_path.parent_path() / (output_path.stem().string() + "_spp" + output_path.extension().string())).string();
+	job.format = getImageFormat(job.file_name);
+	job.width = image_size.x;
+	job.height = image_size.y;
+	job.exr_half = false;
+	job.exr_compression = output_settings.exr_compression;
+
+	// float formats store the counts, 8 bit formats the counts relative to the maximum
+	uint32_t max_count = (std::max)(*std::max_element(sample_counts.begin(), sample_counts.end()), 1u);
+	if (isFloatImageFormat(job.format))
+	{
+		job.hdr_pixels.resize(sample_counts.size() * 3);
+		for (size_t pixel_idx = 0; pixel_idx < sample_counts.size(); pixel_idx++)
+		{
+			std::fill_n(&job.hdr_pixels[pixel_idx * 3], 3, float(sample_counts[pixel_idx]));
+		}
+	}
+	else
+	{
+		job.ldr_pixels.resize(sample_counts.size() * 3);
+		for (size_t pixel_idx = 0; pixel_idx < sample_counts.size(); pixel_idx++)
+		{
+			std::fill_n(&job.ldr_pixels[pixel_idx * 3], 3, uint8_t(uint64_t(sample_counts[pixel_idx]) * 255 / max_count));
+		}
+	}
+
+	if (!image_writer)
+	{
+		image_writer = std::make_unique<CImageWriter>();
+	}
+	image_writer->submit(std::move(job));
+}
+
+void CRGBFilm::saveState(CCheckpointWriter& writer)const
+{
+	uint8_t has_statistics = hasSampleStatistics() ? 1 : 0;
+	writer.writeVector(output_img);
+	writer.write(&has_statistics, sizeof(has_statistics));
+	if (has_statistics)
+	{
+		writer.writeVector(sample_counts);
+		writer.writeVector(luminance_sq_sums);
+	}
+}
+
+bool CRGBFilm::loadState(CCheckpointReader& reader)
+{
+	uint8_t has_statistics = 0;
+	if (!reader.readVector(output_img) || !reader.read(&has_statistics, sizeof(has_statistics)) || bool(has_statistics) != hasSampleStatistics())
+	{
+		return false;
+	}
+	return !has_statistics || (reader.readVector(sample_counts) && reader.readVector(luminance_sq_sums));
+}
+
+bool CRGBFilm::mergeState(CCheckpointReader& reader)
+{
+	TrackedVector<glm::vec3, MC_Film> other_img(output_img.size());
+	TrackedVector<uint32_t, MC_Film> other_counts(sample_counts.size());
+	TrackedVector<float, MC_Film> other_luminance_sq_sums(luminance_sq_sums.size());
+	uint8_t has_statistics = 0;
+	if (!hasSampleStatistics() || !reader.readVector(other_img) || !reader.read(&has_statistics, sizeof(has_statistics)) || !has_statistics ||
+		!reader.readVector(other_counts) || !reader.readVector(other_luminance_sq_sums))
+	{
+		return false;
+	}
+
+	for (size_t pixel_idx = 0; pixel_idx < output_img.size(); pixel_idx++)
+	{
+		output_img[pixel_idx] += other_img[pixel_idx];
+		sample_counts[pixel_idx] += other_counts[pixel_idx];
+		luminance_sq_sums[pixel_idx] += other_luminance_sq_sums[pixel_idx];
+	}
+	return true;
+}
+
+static constexpr size_t tile_pixel_bytes = sizeof(glm::vec3) + sizeof(uint32_t) + sizeof(float);
+
+size_t CRGBFilm::tileBytes(glm::u32vec2 tile_min, glm::u32vec2 tile_max)
+{
+	return size_t(tile_max.x - tile_min.x) * (tile_max.y - tile_min.y) * tile_pixel_bytes;
+}
+
+void CRGBFilm::takeTile(glm::u32vec2 tile_min, glm::u32vec2 tile_max, std::vector<uint8_t>& dst)
+{
+	assert(hasSampleStatistics());
+	const uint32_t tile_width = tile_max.x - tile_min.x;
+	dst.resize(tileBytes(tile_min, tile_max));
+
+	uint8_t* dst_ptr = dst.data();
+	for (uint32_t y = tile_min.y; y < tile_max.y; y++)
+	{
+		size_t row_begin = tile_min.x + size_t(y) * image_size.x;
+		memcpy(dst_ptr, &output_img[row_begin], tile_width * sizeof(glm::vec3));
+		dst_ptr += tile_width * sizeof(glm::vec3);
+		memcpy(dst_ptr, &sample_counts[row_begin], tile_width * sizeof(uint32_t));
+		dst_ptr += tile_width * sizeof(uint32_t);
+		memcpy(dst_ptr, &luminance_sq_sums[row_begin], tile_width * sizeof(float));
+		dst_ptr += tile_width * sizeof(float);
+
+		std::fill_n(output_img.begin() + row_begin, tile_width, glm::vec3(0.0f));
+		std::fill_n(sample_counts.begin() + row_begin, tile_width, 0u);
+		std::fill_n(luminance_sq_sums.begin() + row_begin, tile_width, 0.0f);
+	}
+}
+
+bool CRGBFilm::addTile(glm::u32vec2 tile_min, glm::u32vec2 tile_max, const std::vector<uint8_t>& src)
+{
+	const uint32_t tile_width = tile_max.x - tile_min.x;
+	if (!hasSampleStatistics() || tile_max.x > image_size.x || tile_max.y > image_size.y ||
+		src.size() != tileBytes(tile_min, tile_max))
+	{
+		return false;
+	}
+
+	const uint8_t* src_ptr = src.data();
+	for (uint32_t y = tile_min.y; y < tile_max.y; y++)
+	{
+		size_t row_begin = tile_min.x + size_t(y) * image_size.x;
+		for (uint32_t x = 0; x < tile_width; x++)
+		{
+			glm::vec3 radiance;
+			memcpy(&radiance, src_ptr + x * sizeof(glm::vec3), sizeof(glm::vec3));
+			output_img[row_begin + x] += radiance;
+		}
+		src_ptr += tile_width * sizeof(glm::vec3);
+		for (uint32_t x = 0; x < tile_width; x++)
+		{
+			uint32_t count;
+			memcpy(&count, src_ptr + x * sizeof(uint32_t), sizeof(uint32_t));
+			sample_counts[row_begin + x] += count;
+		}
+		src_ptr += tile_width * sizeof(uint32_t);
+		for (uint32_t x = 0; x < tile_width; x++)
+		{
+			float luminance_sq_sum;
+			memcpy(&luminance_sq_sum, src_ptr + x * sizeof(float), sizeof(float));
+			luminance_sq_sums[row_begin + x] += luminance_sq_sum;
+		}
+		src_ptr += tile_width * sizeof(float);
+	}
+	return true;
+}
+
+void CRGBFilm::flushOutput()
+{
+	if (image_writer)
+	{
+		image_writer->flush();
+	}
+}
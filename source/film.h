@@ -3,16 +3,43 @@
 #include <glm/vec3.hpp>
 #include <glm/common.hpp>
 #include <glm/exponential.hpp>
+#include <algorithm>
+#include <cstring>
+#include <memory>
 #include <vector>
+#include "memory_tracker.h"
+#include "image_output.h"
+#include "checkpoint.h"
+#include "preview_stream.h"
+
+enum EToneOperator
+{
+	TO_Clamp,
+	TO_Reinhard,
+	TO_ACES,	// Narkowicz's fit of the ACES filmic curve
+};
+
+enum EOutputEncoding
+{
+	OE_Gamma22,
+	OE_sRGB,
+};
+
+struct SFilmResolveSettings
+{
+	EToneOperator tone_operator = TO_Clamp;
+	EOutputEncoding encoding = OE_Gamma22;
+};
 
 class CRGBFilm
 {
 public:
-	CRGBFilm(glm::u32vec2 ipt_img_sz)
-		:image_size(ipt_img_sz) 
+	CRGBFilm(glm::u32vec2 ipt_img_sz, const SFilmResolveSettings& settings = SFilmResolveSettings())
+		:image_size(ipt_img_sz)
 	{
 		output_img.resize(image_size.y * image_size.x);
 		memset(output_img.data(),0,sizeof(glm::vec3) * output_img.size());
+		setResolveSettings(settings);
 	};
 
 	inline glm::u32vec2 getImageSize()const { return image_size; }
@@ -23,27 +50,96 @@ public:
 		assert(dst_pos.y >= 0 && dst_pos.y <= image_size.y);
 		int write_idx = dst_pos.x + dst_pos.y * image_size.x;
 		output_img[write_idx] += L;
+		if (!sample_counts.empty())
+		{
+			float luminance = pixelLuminance(L);
+			sample_counts[write_idx]++;
+			luminance_sq_sums[write_idx] += luminance * luminance;
+		}
 	}
 
-	inline void finalizeRender(float spp)
+	inline void clear()
 	{
-		out_tga_data.resize(image_size.y * image_size.x);
-		for (int idx_x = 0; idx_x < image_size.x; idx_x++)
-		{
-			for (int idx_y = 0; idx_y < image_size.y; idx_y++)
-			{
-				int dst_idx = idx_x + idx_y * image_size.x;
-				glm::vec3 mapped_data = glm::pow(glm::vec3(output_img[dst_idx] / spp), glm::vec3(1.0f / 2.2f));
-				glm::vec3 norm_data = glm::clamp(mapped_data, glm::vec3(0.0), glm::vec3(1.0)) * 255.0f;
-				out_tga_data[dst_idx] = norm_data;
-			}
-		}
+		memset(output_img.data(), 0, sizeof(glm::vec3) * output_img.size());
+		std::fill(sample_counts.begin(), sample_counts.end(), 0u);
+		std::fill(luminance_sq_sums.begin(), luminance_sq_sums.end(), 0.0f);
 	}
 
+	// Per pixel sample counts and luminance second moments for adaptive
+	// sampling. With them, the resolve divides each pixel by its own count
+	// and ignores the spp argument.
+	void enableSampleStatistics();
+	inline bool hasSampleStatistics()const { return !sample_counts.empty(); }
+	inline uint32_t getSampleCount(glm::u32vec2 pos)const { return sample_counts[pos.x + pos.y * image_size.x]; }
+
+	// standard error of the pixel's mean luminance relative to the mean
+	float relativeError(glm::u32vec2 pos)const;
+
+	// writes the sample counts next to the output image as <name>_spp<extension>
+	void writeSampleCountImage();
+
+	// accumulated radiance and sample statistics, for checkpoints
+	void saveState(CCheckpointWriter& writer)const;
+	bool loadState(CCheckpointReader& reader);
+
+	// adds the state of another film of the same size, which must have
+	// sample statistics like this one
+	bool mergeState(CCheckpointReader& reader);
+
+	// Accumulators of the pixels in [tile_min, tile_max), row by row, for the
+	// tile coordinator. takeTile clears the pixels it packed, addTile needs
+	// sample statistics on both films.
+	void takeTile(glm::u32vec2 tile_min, glm::u32vec2 tile_max, std::vector<uint8_t>& dst);
+	bool addTile(glm::u32vec2 tile_min, glm::u32vec2 tile_max, const std::vector<uint8_t>& src);
+	static size_t tileBytes(glm::u32vec2 tile_min, glm::u32vec2 tile_max);
+
+	void setResolveSettings(const SFilmResolveSettings& settings);
+
+	// Tone maps and encodes the accumulated radiance into 8 bit RGB, in parallel
+	// over the rows. Can be called repeatedly, e.g. for previews; the output
+	// buffer is only allocated the first time.
+	void finalizeRender(float spp);
+
 	inline void* getFinalData() { return out_tga_data.data(); }
 
+	inline void setOutputSettings(const SImageOutputSettings& settings) { output_settings = settings; }
+	inline const std::string& getOutputFileName()const { return output_settings.file_name; }
+
+	// Snapshots the image in the format of the output file name and writes it
+	// on the I/O thread; the film can keep accumulating samples right away.
+	void writeImage(float spp);
+
+	// waits for the images that are still being written
+	void flushOutput();
+
+	// Live preview for an image viewer, see CPreviewStream. Due at most once per
+	// preview_stream_interval and only once the previous update is sent, so the
+	// render never waits for the viewer; callers skip resolving work otherwise.
+	// streamPreview sends right away, e.g. the final image.
+	bool previewStreamDue();
+	void streamPreview(float spp);
+
 private:
+	static inline float pixelLuminance(glm::vec3 L) { return 0.2126f * L.x + 0.7152f * L.y + 0.0722f * L.z; }
+
+	void resolveRow(int row_idx, int x_begin, int x_end, float spp);
+	void snapshotLinear(float spp, TrackedVector<float, MC_Film>& dst);
+
 	glm::u32vec2 image_size;
-	std::vector<glm::vec3> output_img;
-	std::vector<glm::u8vec3> out_tga_data;
-};
\ No newline at end of file
+	TrackedVector<glm::vec3, MC_Film> output_img;
+	TrackedVector<glm::u8vec3, MC_Film> out_tga_data;
+	TrackedVector<uint32_t, MC_Film> sample_counts;
+	TrackedVector<float, MC_Film> luminance_sq_sums;
+
+	SFilmResolveSettings resolve_settings;
+	SImageOutputSettings output_settings;
+	std::unique_ptr<CImageWriter> image_writer;
+	std::unique_ptr<CPreviewStream> preview_stream;
+
+	// encode_thresholds[k] is the smallest tone mapped value that encodes to k
+	// or more. encode_buckets holds the code at the start of every range of
+	// values sharing the upper 16 bits, and the thresholds refine it exactly.
+	float encode_thresholds[257];
+	std::vector<uint8_t> encode_buckets;
+	int encode_refine_steps = 1;
+};
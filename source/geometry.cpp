@@ -1,21 +1,148 @@
 #include "geometry.h"
 #include "scene.h"
 #include "rply/rply.h"
+#include "decompress.h"
+#include "pbrt/hash.h"
+#include <atomic>
 
 void errorFunction(void* userPtr, enum RTCError error, const char* str)
 {
 	printf("error %d: %s\n", error, str);
 }
 
-CAccelerator::CAccelerator()
+// Embree reports its allocations (BVH and geometry buffers) before they happen;
+// refusing one makes the current operation fail with RTC_ERROR_OUT_OF_MEMORY.
+bool embreeMemoryMonitor(void* userPtr, ssize_t bytes, bool post)
 {
-	rt_device = rtcNewDevice(NULL);
-	if (!rt_device)
+	return trackMemory(MC_Embree, bytes, !post) || post;
+}
+
+// an ObjectBegin/ObjectEnd definition, see CAccelerator::addLazyObject
+struct SLazyObject
+{
+	// the parsed shapes, released once the object is built
+	std::vector<SShapeSceneEntity> shapes;
+	std::filesystem::path file_path;
+	glm::vec3 bounds[2];
+
+	std::atomic<RTCScene> rt_scene = nullptr;
+	std::atomic<CWideBVH*> wide_bvh = nullptr;
+	std::vector<int> material_indices; // by geometry ID in rt_scene or wide_bvh
+};
+
+static RTCDevice newDevice()
+{
+	// lets Embree back the BVH with huge pages as well
+	RTCDevice device = rtcNewDevice(hugePagesEnabled() ? "hugepages=1" : NULL);
+	if (!device)
 	{
 		printf("error %d: cannot create device\n", rtcGetDeviceError(NULL));
 	}
-	rtcSetDeviceErrorFunction(rt_device, errorFunction, NULL);
+	rtcSetDeviceErrorFunction(device, errorFunction, NULL);
+	rtcSetDeviceMemoryMonitorFunction(device, embreeMemoryMonitor, NULL);
+	return device;
+}
+
+// same payload: the same file, or for inline meshes the same data
+static bool sameMeshPayload(const SSharedMeshBuffers& mesh_buffers, const std::string& source_file, std::span<const glm::vec3> positions, std::span<const int> indices)
+{
+	if (!source_file.empty() || !mesh_buffers.source_file.empty())
+	{
+		return mesh_buffers.source_file == source_file;
+	}
+	return mesh_buffers.vertex_count == positions.size() && mesh_buffers.triangle_count * 3 == indices.size() &&
+		memcmp(rtcGetBufferData(mesh_buffers.vertex_buffer), positions.data(), positions.size_bytes()) == 0 &&
+		memcmp(rtcGetBufferData(mesh_buffers.index_buffer), indices.data(), indices.size_bytes()) == 0;
+}
+
+static uint64_t fileStamp(const std::string& file_name)
+{
+	if (file_name.empty())
+	{
+		return 0;
+	}
+	std::error_code error;
+	uint64_t file_size = std::filesystem::file_size(file_name, error);
+	int64_t write_time = std::filesystem::last_write_time(file_name, error).time_since_epoch().count();
+	return pbrt::Hash(file_size, write_time);
+}
+
+CMeshBufferCache::CMeshBufferCache()
+{
+	device = newDevice();
+}
+
+CMeshBufferCache::~CMeshBufferCache()
+{
+	for (auto& cache_iter : cached_buffers)
+	{
+		rtcReleaseBuffer(cache_iter.second.mesh_buffers.vertex_buffer);
+		rtcReleaseBuffer(cache_iter.second.mesh_buffers.index_buffer);
+	}
+	rtcReleaseDevice(device);
+}
+
+void CMeshBufferCache::beginFrame()
+{
+	for (auto cache_iter = cached_buffers.begin(); cache_iter != cached_buffers.end();)
+	{
+		if (cache_iter->second.last_frame < frame_idx)
+		{
+			rtcReleaseBuffer(cache_iter->second.mesh_buffers.vertex_buffer);
+			rtcReleaseBuffer(cache_iter->second.mesh_buffers.index_buffer);
+			cache_iter = cached_buffers.erase(cache_iter);
+		}
+		else
+		{
+			++cache_iter;
+		}
+	}
+	frame_idx++;
+}
+
+bool CMeshBufferCache::find(uint64_t hash, const std::string& source_file, std::span<const glm::vec3> positions, std::span<const int> indices, SSharedMeshBuffers& mesh_buffers)
+{
+	uint64_t file_stamp = fileStamp(source_file);
+	auto range = cached_buffers.equal_range(hash);
+	for (auto iter = range.first; iter != range.second; iter++)
+	{
+		SCachedMeshBuffers& cached = iter->second;
+		if (cached.file_stamp == file_stamp && sameMeshPayload(cached.mesh_buffers, source_file, positions, indices))
+		{
+			cached.last_frame = frame_idx;
+			mesh_buffers = cached.mesh_buffers;
+			rtcRetainBuffer(mesh_buffers.vertex_buffer);
+			rtcRetainBuffer(mesh_buffers.index_buffer);
+			return true;
+		}
+	}
+	return false;
+}
+
+void CMeshBufferCache::insert(uint64_t hash, const SSharedMeshBuffers& mesh_buffers)
+{
+	SCachedMeshBuffers cached;
+	cached.mesh_buffers = mesh_buffers;
+	cached.file_stamp = fileStamp(mesh_buffers.source_file);
+	cached.last_frame = frame_idx;
+	rtcRetainBuffer(mesh_buffers.vertex_buffer);
+	rtcRetainBuffer(mesh_buffers.index_buffer);
+	cached_buffers.emplace(hash, std::move(cached));
+}
 
+CAccelerator::CAccelerator(CMeshBufferCache* mesh_cache, EAcceleratorBackend backend)
+	: backend(backend)
+	, mesh_cache(mesh_cache)
+{
+	if (mesh_cache)
+	{
+		rt_device = mesh_cache->getDevice();
+		rtcRetainDevice(rt_device);
+	}
+	else
+	{
+		rt_device = newDevice();
+	}
 	rt_scene = rtcNewScene(rt_device);
 }
 
@@ -28,15 +155,139 @@ CAccelerator::~CAccelerator()
 
 	for (auto& geo_iter : scene_geometries)
 	{
-		rtcReleaseGeometry(geo_iter.geometry);
+		if (geo_iter.geometry)
+		{
+			rtcReleaseGeometry(geo_iter.geometry);
+		}
+	}
+
+	for (auto& buffer_iter : shared_mesh_buffers)
+	{
+		rtcReleaseBuffer(buffer_iter.second.vertex_buffer);
+		rtcReleaseBuffer(buffer_iter.second.index_buffer);
+	}
+
+	for (size_t node_idx = 1; node_idx < node_scenes.size(); node_idx++)
+	{
+		rtcReleaseScene(node_scenes[node_idx]);
 	}
 
 	rtcReleaseScene(rt_scene);
+	if (lazy_geometry)
+	{
+		rtcReleaseGeometry(lazy_geometry);
+	}
+	for (auto& lazy_object : lazy_objects)
+	{
+		RTCScene object_scene = lazy_object->rt_scene.load();
+		if (object_scene)
+		{
+			rtcReleaseScene(object_scene);
+		}
+		delete lazy_object->wide_bvh.load();
+	}
 	rtcReleaseDevice(rt_device);
+
+	for (auto& memory_iter : mesh_buffer_memory)
+	{
+		freeLarge(memory_iter.first, memory_iter.second);
+		trackMemory(MC_Embree, -int64_t(memory_iter.second));
+	}
+}
+
+void STriangleMesh::init(std::span<const int> ipt_indices, std::span<const glm::vec3> ipt_points, std::span<const glm::vec3> ipt_normals, std::span<const glm::vec2> ipt_uvs, bool compact)
+{
+	triangle_count = ipt_indices.size() / 3;
+	points.assign(ipt_points.begin(), ipt_points.end());
+
+	if (!compact)
+	{
+		indices.assign(ipt_indices.begin(), ipt_indices.end());
+		normals.assign(ipt_normals.begin(), ipt_normals.end());
+		uvs.assign(ipt_uvs.begin(), ipt_uvs.end());
+		return;
+	}
+
+	if (ipt_points.size() <= 65536)
+	{
+		indices16.assign(ipt_indices.begin(), ipt_indices.end());
+	}
+	else
+	{
+		indices.assign(ipt_indices.begin(), ipt_indices.end());
+	}
+
+	oct_normals.resize(ipt_normals.size());
+	for (size_t idx = 0; idx < ipt_normals.size(); idx++)
+	{
+		oct_normals[idx] = encodeOctahedral(ipt_normals[idx]);
+	}
+
+	half_uvs.resize(ipt_uvs.size());
+	for (size_t idx = 0; idx < ipt_uvs.size(); idx++)
+	{
+		half_uvs[idx] = glm::packHalf2x16(ipt_uvs[idx]);
+	}
+}
+
+bool STriangleMesh::sameData(const STriangleMesh& other)const
+{
+	return triangle_count == other.triangle_count && points == other.points &&
+		indices == other.indices && normals == other.normals && uvs == other.uvs &&
+		indices16 == other.indices16 && oct_normals == other.oct_normals && half_uvs == other.half_uvs;
+}
+
+size_t STriangleMesh::memoryBytes()const
+{
+	return points.size() * sizeof(glm::vec3) +
+		indices.size() * sizeof(int) + normals.size() * sizeof(glm::vec3) + uvs.size() * sizeof(glm::vec2) +
+		indices16.size() * sizeof(uint16_t) + oct_normals.size() * sizeof(uint32_t) + half_uvs.size() * sizeof(uint32_t);
+}
+
+size_t STriangleMesh::fullPrecisionBytes()const
+{
+	return points.size() * sizeof(glm::vec3) + triangle_count * 3 * sizeof(int) +
+		(normals.size() + oct_normals.size()) * sizeof(glm::vec3) + (uvs.size() + half_uvs.size()) * sizeof(glm::vec2);
+}
+
+SShapeInteraction CAccelerator::shapeInteraction(const CRay& ray, float hit_t, unsigned geometry_id, const SLazyInstance* instance, glm::vec3 hit_normal)const
+{
+	int mat_idx = -1;
+	if (instance)
+	{
+		// the geometry ID is the one in the object's scene, the normal is in object space
+		mat_idx = lazy_objects[instance->object_idx]->material_indices[geometry_id];
+		hit_normal = instance->normal_to_world * hit_normal;
+	}
+	else
+	{
+		mat_idx = scene_geometries[geometry_id].material_idx;
+	}
+	hit_normal = glm::normalize(hit_normal);
+
+	SShapeInteraction shape_interaction;
+	shape_interaction.hit_t = hit_t;
+	shape_interaction.sface_interaction.position = ray.origin + shape_interaction.hit_t * ray.direction;
+	shape_interaction.sface_interaction.norm = faceForward(ray.direction, hit_normal);
+	shape_interaction.sface_interaction.material = scene_materials[mat_idx];
+	shape_interaction.sface_interaction.wo = -ray.direction;
+	return shape_interaction;
 }
 
 SShapeInteraction CAccelerator::intersection(CRay ray)
 {
+	if (backend == AB_WideBVH)
+	{
+		SBVHRay bvh_ray = { ray.origin, ray.direction, 1e-5f, std::numeric_limits<float>::max() };
+		SBVHHit bvh_hit;
+		if (!wide_bvh->intersect(bvh_ray, bvh_hit))
+		{
+			return SShapeInteraction();
+		}
+		const SLazyInstance* instance = bvh_hit.inst_id != SBVHHit::invalid_id ? &lazy_instances[bvh_hit.inst_id] : nullptr;
+		return shapeInteraction(ray, bvh_hit.t, bvh_hit.geom_id, instance, bvh_hit.ng);
+	}
+
 	RTCIntersectArguments args;
 	rtcInitIntersectArguments(&args);
 
@@ -56,28 +307,24 @@ SShapeInteraction CAccelerator::intersection(CRay ray)
 	embree_ray.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
 	embree_ray.hit.primID = RTC_INVALID_GEOMETRY_ID;
 
-	rtcIntersect1(rt_scene, &embree_ray, &args);
+	rtcIntersect1(traversalScene(), &embree_ray, &args);
 
-	SShapeInteraction shape_interaction;
-
-	if (embree_ray.hit.geomID != RTC_INVALID_GEOMETRY_ID)
+	if (embree_ray.hit.geomID == RTC_INVALID_GEOMETRY_ID)
 	{
-		const SA7XGeometry& scene_geometry = scene_geometries[embree_ray.hit.geomID];
-		glm::vec3 hit_normal = glm::normalize(glm::vec3(embree_ray.hit.Ng_x, embree_ray.hit.Ng_y, embree_ray.hit.Ng_z));
-		int mat_idx = scene_geometry.material_idx;
-
-		shape_interaction.hit_t = embree_ray.ray.tfar;
-		shape_interaction.sface_interaction.position = ray.origin + shape_interaction.hit_t * ray.direction;
-		shape_interaction.sface_interaction.norm = faceForward(ray.direction, hit_normal);
-		shape_interaction.sface_interaction.material = scene_materials[mat_idx];
-		shape_interaction.sface_interaction.wo = -ray.direction;
+		return SShapeInteraction();
 	}
-
-	return shape_interaction;
+	const SLazyInstance* instance = embree_ray.hit.instID[0] != RTC_INVALID_GEOMETRY_ID ? &lazy_instances[embree_ray.hit.instID[0]] : nullptr;
+	return shapeInteraction(ray, embree_ray.ray.tfar, embree_ray.hit.geomID, instance, glm::vec3(embree_ray.hit.Ng_x, embree_ray.hit.Ng_y, embree_ray.hit.Ng_z));
 }
 
 bool CAccelerator::traceVisibilityRay(CRay ray, float max_t)
 {
+	if (backend == AB_WideBVH)
+	{
+		SBVHRay bvh_ray = { ray.origin, ray.direction, 1e-5f, max_t - 1e-5f };
+		return !wide_bvh->occluded(bvh_ray);
+	}
+
 	RTCOccludedArguments sargs;
 	rtcInitOccludedArguments(&sargs);
 
@@ -92,7 +339,7 @@ bool CAccelerator::traceVisibilityRay(CRay ray, float max_t)
 	visibility_ray.tfar = max_t - 1e-5;
 	visibility_ray.time = 0;
 	visibility_ray.mask = -1;
-	rtcOccluded1(rt_scene, &visibility_ray, &sargs);
+	rtcOccluded1(traversalScene(), &visibility_ray, &sargs);
 	if (visibility_ray.tfar > 0.0)
 	{
 		return true;
@@ -139,9 +386,68 @@ int rply_face_callback(p_ply_argument argument)
 	return 1;
 }
 
-RTCGeometry CAccelerator::readPLY(const std::string& file_name, int ID)
+size_t rply_stream_input(void* input_data, void* buffer, size_t size)
+{
+	return ((CDecompressStream*)input_data)->read(buffer, size);
+}
+
+// compressed meshes (.ply.gz, .ply.zst) are inflated while rply consumes them
+static p_ply openPLY(const std::string& file_name, std::unique_ptr<CDecompressStream>& ply_stream, p_ply_error_cb error_call_back)
+{
+	if (detectCompression(file_name) != CP_None)
+	{
+		ply_stream = CDecompressStream::open(file_name, false);
+		return ply_stream ? ply_open_from_reader(rply_stream_input, ply_stream.get(), error_call_back, 0, nullptr) : nullptr;
+	}
+	return ply_open(file_name.c_str(), error_call_back, 0, nullptr);
+}
+
+void ply_silent_error_call_back(p_ply, const char*)
+{
+}
+
+int rply_bounds_callback(p_ply_argument argument)
+{
+	glm::vec3* bounds;
+	long axis;
+	ply_get_argument_user_data(argument, (void**)&bounds, &axis);
+
+	float value = (float)ply_get_argument_value(argument);
+	bounds[0][axis] = (std::min)(bounds[0][axis], value);
+	bounds[1][axis] = (std::max)(bounds[1][axis], value);
+	return 1;
+}
+
+int rply_abort_callback(p_ply_argument argument)
+{
+	return 0;
+}
+
+// Only the vertex positions are read, the faces after them stop the reader.
+// A file that cannot be read leaves the bounds empty, its real read reports it.
+static void readPLYBounds(const std::string& file_name, glm::vec3 bounds[2])
+{
+	std::unique_ptr<CDecompressStream> ply_stream;
+	p_ply ply = openPLY(file_name, ply_stream, ply_silent_error_call_back);
+	if (!ply)
+	{
+		return;
+	}
+	if (ply_read_header(ply) != 0)
+	{
+		ply_set_read_cb(ply, "vertex", "x", rply_bounds_callback, bounds, 0);
+		ply_set_read_cb(ply, "vertex", "y", rply_bounds_callback, bounds, 1);
+		ply_set_read_cb(ply, "vertex", "z", rply_bounds_callback, bounds, 2);
+		ply_set_read_cb(ply, "face", "vertex_indices", rply_abort_callback, nullptr, 0);
+		ply_read(ply);
+	}
+	ply_close(ply);
+}
+
+const SSharedMeshBuffers* CAccelerator::readPLY(const std::string& file_name)
 {
-	p_ply ply = ply_open(file_name.c_str(), ply_error_call_back, 0, nullptr);
+	std::unique_ptr<CDecompressStream> ply_stream;
+	p_ply ply = openPLY(file_name, ply_stream, ply_error_call_back);
 	if (!ply) { assert(false); }
 	if (ply_read_header(ply) == 0) { assert(false); }
 
@@ -186,57 +492,570 @@ RTCGeometry CAccelerator::readPLY(const std::string& file_name, int ID)
 	if (ply_read(ply) == 0) { assert(false); }
 	ply_close(ply);
 
-	RTCGeometry geom = rtcNewGeometry(rt_device, RTC_GEOMETRY_TYPE_TRIANGLE);
-	float* geo_vertices = (float*)rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 3 * sizeof(float), positions.size());
-	//float* geo_normals = (float*)rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_NORMAL, 0, RTC_FORMAT_FLOAT3, 3 * sizeof(float), normals.size());
-	unsigned* geo_indices = (unsigned*)rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 3 * sizeof(unsigned), triangle_indices.size() / 3);
-	memcpy(geo_vertices, positions.data(), positions.size() * sizeof(glm::vec3));
-	//memcpy(geo_normals, normals.data(), normals.size() * sizeof(glm::vec3));
-	for (int idx = 0; idx < triangle_indices.size(); idx++)
+	uint64_t hash = pbrt::HashBuffer(file_name.data(), file_name.size());
+	return createMeshBuffers(hash, file_name, positions, triangle_indices);
+}
+
+// Exporters often emit the same mesh payload many times. Shapes are keyed by a
+// content hash and a hit is confirmed by comparing the data, so identical
+// meshes end up sharing one set of buffers while every shape keeps its own
+// geometry (and therefore its own material).
+const SSharedMeshBuffers* CAccelerator::findMeshBuffers(uint64_t hash, const std::string& source_file, std::span<const glm::vec3> positions, std::span<const int> indices)
+{
+	if (!mesh_dedup)
+	{
+		return nullptr;
+	}
+
+	auto range = shared_mesh_buffers.equal_range(hash);
+	for (auto iter = range.first; iter != range.second; iter++)
+	{
+		if (sameMeshPayload(iter->second, source_file, positions, indices))
+		{
+			return &iter->second;
+		}
+	}
+	return nullptr;
+}
+
+// buffers of the previous batch frame become this accelerator's own
+const SSharedMeshBuffers* CAccelerator::findCachedMeshBuffers(uint64_t hash, const std::string& source_file, std::span<const glm::vec3> positions, std::span<const int> indices)
+{
+	SSharedMeshBuffers mesh_buffers;
+	if (!mesh_dedup || !mesh_cache || !mesh_cache->find(hash, source_file, positions, indices, mesh_buffers))
+	{
+		return nullptr;
+	}
+	return &shared_mesh_buffers.emplace(hash, std::move(mesh_buffers))->second;
+}
+
+const SSharedMeshBuffers* CAccelerator::createMeshBuffers(uint64_t hash, const std::string& source_file, std::span<const glm::vec3> positions, std::span<const int> indices)
+{
+	SSharedMeshBuffers mesh_buffers;
+	mesh_buffers.vertex_count = positions.size();
+	mesh_buffers.triangle_count = indices.size() / 3;
+	mesh_buffers.source_file = source_file;
+
+	// padded so that the last vertex can be read with a 16 byte load
+	mesh_buffers.vertex_buffer = newMeshBuffer(positions.size_bytes() + sizeof(float));
+	mesh_buffers.index_buffer = newMeshBuffer(mesh_buffers.triangle_count * 3 * sizeof(unsigned));
+	if (!mesh_buffers.vertex_buffer || !mesh_buffers.index_buffer)
+	{
+		memoryBudgetExceeded(MC_Embree, positions.size_bytes() + indices.size_bytes());
+	}
+	memcpy(rtcGetBufferData(mesh_buffers.vertex_buffer), positions.data(), positions.size_bytes());
+	memcpy(rtcGetBufferData(mesh_buffers.index_buffer), indices.data(), mesh_buffers.triangle_count * 3 * sizeof(unsigned));
+
+	if (mesh_cache && mesh_dedup)
+	{
+		mesh_cache->insert(hash, mesh_buffers);
+	}
+	return &shared_mesh_buffers.emplace(hash, std::move(mesh_buffers))->second;
+}
+
+// Embree allocates its own buffers with normal pages; with huge pages enabled
+// large buffers are allocated here and shared with Embree instead.
+RTCBuffer CAccelerator::newMeshBuffer(size_t bytes)
+{
+	// cached buffers outlive this accelerator, so Embree has to own their memory
+	if (!hugePagesEnabled() || bytes < large_allocation_size || mesh_cache)
+	{
+		return rtcNewBuffer(rt_device, bytes);
+	}
+
+	if (!trackMemory(MC_Embree, int64_t(bytes)))
 	{
-		geo_indices[idx] = unsigned(triangle_indices[idx]);
+		return nullptr;
 	}
+	void* data = allocateLarge(bytes);
+	mesh_buffer_memory.emplace_back(data, bytes);
+	return rtcNewSharedBuffer(rt_device, data, bytes);
+}
+
+RTCGeometry CAccelerator::attachMeshGeometry(RTCScene scene, const SSharedMeshBuffers* mesh_buffers, int ID)
+{
+	RTCGeometry geom = rtcNewGeometry(rt_device, RTC_GEOMETRY_TYPE_TRIANGLE);
+	rtcSetGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, mesh_buffers->vertex_buffer, 0, 3 * sizeof(float), mesh_buffers->vertex_count);
+	rtcSetGeometryBuffer(geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, mesh_buffers->index_buffer, 0, 3 * sizeof(unsigned), mesh_buffers->triangle_count);
 	rtcCommitGeometry(geom);
-	rtcAttachGeometryByID(rt_scene, geom, ID);
+	rtcAttachGeometryByID(scene, geom, ID);
 	return geom;
 }
 
-RTCGeometry CAccelerator::createRTCGeometry(SShapeSceneEntity* shape_entity, int ID, const std::filesystem::path& file_path)
+const SSharedMeshBuffers* CAccelerator::findOrCreateMeshBuffers(SShapeSceneEntity* shape_entity, const std::filesystem::path& file_path)
 {
+	const SSharedMeshBuffers* mesh_buffers = nullptr;
+	bool shared = false;
+	bool cached = false;
 	if (shape_entity->name == "trianglemesh")
 	{
-		std::vector<int> indices = shape_entity->parameters.GetIntArray("indices");
-		std::vector<glm::vec3> positions = shape_entity->parameters.GetPoint3fArray("P");
-		std::vector<glm::vec3> normals = shape_entity->parameters.GetPoint3fArray("N");
-		std::vector<glm::vec2> uvs = shape_entity->parameters.GetPoint2fArray("uv");
+		std::span<const int> indices = shape_entity->parameters.GetIntSpan("indices");
+		std::span<const glm::vec3> positions = shape_entity->parameters.GetPoint3fSpan("P");
 
-		RTCGeometry geom = rtcNewGeometry(rt_device, RTC_GEOMETRY_TYPE_TRIANGLE);
-		float* geo_vertices = (float*)rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 3 * sizeof(float), positions.size());
-		//float* geo_normals = (float*)rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_NORMAL, 0, RTC_FORMAT_FLOAT3, 3 * sizeof(float), normals.size());
-		//float* geo_uvs = (float*)rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 0, RTC_FORMAT_FLOAT2, 2 * sizeof(float), uvs.size());
-		unsigned* geo_indices = (unsigned*)rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 3 * sizeof(unsigned), indices.size() / 3);
-		memcpy(geo_vertices, positions.data(), positions.size() * sizeof(glm::vec3));
-		//memcpy(geo_normals, normals.data(), normals.size() * sizeof(glm::vec3));
-		for (int idx = 0; idx < indices.size(); idx++)
+		uint64_t hash = pbrt::HashBuffer(positions.data(), positions.size_bytes(), pbrt::HashBuffer(indices.data(), indices.size_bytes()));
+		mesh_buffers = findMeshBuffers(hash, std::string(), positions, indices);
+		shared = mesh_buffers != nullptr;
+		if (!shared)
+		{
+			mesh_buffers = findCachedMeshBuffers(hash, std::string(), positions, indices);
+			cached = mesh_buffers != nullptr;
+		}
+		if (!mesh_buffers)
 		{
-			geo_indices[idx] = unsigned(indices[idx]);
+			mesh_buffers = createMeshBuffers(hash, std::string(), positions, indices);
 		}
-		rtcCommitGeometry(geom);
-		rtcAttachGeometryByID(rt_scene, geom, ID);
-		return geom;
-		
 	}
 	else if (shape_entity->name == "plymesh")
 	{
 		std::string file_name = shape_entity->parameters.GetOneString("filename", "");
-		std::filesystem::path filepath = file_path / std::filesystem::path(file_name);
-		return readPLY(filepath.string(),ID);
+		std::string ply_file = (file_path / std::filesystem::path(file_name)).string();
+
+		// the file is only read for its first reference
+		uint64_t hash = pbrt::HashBuffer(ply_file.data(), ply_file.size());
+		mesh_buffers = findMeshBuffers(hash, ply_file, {}, {});
+		shared = mesh_buffers != nullptr;
+		if (!shared)
+		{
+			mesh_buffers = findCachedMeshBuffers(hash, ply_file, {}, {});
+			cached = mesh_buffers != nullptr;
+		}
+		if (!mesh_buffers)
+		{
+			mesh_buffers = readPLY(ply_file);
+		}
+	}
+	else
+	{
+		return nullptr;
+	}
+
+	size_t buffer_bytes = mesh_buffers->vertex_count * sizeof(glm::vec3) + mesh_buffers->triangle_count * 3 * sizeof(unsigned);
+	mesh_dedup_stats.shape_num++;
+	mesh_dedup_stats.buffer_bytes += buffer_bytes;
+	if (cached)
+	{
+		mesh_dedup_stats.cached_shape_num++;
+	}
+	if (shared)
+	{
+		mesh_dedup_stats.shared_shape_num++;
+		mesh_dedup_stats.shared_bytes += buffer_bytes;
+	}
+	return mesh_buffers;
+}
+
+RTCGeometry CAccelerator::createRTCGeometry(SShapeSceneEntity* shape_entity, int ID, const std::filesystem::path& file_path)
+{
+	const SSharedMeshBuffers* mesh_buffers = findOrCreateMeshBuffers(shape_entity, file_path);
+	if (mesh_buffers == nullptr)
+	{
+		return RTCGeometry();
+	}
+
+	if (geometry_buffers.size() <= size_t(ID))
+	{
+		geometry_buffers.resize(ID + 1, nullptr);
+	}
+	geometry_buffers[ID] = mesh_buffers;
+	if (backend == AB_WideBVH)
+	{
+		return nullptr;
+	}
+	return attachMeshGeometry(rt_scene, mesh_buffers, ID);
+}
+
+int CAccelerator::addLazyObject(std::vector<SShapeSceneEntity>&& shapes, const std::filesystem::path& file_path)
+{
+	std::unique_ptr<SLazyObject> lazy_object = std::make_unique<SLazyObject>();
+	lazy_object->shapes = std::move(shapes);
+	lazy_object->file_path = file_path;
+	lazy_object->bounds[0] = glm::vec3(std::numeric_limits<float>::max());
+	lazy_object->bounds[1] = glm::vec3(-std::numeric_limits<float>::max());
+
+	for (SShapeSceneEntity& shape_entity : lazy_object->shapes)
+	{
+		if (shape_entity.name == "trianglemesh")
+		{
+			for (const glm::vec3& position : shape_entity.parameters.GetPoint3fSpan("P"))
+			{
+				lazy_object->bounds[0] = glm::min(lazy_object->bounds[0], position);
+				lazy_object->bounds[1] = glm::max(lazy_object->bounds[1], position);
+			}
+		}
+		else if (shape_entity.name == "plymesh")
+		{
+			std::string file_name = shape_entity.parameters.GetOneString("filename", "");
+			readPLYBounds((file_path / std::filesystem::path(file_name)).string(), lazy_object->bounds);
+		}
+	}
+
+	lazy_objects.push_back(std::move(lazy_object));
+	return int(lazy_objects.size()) - 1;
+}
+
+void CAccelerator::addLazyInstance(int object_idx, const glm::mat4x4& world_from_object)
+{
+	const SLazyObject& lazy_object = *lazy_objects[object_idx];
+
+	SLazyInstance instance;
+	instance.object_idx = object_idx;
+	instance.object_from_world = glm::inverse(world_from_object);
+	instance.normal_to_world = glm::transpose(glm::mat3x3(instance.object_from_world));
+
+	glm::vec3 world_min(std::numeric_limits<float>::max());
+	glm::vec3 world_max(-std::numeric_limits<float>::max());
+	for (int corner_idx = 0; corner_idx < 8; corner_idx++)
+	{
+		glm::vec3 corner(lazy_object.bounds[corner_idx & 1].x, lazy_object.bounds[(corner_idx >> 1) & 1].y, lazy_object.bounds[corner_idx >> 2].z);
+		glm::vec3 world_corner = glm::vec3(world_from_object * glm::vec4(corner, 1.0f));
+		world_min = glm::min(world_min, world_corner);
+		world_max = glm::max(world_max, world_corner);
+	}
+	instance.world_bounds = { world_min.x, world_min.y, world_min.z, 0.0f, world_max.x, world_max.y, world_max.z, 0.0f };
+
+	// an object without readable geometry is never entered
+	if (lazy_object.bounds[0].x <= lazy_object.bounds[1].x)
+	{
+		lazy_instances.push_back(instance);
+	}
+}
+
+// the object's meshes and their materials, its parsed shapes are released
+std::vector<const SSharedMeshBuffers*> CAccelerator::createLazyObjectMeshes(SLazyObject& lazy_object)
+{
+	std::vector<const SSharedMeshBuffers*> object_meshes;
+	for (SShapeSceneEntity& shape_entity : lazy_object.shapes)
+	{
+		const SSharedMeshBuffers* mesh_buffers = findOrCreateMeshBuffers(&shape_entity, lazy_object.file_path);
+		auto mat_map_iter = mat_name_idx_map.find(shape_entity.material_name);
+		if (mesh_buffers != nullptr && mat_map_iter != mat_name_idx_map.end())
+		{
+			object_meshes.push_back(mesh_buffers);
+			lazy_object.material_indices.push_back(mat_map_iter->second);
+		}
+		shape_entity.parameters.releaseParameters();
+	}
+	lazy_object.shapes.clear();
+	return object_meshes;
+}
+
+// Builds on the first ray that enters an instance; rays reaching another
+// object in the meantime wait for the mesh buffers this build holds.
+RTCScene CAccelerator::lazyObjectScene(SLazyObject& lazy_object)
+{
+	RTCScene object_scene = lazy_object.rt_scene.load(std::memory_order_acquire);
+	if (object_scene)
+	{
+		return object_scene;
+	}
+
+	std::lock_guard<std::mutex> lock(lazy_build_mutex);
+	object_scene = lazy_object.rt_scene.load(std::memory_order_acquire);
+	if (object_scene)
+	{
+		return object_scene;
+	}
+
+	object_scene = rtcNewScene(rt_device);
+	if (compact_scene)
+	{
+		rtcSetSceneFlags(object_scene, RTC_SCENE_FLAG_COMPACT);
+	}
+	std::vector<const SSharedMeshBuffers*> object_meshes = createLazyObjectMeshes(lazy_object);
+	for (size_t geometry_id = 0; geometry_id < object_meshes.size(); geometry_id++)
+	{
+		// the scene keeps the geometry and the geometry keeps its buffers
+		rtcReleaseGeometry(attachMeshGeometry(object_scene, object_meshes[geometry_id], int(geometry_id)));
+	}
+	rtcCommitScene(object_scene);
+
+	lazy_object.rt_scene.store(object_scene, std::memory_order_release);
+	return object_scene;
+}
+
+void CAccelerator::lazyInstanceBounds(const RTCBoundsFunctionArguments* args)
+{
+	const CAccelerator* accelerator = (const CAccelerator*)args->geometryUserPtr;
+	*args->bounds_o = accelerator->lazy_instances[args->primID].world_bounds;
+}
+
+// Both overloads transform the direction without normalizing it: its length
+// changes with the scale of the transform, which keeps t the same in both spaces.
+static SBVHRay objectSpaceRay(const SBVHRay& ray, const glm::mat4x4& object_from_world)
+{
+	SBVHRay object_ray = ray;
+	object_ray.origin = glm::vec3(object_from_world * glm::vec4(ray.origin, 1.0f));
+	object_ray.direction = glm::vec3(object_from_world * glm::vec4(ray.direction, 0.0f));
+	return object_ray;
+}
+
+static RTCRay objectSpaceRay(const RTCRay& ray, const glm::mat4x4& object_from_world)
+{
+	glm::vec3 origin = glm::vec3(object_from_world * glm::vec4(ray.org_x, ray.org_y, ray.org_z, 1.0f));
+	glm::vec3 direction = glm::vec3(object_from_world * glm::vec4(ray.dir_x, ray.dir_y, ray.dir_z, 0.0f));
+
+	RTCRay object_ray = ray;
+	object_ray.org_x = origin.x;
+	object_ray.org_y = origin.y;
+	object_ray.org_z = origin.z;
+	object_ray.dir_x = direction.x;
+	object_ray.dir_y = direction.y;
+	object_ray.dir_z = direction.z;
+	return object_ray;
+}
+
+// only single rays are traced, so N is 1 and the ray layout is RTCRayHit's
+void CAccelerator::intersectLazyInstance(const RTCIntersectFunctionNArguments* args)
+{
+	if (!args->valid[0])
+	{
+		return;
+	}
+	CAccelerator* accelerator = (CAccelerator*)args->geometryUserPtr;
+	const SLazyInstance& instance = accelerator->lazy_instances[args->primID];
+	RTCScene object_scene = accelerator->lazyObjectScene(*accelerator->lazy_objects[instance.object_idx]);
+	RTCRay object_ray = objectSpaceRay(((RTCRayHit*)args->rayhit)->ray, instance.object_from_world);
+	rtcForwardIntersect1(args, object_scene, &object_ray, args->primID);
+}
+
+void CAccelerator::occludedLazyInstance(const RTCOccludedFunctionNArguments* args)
+{
+	if (!args->valid[0])
+	{
+		return;
+	}
+	CAccelerator* accelerator = (CAccelerator*)args->geometryUserPtr;
+	const SLazyInstance& instance = accelerator->lazy_instances[args->primID];
+	RTCScene object_scene = accelerator->lazyObjectScene(*accelerator->lazy_objects[instance.object_idx]);
+	RTCRay object_ray = objectSpaceRay(*(RTCRay*)args->ray, instance.object_from_world);
+	rtcForwardOccluded1(args, object_scene, &object_ray, args->primID);
+}
+
+// Same double checked build as lazyObjectScene. The build runs inside a render
+// job holding lazy_build_mutex, so it stays on the calling thread.
+CWideBVH* CAccelerator::lazyObjectBVH(SLazyObject& lazy_object)
+{
+	CWideBVH* object_bvh = lazy_object.wide_bvh.load(std::memory_order_acquire);
+	if (object_bvh)
+	{
+		return object_bvh;
+	}
+
+	std::lock_guard<std::mutex> lock(lazy_build_mutex);
+	object_bvh = lazy_object.wide_bvh.load(std::memory_order_acquire);
+	if (object_bvh)
+	{
+		return object_bvh;
+	}
+
+	object_bvh = new CWideBVH();
+	std::vector<const SSharedMeshBuffers*> object_meshes = createLazyObjectMeshes(lazy_object);
+	for (size_t geometry_id = 0; geometry_id < object_meshes.size(); geometry_id++)
+	{
+		const SSharedMeshBuffers* mesh_buffers = object_meshes[geometry_id];
+		object_bvh->addTriangles(uint32_t(geometry_id), (const glm::vec3*)rtcGetBufferData(mesh_buffers->vertex_buffer), (const uint32_t*)rtcGetBufferData(mesh_buffers->index_buffer), mesh_buffers->triangle_count);
+	}
+	object_bvh->build(false);
+
+	lazy_object.wide_bvh.store(object_bvh, std::memory_order_release);
+	return object_bvh;
+}
+
+bool CAccelerator::intersectLazyInstanceBVH(void* user_ptr, uint32_t prim_id, SBVHRay& ray, SBVHHit& hit)
+{
+	CAccelerator* accelerator = (CAccelerator*)user_ptr;
+	const SLazyInstance& instance = accelerator->lazy_instances[prim_id];
+	CWideBVH* object_bvh = accelerator->lazyObjectBVH(*accelerator->lazy_objects[instance.object_idx]);
+	SBVHRay object_ray = objectSpaceRay(ray, instance.object_from_world);
+	if (!object_bvh->intersect(object_ray, hit))
+	{
+		return false;
+	}
+	ray.tfar = object_ray.tfar;
+	hit.inst_id = prim_id;
+	return true;
+}
+
+bool CAccelerator::occludedLazyInstanceBVH(void* user_ptr, uint32_t prim_id, const SBVHRay& ray)
+{
+	CAccelerator* accelerator = (CAccelerator*)user_ptr;
+	const SLazyInstance& instance = accelerator->lazy_instances[prim_id];
+	CWideBVH* object_bvh = accelerator->lazyObjectBVH(*accelerator->lazy_objects[instance.object_idx]);
+	return object_bvh->occluded(objectSpaceRay(ray, instance.object_from_world));
+}
+
+// Geometry IDs index scene_geometries, instance prim_ids index lazy_instances.
+// The triangles are copied into the BVH, so without lazy objects that may
+// still share them the mesh buffers are released afterwards.
+void CAccelerator::buildWideBVH()
+{
+	wide_bvh = std::make_unique<CWideBVH>();
+	for (size_t geometry_id = 0; geometry_id < geometry_buffers.size(); geometry_id++)
+	{
+		const SSharedMeshBuffers* mesh_buffers = geometry_buffers[geometry_id];
+		if (mesh_buffers != nullptr)
+		{
+			wide_bvh->addTriangles(uint32_t(geometry_id), (const glm::vec3*)rtcGetBufferData(mesh_buffers->vertex_buffer), (const uint32_t*)rtcGetBufferData(mesh_buffers->index_buffer), mesh_buffers->triangle_count);
+		}
+	}
+
+	for (const SLazyInstance& instance : lazy_instances)
+	{
+		const RTCBounds& bounds = instance.world_bounds;
+		wide_bvh->addProcedural(glm::vec3(bounds.lower_x, bounds.lower_y, bounds.lower_z), glm::vec3(bounds.upper_x, bounds.upper_y, bounds.upper_z));
+	}
+	wide_bvh->setProceduralFunctions(this, intersectLazyInstanceBVH, occludedLazyInstanceBVH);
+	wide_bvh->build(true);
+
+	if (!lazy_instances.empty())
+	{
+		printf("%zu instances of %zu objects are built when a ray first reaches them\n", lazy_instances.size(), lazy_objects.size());
+	}
+	if (getNumaNodeCount() > 1)
+	{
+		printf("the wide BVH is not replicated, all NUMA nodes share one copy\n");
 	}
-	return RTCGeometry();
+
+	if (lazy_objects.empty())
+	{
+		for (auto& buffer_iter : shared_mesh_buffers)
+		{
+			rtcReleaseBuffer(buffer_iter.second.vertex_buffer);
+			rtcReleaseBuffer(buffer_iter.second.index_buffer);
+		}
+		shared_mesh_buffers.clear();
+		geometry_buffers.clear();
+	}
+}
+
+// geometry IDs index scene_geometries, the instances take the next one
+void CAccelerator::attachLazyInstances()
+{
+	if (lazy_instances.empty())
+	{
+		return;
+	}
+
+	lazy_geometry = rtcNewGeometry(rt_device, RTC_GEOMETRY_TYPE_USER);
+	rtcSetGeometryUserPrimitiveCount(lazy_geometry, unsigned(lazy_instances.size()));
+	rtcSetGeometryUserData(lazy_geometry, this);
+	rtcSetGeometryBoundsFunction(lazy_geometry, lazyInstanceBounds, nullptr);
+	rtcSetGeometryIntersectFunction(lazy_geometry, intersectLazyInstance);
+	rtcSetGeometryOccludedFunction(lazy_geometry, occludedLazyInstance);
+	rtcCommitGeometry(lazy_geometry);
+	rtcAttachGeometryByID(rt_scene, lazy_geometry, unsigned(scene_geometries.size()));
+	printf("%zu instances of %zu objects are built when a ray first reaches them\n", lazy_instances.size(), lazy_objects.size());
 }
 
 void CAccelerator::finalizeRtSceneCreate()
 {
+	if (backend == AB_WideBVH)
+	{
+		buildWideBVH();
+		mesh_cache = nullptr;
+		return;
+	}
+
+	attachLazyInstances();
+
+	if (compact_scene)
+	{
+		rtcSetSceneFlags(rt_scene, RTC_SCENE_FLAG_COMPACT);
+	}
 	rtcCommitScene(rt_scene);
+
+	// over the memory budget: retry once with the smallest BVH Embree can build
+	if (rtcGetDeviceError(rt_device) == RTC_ERROR_OUT_OF_MEMORY)
+	{
+		printf("BVH build exceeded the memory budget, retrying with a compact low quality BVH\n");
+		rtcSetSceneFlags(rt_scene, RTC_SCENE_FLAG_COMPACT);
+		rtcSetSceneBuildQuality(rt_scene, RTC_BUILD_QUALITY_LOW);
+		rtcCommitScene(rt_scene);
+		if (rtcGetDeviceError(rt_device) == RTC_ERROR_OUT_OF_MEMORY)
+		{
+			memoryBudgetExceeded(MC_Embree, 0);
+		}
+	}
+
+	replicateForNumaNodes();
+
+	// lazy objects are built during the render, while the next batch frame may be using the cache
+	mesh_cache = nullptr;
+}
+
+// In NUMA mode every node traverses its own copy of the scene. The buffers are
+// copied from a thread pinned to the node, so first touch places them in the
+// node's memory; the BVH is committed from there as well.
+void CAccelerator::replicateForNumaNodes()
+{
+	node_scenes.assign(1, rt_scene);
+
+	int node_num = getNumaNodeCount();
+	if (node_num <= 1)
+	{
+		return;
+	}
+
+	size_t replica_bytes = getTrackedMemory(MC_Embree);
+	if (getMemoryBudget() != 0 && getTrackedMemory() + replica_bytes * (node_num - 1) > getMemoryBudget())
+	{
+		printf("the memory budget does not allow replicating the scene on %d NUMA nodes, all nodes share one copy\n", node_num);
+		return;
+	}
+
+	for (int node_idx = 1; node_idx < node_num; node_idx++)
+	{
+		runOnNumaNode(node_idx, [&]() {
+			RTCScene node_scene = rtcNewScene(rt_device);
+			rtcSetSceneFlags(node_scene, rtcGetSceneFlags(rt_scene));
+
+			std::unordered_map<const SSharedMeshBuffers*, SSharedMeshBuffers> node_buffers;
+			for (size_t geometry_id = 0; geometry_id < geometry_buffers.size(); geometry_id++)
+			{
+				const SSharedMeshBuffers* mesh_buffers = geometry_buffers[geometry_id];
+				if (mesh_buffers == nullptr)
+				{
+					continue;
+				}
+
+				auto buffer_iter = node_buffers.find(mesh_buffers);
+				if (buffer_iter == node_buffers.end())
+				{
+					size_t vertex_bytes = mesh_buffers->vertex_count * sizeof(glm::vec3) + sizeof(float);
+					size_t index_bytes = mesh_buffers->triangle_count * 3 * sizeof(unsigned);
+
+					SSharedMeshBuffers node_mesh_buffers = *mesh_buffers;
+					node_mesh_buffers.vertex_buffer = newMeshBuffer(vertex_bytes);
+					node_mesh_buffers.index_buffer = newMeshBuffer(index_bytes);
+					if (!node_mesh_buffers.vertex_buffer || !node_mesh_buffers.index_buffer)
+					{
+						memoryBudgetExceeded(MC_Embree, vertex_bytes + index_bytes);
+					}
+					memcpy(rtcGetBufferData(node_mesh_buffers.vertex_buffer), rtcGetBufferData(mesh_buffers->vertex_buffer), vertex_bytes);
+					memcpy(rtcGetBufferData(node_mesh_buffers.index_buffer), rtcGetBufferData(mesh_buffers->index_buffer), index_bytes);
+					buffer_iter = node_buffers.emplace(mesh_buffers, node_mesh_buffers).first;
+				}
+
+				// the scene keeps the geometry and the geometry keeps its buffers
+				rtcReleaseGeometry(attachMeshGeometry(node_scene, &buffer_iter->second, int(geometry_id)));
+			}
+
+			// the lazy objects are built once and shared by all nodes
+			if (lazy_geometry)
+			{
+				rtcAttachGeometryByID(node_scene, lazy_geometry, unsigned(scene_geometries.size()));
+			}
+
+			for (auto& buffer_iter : node_buffers)
+			{
+				rtcReleaseBuffer(buffer_iter.second.vertex_buffer);
+				rtcReleaseBuffer(buffer_iter.second.index_buffer);
+			}
+
+			rtcCommitScene(node_scene);
+			node_scenes.push_back(node_scene);
+			});
+	}
+	printf("scene replicated on %d NUMA nodes\n", node_num);
 }
 
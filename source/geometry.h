@@ -1,26 +1,135 @@
 #pragma once
 #include <embree4/rtcore.h>
 #include <map>
+#include <unordered_map>
+#include <span>
 #include <string>
 #include <filesystem>
+#include <memory>
+#include <mutex>
+#include <glm/matrix.hpp>
 
 #include "ray.h"
 #include "material.h"
 #include "sampling.h"
 #include "interaction.h"
+#include "memory_tracker.h"
+#include "parallel.h"
+#include "bvh.h"
+
+enum EAcceleratorBackend
+{
+	AB_Embree,
+	AB_WideBVH, // CWideBVH, see bvh.h
+};
 
 struct SA7XGeometry
 {
-	RTCGeometry geometry;
+	RTCGeometry geometry; // nullptr with the wide BVH backend
 	int material_idx;
 };
 
+// vertex and index buffers of one mesh payload, shared by all shapes with identical data
+struct SSharedMeshBuffers
+{
+	RTCBuffer vertex_buffer;
+	RTCBuffer index_buffer;
+	size_t vertex_count;
+	size_t triangle_count;
+
+	// plymesh payloads are identified by their file
+	std::string source_file;
+};
+
+// Mesh buffers kept between the frames of a batch render. Accelerators using
+// the cache share its Embree device, so a mesh byte-identical to one of the
+// previous frame (static set dressing) reuses its buffers instead of being
+// loaded again. A PLY file counts as unchanged while its path, size and
+// modification time are. Only one accelerator at a time may build with it.
+class CMeshBufferCache
+{
+public:
+	CMeshBufferCache();
+	~CMeshBufferCache();
+
+	// buffers the previous frame did not use are released
+	void beginFrame();
+
+	inline RTCDevice getDevice()const { return device; }
+
+	// the returned buffers are retained for the caller
+	bool find(uint64_t hash, const std::string& source_file, std::span<const glm::vec3> positions, std::span<const int> indices, SSharedMeshBuffers& mesh_buffers);
+	void insert(uint64_t hash, const SSharedMeshBuffers& mesh_buffers);
+
+private:
+	struct SCachedMeshBuffers
+	{
+		SSharedMeshBuffers mesh_buffers;
+		uint64_t file_stamp;
+		int last_frame;
+	};
+
+	RTCDevice device;
+	std::unordered_multimap<uint64_t, SCachedMeshBuffers> cached_buffers;
+	int frame_idx = 0;
+};
+
+struct SMeshDedupStats
+{
+	int shape_num = 0;
+	int shared_shape_num = 0;
+	int cached_shape_num = 0; // reused from the previous frame of a batch
+	size_t buffer_bytes = 0;
+	size_t shared_bytes = 0;
+};
+
+// Emissive meshes, kept on the CPU for light sampling. The compact layout
+// stores 16 bit indices for meshes with at most 64k vertices, octahedral
+// encoded normals and half precision uvs; attributes are decoded on access.
 struct STriangleMesh
 {
-	std::vector<int> indices;
-	std::vector<glm::vec3> points;
-	std::vector<glm::vec3> normals;
-	std::vector<glm::vec2> uvs;
+	void init(std::span<const int> ipt_indices, std::span<const glm::vec3> ipt_points, std::span<const glm::vec3> ipt_normals, std::span<const glm::vec2> ipt_uvs, bool compact);
+	bool sameData(const STriangleMesh& other)const;
+
+	size_t memoryBytes()const;
+	size_t fullPrecisionBytes()const;
+
+	inline size_t triangleCount()const { return triangle_count; }
+
+	inline glm::i32vec3 triangle(int tri_index)const
+	{
+		if (!indices16.empty())
+		{
+			return glm::i32vec3(indices16[tri_index * 3 + 0], indices16[tri_index * 3 + 1], indices16[tri_index * 3 + 2]);
+		}
+		return glm::i32vec3(indices[tri_index * 3 + 0], indices[tri_index * 3 + 1], indices[tri_index * 3 + 2]);
+	}
+
+	inline bool hasNormals()const { return !normals.empty() || !oct_normals.empty(); }
+	inline glm::vec3 normal(int vtx_index)const
+	{
+		return oct_normals.empty() ? normals[vtx_index] : decodeOctahedral(oct_normals[vtx_index]);
+	}
+
+	inline bool hasUVs()const { return !uvs.empty() || !half_uvs.empty(); }
+	inline glm::vec2 uv(int vtx_index)const
+	{
+		return half_uvs.empty() ? uvs[vtx_index] : glm::unpackHalf2x16(half_uvs[vtx_index]);
+	}
+
+	TrackedVector<glm::vec3, MC_Meshes> points;
+
+	// full precision layout
+	TrackedVector<int, MC_Meshes> indices;
+	TrackedVector<glm::vec3, MC_Meshes> normals;
+	TrackedVector<glm::vec2, MC_Meshes> uvs;
+
+	// compact layout
+	TrackedVector<uint16_t, MC_Meshes> indices16;
+	TrackedVector<uint32_t, MC_Meshes> oct_normals;
+	TrackedVector<uint32_t, MC_Meshes> half_uvs;
+
+	size_t triangle_count = 0;
 };
 
 struct SShapeSample
@@ -40,28 +149,30 @@ public:
 
 	inline float area()
 	{
-		const std::shared_ptr<STriangleMesh> tri_mesh = triangle_mesh;
-		const std::vector<int>& indices = tri_mesh->indices;
-		const std::vector<glm::vec3> points = tri_mesh->points;
-		glm::i32vec3 vtx_indices(indices[tri_index * 3 + 0], indices[tri_index * 3 + 1], indices[tri_index * 3 + 2]);
-		glm::vec3 positions[3] = { points[vtx_indices.x],points[vtx_indices.y], points[vtx_indices.z] };
+		const STriangleMesh& tri_mesh = *triangle_mesh;
+		glm::i32vec3 vtx_indices = tri_mesh.triangle(tri_index);
+		glm::vec3 positions[3] = { tri_mesh.points[vtx_indices.x],tri_mesh.points[vtx_indices.y], tri_mesh.points[vtx_indices.z] };
 		return 0.5f * glm::length(glm::cross(positions[1] - positions[0], positions[2] - positions[0]));
 	}
 
 	inline SShapeSample sample(glm::vec2 u)
 	{
-		const std::shared_ptr<STriangleMesh> tri_mesh = triangle_mesh;
-		const std::vector<int>& indices = tri_mesh->indices;
-		const std::vector<glm::vec3> points = tri_mesh->points;
-		const std::vector<glm::vec3> normals = tri_mesh->normals;
-
-		glm::i32vec3 vtx_indices(indices[tri_index * 3 + 0], indices[tri_index * 3 + 1], indices[tri_index * 3 + 2]);
-		glm::vec3 positions[3] = { points[vtx_indices.x],points[vtx_indices.y], points[vtx_indices.z] };
-		glm::vec3 normal[3] = { normals[vtx_indices.x],normals[vtx_indices.y], normals[vtx_indices.z] };
+		const STriangleMesh& tri_mesh = *triangle_mesh;
+		glm::i32vec3 vtx_indices = tri_mesh.triangle(tri_index);
+		glm::vec3 positions[3] = { tri_mesh.points[vtx_indices.x],tri_mesh.points[vtx_indices.y], tri_mesh.points[vtx_indices.z] };
 		glm::vec3 barycentric_coords = sampleUniformTriangle(u); //!
 
 		glm::vec3 sampled_pos = positions[0] * barycentric_coords.x + positions[1] * barycentric_coords.y + positions[2] * barycentric_coords.z;
-		glm::vec3 sampled_normal = normal[0] * barycentric_coords.x + normal[1] * barycentric_coords.y + normal[2] * barycentric_coords.z;
+		glm::vec3 sampled_normal;
+		if (tri_mesh.hasNormals())
+		{
+			glm::vec3 normal[3] = { tri_mesh.normal(vtx_indices.x),tri_mesh.normal(vtx_indices.y), tri_mesh.normal(vtx_indices.z) };
+			sampled_normal = normal[0] * barycentric_coords.x + normal[1] * barycentric_coords.y + normal[2] * barycentric_coords.z;
+		}
+		else
+		{
+			sampled_normal = glm::cross(positions[1] - positions[0], positions[2] - positions[0]);
+		}
 		sampled_normal = glm::normalize(sampled_normal);
 
 		return SShapeSample{ CInteraction {sampled_pos,sampled_normal},area()};
@@ -124,10 +235,20 @@ struct SShapeInteraction
 };
 
 class SShapeSceneEntity;
+struct SLazyObject;
+
+struct SLazyInstance
+{
+	int object_idx;
+	glm::mat4x4 object_from_world;
+	glm::mat3x3 normal_to_world;
+	RTCBounds world_bounds;
+};
+
 class CAccelerator
 {
 public:
-	CAccelerator();
+	CAccelerator(CMeshBufferCache* mesh_cache = nullptr, EAcceleratorBackend backend = AB_Embree);
 	~CAccelerator();
 	
 	SShapeInteraction intersection(CRay ray);
@@ -136,19 +257,91 @@ public:
 	// false = occluded
 	bool traceVisibilityRay(CRay ray, float max_t);
 
+	// the wide BVH backend only keeps the mesh buffers and returns nullptr, its
+	// BVH is built from them in finalizeRtSceneCreate
 	RTCGeometry createRTCGeometry(SShapeSceneEntity* shape_entity, int ID,const std::filesystem::path& file_path);
+
+	// An ObjectBegin/ObjectEnd definition: only the bounds of its meshes are
+	// read here, the meshes and their Embree scene are built when a ray first
+	// enters one of its instances. Returns the object index.
+	int addLazyObject(std::vector<SShapeSceneEntity>&& shapes, const std::filesystem::path& file_path);
+	void addLazyInstance(int object_idx, const glm::mat4x4& world_from_object);
+
 	void finalizeRtSceneCreate();
 
+	inline const SMeshDedupStats& getMeshDedupStats()const { return mesh_dedup_stats; }
+	inline EAcceleratorBackend getBackend()const { return backend; }
+
+	// RTC_SCENE_FLAG_COMPACT, trades some traversal speed for a smaller BVH
+	inline void enableCompactScene() { compact_scene = true; }
+
 private:
-	RTCGeometry readPLY(const std::string& file_name, int ID);
+	const SSharedMeshBuffers* readPLY(const std::string& file_name);
+	const SSharedMeshBuffers* findOrCreateMeshBuffers(SShapeSceneEntity* shape_entity, const std::filesystem::path& file_path);
+
+	const SSharedMeshBuffers* findMeshBuffers(uint64_t hash, const std::string& source_file, std::span<const glm::vec3> positions, std::span<const int> indices);
+	const SSharedMeshBuffers* findCachedMeshBuffers(uint64_t hash, const std::string& source_file, std::span<const glm::vec3> positions, std::span<const int> indices);
+	const SSharedMeshBuffers* createMeshBuffers(uint64_t hash, const std::string& source_file, std::span<const glm::vec3> positions, std::span<const int> indices);
+	RTCGeometry attachMeshGeometry(RTCScene scene, const SSharedMeshBuffers* mesh_buffers, int ID);
+
+	// the hit shared by both backends; instance is set for hits inside a lazy object
+	SShapeInteraction shapeInteraction(const CRay& ray, float hit_t, unsigned geometry_id, const SLazyInstance* instance, glm::vec3 hit_normal)const;
+
+	// nullptr when the memory budget is exceeded
+	RTCBuffer newMeshBuffer(size_t bytes);
+
+	void replicateForNumaNodes();
+
+	// Lazy instances are the primitives of one user geometry whose callbacks
+	// forward the ray into the object's scene, building it on the first hit.
+	void attachLazyInstances();
+	RTCScene lazyObjectScene(SLazyObject& lazy_object);
+	std::vector<const SSharedMeshBuffers*> createLazyObjectMeshes(SLazyObject& lazy_object);
+	static void lazyInstanceBounds(const RTCBoundsFunctionArguments* args);
+	static void intersectLazyInstance(const RTCIntersectFunctionNArguments* args);
+	static void occludedLazyInstance(const RTCOccludedFunctionNArguments* args);
+
+	// the wide BVH counterparts: the instances are procedural primitives of the top level BVH
+	void buildWideBVH();
+	CWideBVH* lazyObjectBVH(SLazyObject& lazy_object);
+	static bool intersectLazyInstanceBVH(void* user_ptr, uint32_t prim_id, SBVHRay& ray, SBVHHit& hit);
+	static bool occludedLazyInstanceBVH(void* user_ptr, uint32_t prim_id, const SBVHRay& ray);
+
+	// the calling thread's NUMA replica of rt_scene
+	inline RTCScene traversalScene()const
+	{
+		int numa_node = getCurrentNumaNode();
+		return size_t(numa_node) < node_scenes.size() ? node_scenes[numa_node] : rt_scene;
+	}
 
 	friend class CAlpa7XScene;
 
+	EAcceleratorBackend backend;
 	RTCScene rt_scene;
 	RTCDevice rt_device;
+	std::unique_ptr<CWideBVH> wide_bvh;
 
 	std::map<std::string, int> mat_name_idx_map;
 	std::vector<CMaterial*> scene_materials;
 	std::vector<SA7XGeometry> scene_geometries;
 	std::vector<STriangleMesh> lights_triangles;
+
+	// content hash -> buffers, see findMeshBuffers
+	bool mesh_dedup = true;
+	bool compact_scene = false;
+	std::unordered_multimap<uint64_t, SSharedMeshBuffers> shared_mesh_buffers;
+	CMeshBufferCache* mesh_cache;
+	SMeshDedupStats mesh_dedup_stats;
+
+	// buffers of every geometry ID, used to build the NUMA replicas and the wide BVH
+	std::vector<const SSharedMeshBuffers*> geometry_buffers;
+	std::vector<RTCScene> node_scenes;
+
+	// huge page memory behind shared Embree buffers, freed after the device
+	std::vector<std::pair<void*, size_t>> mesh_buffer_memory;
+
+	std::vector<std::unique_ptr<SLazyObject>> lazy_objects;
+	std::vector<SLazyInstance> lazy_instances;
+	RTCGeometry lazy_geometry = nullptr;
+	std::mutex lazy_build_mutex;
 };
\ No newline at end of file
@@ -0,0 +1,331 @@
+#include "image_output.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <glm/gtc/packing.hpp>
+#include "stb_image_write.h"
+
+#if defined(A7X_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+EImageFormat getImageFormat(const std::string& file_name)
+{
+	std::string extension = std::filesystem::path(file_name).extension().string();
+	std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return char(std::tolower(c)); });
+	if (extension == ".exr")
+	{
+		return IF_EXR;
+	}
+	if (extension == ".pfm")
+	{
+		return IF_PFM;
+	}
+	if (extension == ".png")
+	{
+		return IF_PNG;
+	}
+	return IF_TGA;
+}
+
+static void appendBytes(std::vector<uint8_t>& dst, const void* data, size_t size)
+{
+	dst.insert(dst.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+}
+
+template<typename T>
+static void appendValue(std::vector<uint8_t>& dst, T value)
+{
+	appendBytes(dst, &value, sizeof(T));
+}
+
+static void appendExrAttribute(std::vector<uint8_t>& dst, const char* name, const char* type, const std::vector<uint8_t>& value)
+{
+	appendBytes(dst, name, strlen(name) + 1);
+	appendBytes(dst, type, strlen(type) + 1);
+	appendValue(dst, int32_t(value.size()));
+	appendBytes(dst, value.data(), value.size());
+}
+
+// OpenEXR's preprocessing for RLE and ZIP: split the bytes into even and odd
+// halves, then store the differences between neighbouring bytes
+static void exrPredict(const std::vector<uint8_t>& raw, std::vector<uint8_t>& predicted)
+{
+	predicted.resize(raw.size());
+	size_t half_size = (raw.size() + 1) / 2;
+	for (size_t idx = 0; idx < raw.size(); idx++)
+	{
+		predicted[(idx & 1) ? half_size + idx / 2 : idx / 2] = raw[idx];
+	}
+
+	int previous = predicted.empty() ? 0 : predicted[0];
+	for (size_t idx = 1; idx < predicted.size(); idx++)
+	{
+		int current = predicted[idx];
+		predicted[idx] = uint8_t(current - previous + (128 + 256));
+		previous = current;
+	}
+}
+
+static void exrRleCompress(const std::vector<uint8_t>& src, std::vector<uint8_t>& dst)
+{
+	const int min_run_length = 3;
+	const int max_run_length = 127;
+
+	dst.clear();
+	const uint8_t* run_start = src.data();
+	const uint8_t* src_end = src.data() + src.size();
+	const uint8_t* run_end = run_start + 1;
+	while (run_start < src_end)
+	{
+		while (run_end < src_end && *run_start == *run_end && run_end - run_start - 1 < max_run_length)
+		{
+			++run_end;
+		}
+
+		if (run_end - run_start >= min_run_length)
+		{
+			// a run of identical bytes
+			dst.push_back(uint8_t((run_end - run_start) - 1));
+			dst.push_back(*run_start);
+			run_start = run_end;
+		}
+		else
+		{
+			// uncompressed bytes until the next run of three
+			while (run_end < src_end &&
+				((run_end + 1 >= src_end || *run_end != *(run_end + 1)) || (run_end + 2 >= src_end || *(run_end + 1) != *(run_end + 2))) &&
+				run_end - run_start < max_run_length)
+			{
+				++run_end;
+			}
+
+			dst.push_back(uint8_t(run_start - run_end));
+			while (run_start < run_end)
+			{
+				dst.push_back(*run_start++);
+			}
+		}
+		++run_end;
+	}
+}
+
+// single part scanline image with B, G, R channels
+static bool writeExr(const SImageOutputJob& job)
+{
+	EExrCompression compression = job.exr_compression;
+#if !defined(A7X_HAVE_ZLIB)
+	if (compression == EC_Zip)
+	{
+		compression = EC_RLE;
+	}
+#endif
+	const int lines_per_block = compression == EC_Zip ? 16 : 1;
+
+	std::vector<uint8_t> file_data;
+	appendValue(file_data, int32_t(20000630));
+	appendValue(file_data, int32_t(2));
+
+	std::vector<uint8_t> value;
+	for (const char* channel_name : { "B", "G", "R" })
+	{
+		appendBytes(value, channel_name, 2);
+		appendValue(value, int32_t(job.exr_half ? 1 : 2));
+		appendValue(value, int32_t(0)); // pLinear and reserved
+		appendValue(value, int32_t(1));
+		appendValue(value, int32_t(1));
+	}
+	value.push_back(0);
+	appendExrAttribute(file_data, "channels", "chlist", value);
+
+	value.assign(1, uint8_t(compression));
+	appendExrAttribute(file_data, "compression", "compression", value);
+
+	value.clear();
+	appendValue(value, int32_t(0));
+	appendValue(value, int32_t(0));
+	appendValue(value, int32_t(job.width - 1));
+	appendValue(value, int32_t(job.height - 1));
+	appendExrAttribute(file_data, "dataWindow", "box2i", value);
+	appendExrAttribute(file_data, "displayWindow", "box2i", value);
+
+	value.assign(1, uint8_t(0));
+	appendExrAttribute(file_data, "lineOrder", "lineOrder", value);
+
+	value.clear();
+	appendValue(value, 1.0f);
+	appendExrAttribute(file_data, "pixelAspectRatio", "float", value);
+
+	value.clear();
+	appendValue(value, 0.0f);
+	appendValue(value, 0.0f);
+	appendExrAttribute(file_data, "screenWindowCenter", "v2f", value);
+
+	value.clear();
+	appendValue(value, 1.0f);
+	appendExrAttribute(file_data, "screenWindowWidth", "float", value);
+	file_data.push_back(0);
+
+	int block_num = (job.height + lines_per_block - 1) / lines_per_block;
+	size_t offset_table_pos = file_data.size();
+	file_data.resize(file_data.size() + block_num * sizeof(uint64_t));
+
+	std::vector<uint8_t> raw_block, predicted_block, packed_block;
+	for (int block_idx = 0; block_idx < block_num; block_idx++)
+	{
+		uint64_t block_offset = file_data.size();
+		memcpy(file_data.data() + offset_table_pos + block_idx * sizeof(uint64_t), &block_offset, sizeof(uint64_t));
+
+		int y_begin = block_idx * lines_per_block;
+		int y_end = (std::min)(y_begin + lines_per_block, int(job.height));
+
+		raw_block.clear();
+		for (int y = y_begin; y < y_end; y++)
+		{
+			const float* row = job.hdr_pixels.data() + size_t(y) * job.width * 3;
+			for (int channel_idx = 2; channel_idx >= 0; channel_idx--)
+			{
+				for (uint32_t x = 0; x < job.width; x++)
+				{
+					float channel = row[x * 3 + channel_idx];
+					if (job.exr_half)
+					{
+						appendValue(raw_block, uint16_t(glm::packHalf1x16(channel)));
+					}
+					else
+					{
+						appendValue(raw_block, channel);
+					}
+				}
+			}
+		}
+
+		const std::vector<uint8_t>* block_data = &raw_block;
+		if (compression != EC_None)
+		{
+			exrPredict(raw_block, predicted_block);
+			if (compression == EC_RLE)
+			{
+				exrRleCompress(predicted_block, packed_block);
+			}
+#if defined(A7X_HAVE_ZLIB)
+			else
+			{
+				uLongf packed_size = compressBound(uLong(predicted_block.size()));
+				packed_block.resize(packed_size);
+				compress2(packed_block.data(), &packed_size, predicted_block.data(), uLong(predicted_block.size()), Z_DEFAULT_COMPRESSION);
+				packed_block.resize(packed_size);
+			}
+#endif
+			// readers take a block as uncompressed if it did not get smaller
+			if (packed_block.size() < raw_block.size())
+			{
+				block_data = &packed_block;
+			}
+		}
+
+		appendValue(file_data, int32_t(y_begin));
+		appendValue(file_data, int32_t(block_data->size()));
+		appendBytes(file_data, block_data->data(), block_data->size());
+	}
+
+	FILE* file = fopen(job.file_name.c_str(), "wb");
+	if (!file)
+	{
+		return false;
+	}
+	bool written = fwrite(file_data.data(), 1, file_data.size(), file) == file_data.size();
+	return (fclose(file) == 0) && written;
+}
+
+static bool writePfm(const SImageOutputJob& job)
+{
+	FILE* file = fopen(job.file_name.c_str(), "wb");
+	if (!file)
+	{
+		return false;
+	}
+
+	// a negative scale marks little endian data; rows are stored bottom to top
+	bool written = fprintf(file, "PF\n%u %u\n-1.0\n", job.width, job.height) > 0;
+	for (int y = int(job.height) - 1; y >= 0 && written; y--)
+	{
+		written = fwrite(job.hdr_pixels.data() + size_t(y) * job.width * 3, sizeof(float) * 3, job.width, file) == job.width;
+	}
+	return (fclose(file) == 0) && written;
+}
+
+bool writeImage(const SImageOutputJob& job)
+{
+	switch (job.format)
+	{
+	case IF_EXR:
+		return writeExr(job);
+	case IF_PFM:
+		return writePfm(job);
+	case IF_PNG:
+		return stbi_write_png(job.file_name.c_str(), job.width, job.height, 3, job.ldr_pixels.data(), job.width * 3) != 0;
+	default:
+		return stbi_write_tga(job.file_name.c_str(), job.width, job.height, 3, job.ldr_pixels.data()) != 0;
+	}
+}
+
+CImageWriter::CImageWriter()
+{
+	io_thread = std::thread(&CImageWriter::writeImages, this);
+}
+
+CImageWriter::~CImageWriter()
+{
+	flush();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		shut_down = true;
+		condition.notify_all();
+	}
+	io_thread.join();
+}
+
+void CImageWriter::submit(SImageOutputJob&& job)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	condition.wait(lock, [&]() { return pending_jobs.size() < max_pending_jobs; });
+	pending_jobs.push_back(std::move(job));
+	condition.notify_all();
+}
+
+void CImageWriter::flush()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	condition.wait(lock, [&]() { return pending_jobs.empty() && !writing; });
+}
+
+void CImageWriter::writeImages()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		condition.wait(lock, [&]() { return !pending_jobs.empty() || shut_down; });
+		if (pending_jobs.empty())
+		{
+			return;
+		}
+
+		SImageOutputJob job = std::move(pending_jobs.front());
+		pending_jobs.pop_front();
+		writing = true;
+		condition.notify_all();
+
+		lock.unlock();
+		if (!writeImage(job))
+		{
+			printf("cannot write image %s\n", job.file_name.c_str());
+		}
+		lock.lock();
+
+		writing = false;
+		condition.notify_all();
+	}
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "memory_tracker.h"
+
+enum EImageFormat
+{
+	IF_TGA,
+	IF_PNG,
+	IF_PFM,
+	IF_EXR,
+};
+
+enum EExrCompression
+{
+	EC_None = 0,
+	EC_RLE = 1,
+	EC_Zip = 3, // zlib over blocks of 16 scanlines, only with A7X_HAVE_ZLIB
+};
+
+struct SImageOutputSettings
+{
+	// empty: the filename parameter of the scene's Film
+	std::string file_name;
+	bool exr_half = true;
+	EExrCompression exr_compression = EC_Zip;
+
+	// tev viewer the progressive passes are streamed to, empty for none
+	std::string preview_stream_address;
+	float preview_stream_interval = 0.5f;
+};
+
+// from the file extension, unknown extensions are written as TGA
+EImageFormat getImageFormat(const std::string& file_name);
+
+inline bool isFloatImageFormat(EImageFormat format) { return format == IF_PFM || format == IF_EXR; }
+
+// one image, owned by the writer once submitted
+struct SImageOutputJob
+{
+	std::string file_name;
+	EImageFormat format;
+	uint32_t width;
+	uint32_t height;
+
+	// 8 bit RGB for TGA/PNG, linear float RGB for PFM/EXR; rows top to bottom
+	TrackedVector<uint8_t, MC_Film> ldr_pixels;
+	TrackedVector<float, MC_Film> hdr_pixels;
+
+	bool exr_half;
+	EExrCompression exr_compression;
+};
+
+// Encodes and writes images on a background I/O thread, so rendering continues
+// while the previous image is written. At most max_pending_jobs images wait in
+// the queue; submit blocks beyond that to bound the memory of the snapshots.
+class CImageWriter
+{
+public:
+	static constexpr int max_pending_jobs = 2;
+
+	CImageWriter();
+	~CImageWriter();
+
+	void submit(SImageOutputJob&& job);
+
+	// blocks until every submitted image has been written
+	void flush();
+
+private:
+	void writeImages();
+
+	std::thread io_thread;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque<SImageOutputJob> pending_jobs;
+	bool writing = false;
+	bool shut_down = false;
+};
+
+bool writeImage(const SImageOutputJob& job);
@@ -1,9 +1,11 @@
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/component_wise.hpp>
+#include <deque>
+#include <atomic>
+#include <climits>
 #include "integrators.h"
 #include "parallel.h"
 #include "sampling.h"
-#include "stb_image_write.h"
 #include "glm-aabb/AABB.hpp"
 #include "lowdiscrepancy.h"
 
@@ -17,47 +19,300 @@ CPathIntegrator::CPathIntegrator(int max_depth, CPerspectiveCamera* camera, CSam
 	: CIntegrator(ipt_accelerator)
 	, max_depth(max_depth)
 	, camera(camera)
+	, view_cameras{ camera }
 	, sampler_prototype(sampler)
 {
 	light_sampler = std::make_shared<CPowerLightSampler>(lights);
 }
 
+bool CPathIntegrator::addView(CPerspectiveCamera* view_camera)
+{
+	if (view_camera->getFilm()->getImageSize() != camera->getFilm()->getImageSize())
+	{
+		return false;
+	}
+	view_cameras.push_back(view_camera);
+	return true;
+}
+
+// Deactivates the pixels whose 3x3 neighbourhood has converged, so that a
+// lucky run of similar samples in a single pixel does not stop it too early.
+// Returns the number of pixels that stay active.
+static uint32_t updateActivePixels(const CRGBFilm* rgb_film, std::vector<uint8_t>& active_pixels, float error_threshold)
+{
+	const glm::u32vec2 image_size = rgb_film->getImageSize();
+	std::atomic<uint32_t> active_num = 0;
+	parallelFor2D(glm::u32vec2(0, 0), image_size, [&](glm::u32vec2 bound_min, glm::u32vec2 bound_max) {
+		bound_max = glm::min(bound_max, image_size);
+		uint32_t tile_active_num = 0;
+		for (glm::uint32 pixel_y = bound_min.y; pixel_y < bound_max.y; pixel_y++)
+		{
+			for (glm::uint32 pixel_x = bound_min.x; pixel_x < bound_max.x; pixel_x++)
+			{
+				uint8_t& active = active_pixels[pixel_x + pixel_y * image_size.x];
+				if (!active)
+				{
+					continue;
+				}
+
+				float max_error = 0.0f;
+				for (glm::uint32 neighbour_y = (std::max)(pixel_y, 1u) - 1; neighbour_y <= (std::min)(pixel_y + 1, image_size.y - 1); neighbour_y++)
+				{
+					for (glm::uint32 neighbour_x = (std::max)(pixel_x, 1u) - 1; neighbour_x <= (std::min)(pixel_x + 1, image_size.x - 1); neighbour_x++)
+					{
+						max_error = (std::max)(max_error, rgb_film->relativeError(glm::u32vec2(neighbour_x, neighbour_y)));
+					}
+				}
+
+				if (max_error <= error_threshold)
+				{
+					active = 0;
+				}
+				else
+				{
+					tile_active_num++;
+				}
+			}
+		}
+		active_num += tile_active_num;
+	});
+	return active_num;
+}
+
 void CPathIntegrator::render()
 {
 	CRGBFilm* rgb_film = camera->getFilm();
 	const glm::u32vec2 image_size = rgb_film->getImageSize();
-	
-	int spp = sampler_prototype->getSamplersPerPixel();
+	const uint32_t image_area = image_size.x * image_size.y;
 
-	for (int spp_idx = 0; spp_idx < spp; spp_idx++)
+	// The views are stacked vertically into one domain, so a pass hands out the
+	// tiles of all of them to the thread pool at once.
+	const uint32_t view_num = uint32_t(view_cameras.size());
+	const glm::u32vec2 views_size(image_size.x, image_size.y * view_num);
+	if (view_num > 1 && (progressive_settings.hasSppRange() || progressive_settings.adaptive_threshold > 0.0f || progressive_settings.checkpoint_interval > 0.0f || progressive_settings.resume))
 	{
-		glm::u32vec2 bound_min = glm::u32vec2(0, 0);
-		glm::u32vec2 bound_max = image_size;
-		for (glm::uint32 pixel_x = bound_min.x; pixel_x < bound_max.x; pixel_x++)
+		printf("spp ranges, adaptive sampling and checkpoints keep the state of one film and are disabled for %u views\n", view_num);
+		progressive_settings.spp_range_begin = 0;
+		progressive_settings.spp_range_end = 0;
+		progressive_settings.adaptive_threshold = 0.0f;
+		progressive_settings.checkpoint_interval = 0.0f;
+		progressive_settings.resume = false;
+	}
+
+	CProgressiveControl progressive(progressive_settings, sampler_prototype->getSamplersPerPixel());
+
+	// Sample indices only depend on the pixel and the pass, so a shard starts
+	// at its first index and its sums add up exactly with the other shards.
+	const bool shard = progressive_settings.hasSppRange();
+	if (shard)
+	{
+		rgb_film->enableSampleStatistics();
+		progressive.setTargetPasses(progressive_settings.spp_range_end);
+		progressive.resumeFrom(progressive_settings.spp_range_begin);
+	}
+
+	// Adaptive sampling keeps the budget of spp samples per pixel on average,
+	// but converged pixels hand their share to the noisy ones, up to four
+	// times the spp in a single pixel.
+	const bool adaptive = progressive_settings.adaptive_threshold > 0.0f && !shard;
+	if (shard && progressive_settings.adaptive_threshold > 0.0f)
+	{
+		printf("adaptive sampling needs every sample of a pixel and is disabled for an spp range\n");
+	}
+	std::vector<uint8_t> active_pixels;
+	uint32_t active_num = image_area;
+	int64_t sample_budget = INT64_MAX;
+	int64_t sample_num = 0;
+	if (adaptive)
+	{
+		rgb_film->enableSampleStatistics();
+		active_pixels.assign(image_area, 1);
+		if (progressive.targetPasses() != INT_MAX)
 		{
-			for (glm::uint32 pixel_y = bound_min.y; pixel_y < bound_max.y; pixel_y++)
+			sample_budget = int64_t(progressive.targetPasses()) * image_area;
+			progressive.setTargetPasses(int((std::min)(int64_t(progressive.targetPasses()) * 4, int64_t(INT_MAX))));
+		}
+	}
+
+	const uint64_t checkpoint_hash = shard ? pbrt::Hash(progressive_settings.scene_hash, progressive_settings.spp_range_begin, progressive_settings.spp_range_end) : progressive_settings.scene_hash;
+	const SCheckpointHeader checkpoint_header = { CI_Path, checkpoint_hash, image_size.x, image_size.y };
+	auto saveCheckpoint = [&]() {
+		CCheckpointWriter writer(progressive_settings.checkpoint_file, checkpoint_header, progressive.completedPasses());
+		rgb_film->saveState(writer);
+		if (adaptive)
+		{
+			writer.writeVector(active_pixels);
+			writer.write(&sample_num, sizeof(sample_num));
+		}
+		writer.commit();
+	};
+
+	if (progressive_settings.resume)
+	{
+		CCheckpointReader reader;
+		int completed_passes = 0;
+		if (reader.open(progressive_settings.checkpoint_file, checkpoint_header, completed_passes))
+		{
+			bool loaded = rgb_film->loadState(reader);
+			if (adaptive)
 			{
-				glm::u32vec2 pix_pos = glm::u32vec2(pixel_x, pixel_y);
-				CSampler* sampler = sampler_prototype; // todo: TLS
-				sampler->initPixelSample(pix_pos, spp_idx);
-				glm::vec3 L = evaluatePixelSample(pix_pos, sampler);
-				rgb_film->addSample(pix_pos, L);
+				loaded = loaded && reader.readVector(active_pixels) && reader.read(&sample_num, sizeof(sample_num));
+				active_num = uint32_t(std::count(active_pixels.begin(), active_pixels.end(), uint8_t(1)));
+			}
+
+			if (loaded && reader.finish())
+			{
+				printf("resuming after %d passes\n", completed_passes);
+				progressive.resumeFrom(completed_passes);
+			}
+			else
+			{
+				// the film may hold part of the checkpoint
+				printf("checkpoint %s is damaged, starting from the beginning\n", progressive_settings.checkpoint_file.c_str());
+				rgb_film->clear();
+				std::fill(active_pixels.begin(), active_pixels.end(), uint8_t(1));
+				active_num = image_area;
+				sample_num = 0;
 			}
 		}
+	}
 
-		//parallelFor2D(glm::u32vec2(0, 0), image_size, [&](glm::u32vec2 bound_min, glm::u32vec2 bound_max) {
-		//});
+	for (int spp_idx = progressive.completedPasses(); spp_idx < progressive.targetPasses(); spp_idx++)
+	{
+		// tiles do not overlap, so every pixel is written by one thread
+		parallelFor2D(glm::u32vec2(0, 0), views_size, [&](glm::u32vec2 bound_min, glm::u32vec2 bound_max) {
+			bound_max = glm::min(bound_max, views_size);
+			std::unique_ptr<CSampler> sampler = sampler_prototype->clone();
+			for (glm::uint32 pixel_x = bound_min.x; pixel_x < bound_max.x; pixel_x++)
+			{
+				for (glm::uint32 pixel_y = bound_min.y; pixel_y < bound_max.y; pixel_y++)
+				{
+					// a tile may reach into the next view
+					const uint32_t view_idx = pixel_y / image_size.y;
+					glm::u32vec2 pix_pos = glm::u32vec2(pixel_x, pixel_y - view_idx * image_size.y);
+
+					// a converged pixel never becomes active again, so the active
+					// pixels all take their spp_idx-th sample in this pass
+					if (adaptive && !active_pixels[pix_pos.x + pix_pos.y * image_size.x])
+					{
+						continue;
+					}
+
+					CPerspectiveCamera* view_camera = view_cameras[view_idx];
+					sampler->initPixelSample(pix_pos, spp_idx);
+					glm::vec3 L = evaluatePixelSample(view_camera, pix_pos, sampler.get());
+					view_camera->getFilm()->addSample(pix_pos, L);
+				}
+			}
+		});
+		sample_num += active_num;
+
+		if (adaptive && spp_idx + 1 >= progressive_settings.adaptive_min_spp)
+		{
+			active_num = updateActivePixels(rgb_film, active_pixels, progressive_settings.adaptive_threshold);
+		}
+
+		bool render_continues = progressive.passCompleted();
+		if (adaptive && (active_num == 0 || sample_num + active_num > sample_budget))
+		{
+			progressive.markComplete();
+			render_continues = false;
+		}
+		if (!render_continues)
+		{
+			break;
+		}
+		const bool preview_due = progressive.previewDue();
+		for (CPerspectiveCamera* view_camera : view_cameras)
+		{
+			CRGBFilm* view_film = view_camera->getFilm();
+			if (view_film->previewStreamDue())
+			{
+				view_film->streamPreview(float(progressive.completedPasses()));
+			}
+			if (preview_due)
+			{
+				view_film->writeImage(float(progressive.completedPasses()));
+			}
+		}
+		if (progressive.checkpointDue())
+		{
+			saveCheckpoint();
+		}
 	}
 
-	rgb_film->finalizeRender(spp);
-	stbi_write_tga("H:/Alpha7XRender/resource/test.tga", image_size.x, image_size.y, 3, rgb_film->getFinalData());
+	// a render stopped early keeps its state for --resume
+	if (progressive.checkpointsEnabled() && !progressive.isComplete())
+	{
+		saveCheckpoint();
+	}
+	else if (progressive.isComplete() && (progressive.checkpointsEnabled() || progressive_settings.resume))
+	{
+		removeCheckpoint(progressive_settings.checkpoint_file);
+	}
 
+	for (CPerspectiveCamera* view_camera : view_cameras)
+	{
+		view_camera->getFilm()->streamPreview(float(progressive.completedPasses()));
+	}
+	if (shard)
+	{
+		// a shard stopped early still holds the exact samples of a shorter range
+		const SCheckpointHeader shard_header = { CI_FilmShard, progressive_settings.scene_hash, image_size.x, image_size.y };
+		const std::string shard_file = rgb_film->getOutputFileName() + ".shard";
+		int32_t spp_begin = progressive_settings.spp_range_begin;
+		CCheckpointWriter writer(shard_file, shard_header, progressive.completedPasses());
+		writer.write(&spp_begin, sizeof(spp_begin));
+		rgb_film->saveState(writer);
+		if (writer.commit())
+		{
+			printf("wrote samples %d to %d into %s\n", spp_begin, progressive.completedPasses(), shard_file.c_str());
+		}
+		return;
+	}
+
+	for (CPerspectiveCamera* view_camera : view_cameras)
+	{
+		view_camera->getFilm()->writeImage(float(progressive.completedPasses()));
+	}
+	if (adaptive)
+	{
+		printf("adaptive sampling: %.2f samples per pixel on average, %u of %u pixels not converged\n", double(sample_num) / image_area, active_num, image_area);
+		rgb_film->writeSampleCountImage();
+	}
 }
 
-glm::vec3 CPathIntegrator::evaluatePixelSample(glm::vec2 pixel_pos, CSampler* sampler)
+bool CPathIntegrator::renderTile(glm::u32vec2 tile_min, glm::u32vec2 tile_max)
 {
-	glm::vec3 ray_origin = camera->getCameraPos();
-	glm::vec3 ray_direction = camera->getPixelRayDirection(pixel_pos + sampler->getPixel2D());
+	CRGBFilm* rgb_film = camera->getFilm();
+	int spp_begin = progressive_settings.spp_range_begin;
+	int spp_end = progressive_settings.hasSppRange() ? progressive_settings.spp_range_end :
+		(progressive_settings.target_spp > 0 ? progressive_settings.target_spp : sampler_prototype->getSamplersPerPixel());
+
+	for (int spp_idx = spp_begin; spp_idx < spp_end; spp_idx++)
+	{
+		parallelFor2D(tile_min, tile_max, [&](glm::u32vec2 bound_min, glm::u32vec2 bound_max) {
+			bound_max = glm::min(bound_max, tile_max);
+			std::unique_ptr<CSampler> sampler = sampler_prototype->clone();
+			for (glm::uint32 pixel_x = bound_min.x; pixel_x < bound_max.x; pixel_x++)
+			{
+				for (glm::uint32 pixel_y = bound_min.y; pixel_y < bound_max.y; pixel_y++)
+				{
+					glm::u32vec2 pix_pos = glm::u32vec2(pixel_x, pixel_y);
+					sampler->initPixelSample(pix_pos, spp_idx);
+					glm::vec3 L = evaluatePixelSample(camera, pix_pos, sampler.get());
+					rgb_film->addSample(pix_pos, L);
+				}
+			}
+		});
+	}
+	return true;
+}
+
+glm::vec3 CPathIntegrator::evaluatePixelSample(CPerspectiveCamera* view_camera, glm::vec2 pixel_pos, CSampler* sampler)
+{
+	glm::vec3 ray_origin = view_camera->getCameraPos();
+	glm::vec3 ray_direction = view_camera->getPixelRayDirection(pixel_pos + sampler->getPixel2D());
 	CRay ray(ray_origin, ray_direction);
 	glm::vec3 L = Li(ray, sampler);
 	return L;
@@ -184,6 +439,8 @@ CSPPMIntegrator::CSPPMIntegrator(int max_depth, float initial_radius, CPerspecti
 	, camera(camera)
 	, sampler_prototype(sampler)
 {
+	// as in pbrt, every sample per pixel is one photon iteration
+	iteration_num = sampler->getSamplersPerPixel();
 	light_sampler = std::make_shared<CPowerLightSampler>(lights);
 }
 
@@ -240,7 +497,7 @@ void CSPPMIntegrator::render()
 	const int image_area = image_size.x * image_size.y;
 	int photons_per_iteration = image_area;
 
-	std::vector<SPPMPixel>pixels(image_area);
+	TrackedVector<SPPMPixel, MC_SPPM> pixels(image_area);
 	for (auto& pixel : pixels)
 	{
 		pixel.radius = initial_radius;
@@ -249,7 +506,88 @@ void CSPPMIntegrator::render()
 	const glm::u32vec2 bound_min = glm::u32vec2(0, 0);
 	const glm::u32vec2 bound_max = image_size;
 
-	for (int iter_idx = 0; iter_idx < iteration_num; iter_idx++)
+	// radiance estimate of the iterations done so far, written into the cleared film
+	auto resolveToFilm = [&](int completed_iterations)
+	{
+		rgb_film->clear();
+		for (glm::uint32 pixel_x = bound_min.x; pixel_x < bound_max.x; pixel_x++)
+		{
+			for (glm::uint32 pixel_y = bound_min.y; pixel_y < bound_max.y; pixel_y++)
+			{
+				glm::u32vec2 pix_pos = glm::u32vec2(pixel_x, pixel_y);
+				glm::ivec2 pixel_offset = pix_pos - bound_min;
+				int pixel_idx = pixel_offset.x + pixel_offset.y * (bound_max.x - bound_min.x);
+				SPPMPixel& pixel = pixels[pixel_idx];
+
+				float num_photons = float(completed_iterations) * photons_per_iteration;
+				glm::vec3 L = pixel.l_d / float(completed_iterations) + pixel.tau / (num_photons * glm::pi<float>() * (pixel.radius * pixel.radius));
+				rgb_film->addSample(pix_pos, L);
+			}
+		}
+	};
+
+	if (progressive_settings.adaptive_threshold > 0.0f)
+	{
+		printf("adaptive sampling is not supported by sppm, every pixel takes part in every iteration\n");
+	}
+	if (progressive_settings.hasSppRange())
+	{
+		// the photon radius of an iteration depends on all iterations before it
+		printf("spp ranges are not supported by sppm, rendering every iteration\n");
+	}
+
+	CProgressiveControl progressive(progressive_settings, iteration_num);
+
+	// visible points and photon statistics are rebuilt every iteration, the
+	// radius, direct lighting, flux and photon count carry over
+	const int pixel_state_floats = 8;
+	const SCheckpointHeader checkpoint_header = { CI_SPPM, progressive_settings.scene_hash, image_size.x, image_size.y };
+	auto saveCheckpoint = [&]() {
+		std::vector<float> pixel_states(size_t(image_area) * pixel_state_floats);
+		for (int pixel_idx = 0; pixel_idx < image_area; pixel_idx++)
+		{
+			const SPPMPixel& pixel = pixels[pixel_idx];
+			float* state = &pixel_states[size_t(pixel_idx) * pixel_state_floats];
+			state[0] = pixel.radius;
+			state[1] = pixel.n;
+			memcpy(state + 2, &pixel.l_d, sizeof(glm::vec3));
+			memcpy(state + 5, &pixel.tau, sizeof(glm::vec3));
+		}
+
+		CCheckpointWriter writer(progressive_settings.checkpoint_file, checkpoint_header, progressive.completedPasses());
+		writer.writeVector(pixel_states);
+		writer.commit();
+	};
+
+	if (progressive_settings.resume)
+	{
+		CCheckpointReader reader;
+		int completed_iterations = 0;
+		std::vector<float> pixel_states(size_t(image_area) * pixel_state_floats);
+		if (reader.open(progressive_settings.checkpoint_file, checkpoint_header, completed_iterations))
+		{
+			if (reader.readVector(pixel_states) && reader.finish())
+			{
+				for (int pixel_idx = 0; pixel_idx < image_area; pixel_idx++)
+				{
+					SPPMPixel& pixel = pixels[pixel_idx];
+					const float* state = &pixel_states[size_t(pixel_idx) * pixel_state_floats];
+					pixel.radius = state[0];
+					pixel.n = state[1];
+					memcpy(&pixel.l_d, state + 2, sizeof(glm::vec3));
+					memcpy(&pixel.tau, state + 5, sizeof(glm::vec3));
+				}
+				printf("resuming after %d iterations\n", completed_iterations);
+				progressive.resumeFrom(completed_iterations);
+			}
+			else
+			{
+				printf("checkpoint %s is damaged, starting from the beginning\n", progressive_settings.checkpoint_file.c_str());
+			}
+		}
+	}
+
+	for (int iter_idx = progressive.completedPasses(); iter_idx < progressive.targetPasses(); iter_idx++)
 	{
 		for (glm::uint32 pixel_x = bound_min.x; pixel_x < bound_max.x; pixel_x++)
 		{
@@ -340,10 +678,11 @@ void CSPPMIntegrator::render()
 		}
 		// build light photon map
 
-		std::vector<SPPMPixelListNode*> grid(image_area);
+		TrackedVector<SPPMPixelListNode*, MC_SPPM> grid(image_area);
 		memset(grid.data(), 0, sizeof(SPPMPixelListNode*) * image_area);
 
-		std::allocator<SPPMPixelListNode> node_allocator;
+		// nodes live for one iteration and are freed with the deque
+		std::deque<SPPMPixelListNode, CTrackedAllocator<SPPMPixelListNode, MC_SPPM>> grid_nodes;
 
 		glm::AABB grid_bound;
 		float max_radius = 0.0;
@@ -387,7 +726,7 @@ void CSPPMIntegrator::render()
 								for (int x = p_min.x; x <= p_max.x; x++)
 								{
 									uint32_t node_hash = hashVisPoint(glm::ivec3(x, y, z), image_area);
-									SPPMPixelListNode* pixel_node = node_allocator.allocate(1);
+									SPPMPixelListNode* pixel_node = &grid_nodes.emplace_back();
 									pixel_node->pixel = &pixel;
 									pixel_node->next_node = grid[node_hash];
 									grid[node_hash] = pixel_node;
@@ -538,27 +877,42 @@ void CSPPMIntegrator::render()
 			}
 		}
 
-	}
-
-	{
-		for (glm::uint32 pixel_x = bound_min.x; pixel_x < bound_max.x; pixel_x++)
+		if (!progressive.passCompleted())
 		{
-			for (glm::uint32 pixel_y = bound_min.y; pixel_y < bound_max.y; pixel_y++)
-			{
-				glm::u32vec2 pix_pos = glm::u32vec2(pixel_x, pixel_y);
-				glm::ivec2 pixel_offset = pix_pos - bound_min;
-				int pixel_idx = pixel_offset.x + pixel_offset.y * (bound_max.x - bound_min.x);
-				SPPMPixel& pixel = pixels[pixel_idx];
-
-				float num_photons = float(iteration_num) * photons_per_iteration;
-				glm::vec3 L = pixel.l_d / float(iteration_num) + pixel.tau / (num_photons * glm::pi<float>() * (pixel.radius * pixel.radius));
-				rgb_film->addSample(pix_pos, L);
-			}
+			break;
+		}
+		const bool stream_preview = rgb_film->previewStreamDue();
+		const bool write_preview = progressive.previewDue();
+		if (stream_preview || write_preview)
+		{
+			resolveToFilm(progressive.completedPasses());
 		}
+		if (stream_preview)
+		{
+			rgb_film->streamPreview(1);
+		}
+		if (write_preview)
+		{
+			rgb_film->writeImage(1);
+		}
+		if (progressive.checkpointDue())
+		{
+			saveCheckpoint();
+		}
+	}
 
-		rgb_film->finalizeRender(1);
-		stbi_write_tga("H:/Alpha7XRender/resource/test.tga", image_size.x, image_size.y, 3, rgb_film->getFinalData());
+	if (progressive.checkpointsEnabled() && !progressive.isComplete())
+	{
+		saveCheckpoint();
 	}
+	else if (progressive.isComplete() && (progressive.checkpointsEnabled() || progressive_settings.resume))
+	{
+		removeCheckpoint(progressive_settings.checkpoint_file);
+	}
+
+	resolveToFilm(progressive.completedPasses());
+	rgb_film->streamPreview(1);
+	rgb_film->writeImage(1);
 }
 
 glm::vec3 CSPPMIntegrator::SampleLd(const CSurfaceInterraction& sf_interaction, const CBSDF* bsdf, CSampler* sampler)
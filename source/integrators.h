@@ -6,6 +6,7 @@
 #include "interaction.h"
 #include "bsdf.h"
 #include "geometry.h"
+#include "progressive.h"
 
 class CIntegrator
 {
@@ -14,11 +15,24 @@ public:
 		:accelerator(ipt_accelerator) {};
 
 	virtual void render() = 0;
+
+	// Renders every sample of the pixels in [tile_min, tile_max) into the film,
+	// for tile coordinator workers. False if the integrator needs the whole image.
+	virtual bool renderTile(glm::u32vec2, glm::u32vec2) { return false; }
+
+	// Renders another camera of the same resolution in the same passes, into
+	// its own film. False if the integrator traces a single camera.
+	virtual bool addView(CPerspectiveCamera*) { return false; }
+
+	inline void setProgressiveSettings(const SProgressiveSettings& settings) { progressive_settings = settings; }
+
 	SShapeInteraction intersect(CRay ray)const;
 	bool traceVisibilityRay(CRay ray, float max_t)
 	{
 		return accelerator->traceVisibilityRay(ray, max_t);
 	}
+protected:
+	SProgressiveSettings progressive_settings;
 private:
 	CAccelerator* accelerator;
 };
@@ -29,9 +43,11 @@ public:
 	CPathIntegrator(int max_depth, CPerspectiveCamera* camera, CSampler* sampler, CAccelerator* ipt_accelerator, std::vector<std::shared_ptr<CLight>> lights);
 
 	void render();
+	bool renderTile(glm::u32vec2 tile_min, glm::u32vec2 tile_max) override;
+	bool addView(CPerspectiveCamera* view_camera) override;
 private:
 
-	glm::vec3 evaluatePixelSample(glm::vec2 pixel_pos, CSampler* sampler);
+	glm::vec3 evaluatePixelSample(CPerspectiveCamera* view_camera, glm::vec2 pixel_pos, CSampler* sampler);
 	glm::vec3 Li(CRay ray, CSampler* sampler);
 
 	glm::vec3 SampleLd(const CSurfaceInterraction& sf_interaction, const CBSDF* bsdf, CSampler* sampler);
@@ -39,6 +55,7 @@ private:
 	int max_depth;
 	std::shared_ptr<CLightSampler> light_sampler;
 	CPerspectiveCamera* camera;
+	std::vector<CPerspectiveCamera*> view_cameras; // the main camera first
 	CSampler* sampler_prototype;
 };
 
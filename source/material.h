@@ -6,6 +6,7 @@
 class CMaterial
 {
 public:
+	virtual ~CMaterial() = default;
 	inline std::shared_ptr<CBxDF> getBxdf() { return bxdf; }
 protected:
 	std::shared_ptr<CBxDF> bxdf;
@@ -15,11 +16,17 @@ class CDiffuseMaterial : public CMaterial
 {
 public:
 	CDiffuseMaterial(glm::vec3 reflectance)
-		:reflectance(reflectance) 
 	{
-		bxdf = std::make_shared<CDiffuseBxDF>(reflectance);
+		setReflectance(reflectance);
 	};
 
+	// for edits between the renders of a session, not during one
+	void setReflectance(glm::vec3 ipt_reflectance)
+	{
+		reflectance = ipt_reflectance;
+		bxdf = std::make_shared<CDiffuseBxDF>(reflectance);
+	}
+
 private:
 	glm::vec3 reflectance;
 };
@@ -28,13 +35,19 @@ class CDielectricMaterial : public CMaterial
 {
 public:
 	CDielectricMaterial(float eta, bool roughness_remapping)
-		:eta(eta)
+		:roughness_remapping(roughness_remapping)
 	{
+		setEta(eta);
+	};
+
+	void setEta(float ipt_eta)
+	{
+		eta = ipt_eta;
 		if (roughness_remapping == false)
 		{
 			bxdf = std::make_shared<CDielectricBxDF>(eta, CTrowbridgeReitzDistribution(0, 0));
 		}
-	};
+	}
 private:
 	float eta;
 	bool roughness_remapping;
@@ -0,0 +1,223 @@
+#include "memory_tracker.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <fstream>
+#include <string>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+static const char* memory_category_names[MC_Count] = { "parser", "meshes", "embree", "bvh", "film", "sppm" };
+
+static std::atomic<size_t> memory_budget = 0;
+static std::atomic<int64_t> tracked_bytes = 0;
+static std::atomic<int64_t> tracked_peak = 0;
+static std::atomic<int64_t> category_bytes[MC_Count];
+static std::atomic<int64_t> category_peak[MC_Count];
+
+static bool huge_pages_enabled = false;
+static std::atomic<int64_t> huge_page_pool_bytes = 0;
+static std::atomic<int64_t> huge_page_advised_bytes = 0;
+
+static void updatePeak(std::atomic<int64_t>& peak, int64_t value)
+{
+	int64_t current_peak = peak.load(std::memory_order_relaxed);
+	while (value > current_peak && !peak.compare_exchange_weak(current_peak, value, std::memory_order_relaxed))
+	{
+	}
+}
+
+void setMemoryBudget(size_t budget_bytes)
+{
+	memory_budget = budget_bytes;
+}
+
+size_t getMemoryBudget()
+{
+	return memory_budget;
+}
+
+bool trackMemory(EMemoryCategory category, int64_t bytes, bool enforce_budget)
+{
+	int64_t total = tracked_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+	size_t budget = memory_budget.load(std::memory_order_relaxed);
+	if (enforce_budget && bytes > 0 && budget != 0 && total > int64_t(budget))
+	{
+		tracked_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+		return false;
+	}
+
+	int64_t category_total = category_bytes[category].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+	updatePeak(category_peak[category], category_total);
+	updatePeak(tracked_peak, total);
+	return true;
+}
+
+void memoryBudgetExceeded(EMemoryCategory category, size_t bytes)
+{
+	printf("memory budget of %.1f MB exceeded by a %.1f MB %s allocation\n",
+		getMemoryBudget() / (1024.0 * 1024.0), bytes / (1024.0 * 1024.0), memory_category_names[category]);
+	printMemoryReport();
+	fflush(stdout);
+	std::_Exit(EXIT_FAILURE);
+}
+
+size_t getTrackedMemory()
+{
+	return size_t(tracked_bytes.load(std::memory_order_relaxed));
+}
+
+size_t getTrackedMemory(EMemoryCategory category)
+{
+	return size_t(category_bytes[category].load(std::memory_order_relaxed));
+}
+
+void printMemoryReport()
+{
+	printf("memory report (MB)    current       peak\n");
+	for (int idx = 0; idx < MC_Count; idx++)
+	{
+		printf("  %-16s %10.1f %10.1f\n", memory_category_names[idx],
+			category_bytes[idx].load() / (1024.0 * 1024.0), category_peak[idx].load() / (1024.0 * 1024.0));
+	}
+	printf("  %-16s %10.1f %10.1f\n", "total", tracked_bytes.load() / (1024.0 * 1024.0), tracked_peak.load() / (1024.0 * 1024.0));
+	if (getMemoryBudget() != 0)
+	{
+		printf("  budget %.1f MB\n", getMemoryBudget() / (1024.0 * 1024.0));
+	}
+	if (huge_pages_enabled)
+	{
+		printf("  huge pages: %.1f MB mapped from the pool, %.1f MB advised, since start\n",
+			huge_page_pool_bytes.load() / (1024.0 * 1024.0), huge_page_advised_bytes.load() / (1024.0 * 1024.0));
+	}
+}
+
+static size_t roundUp(size_t bytes, size_t alignment)
+{
+	return (bytes + alignment - 1) / alignment * alignment;
+}
+
+void enableHugePages()
+{
+	huge_pages_enabled = true;
+
+#if defined(_WIN32)
+	// large pages need the "Lock pages in memory" privilege
+	HANDLE token = nullptr;
+	if (OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+	{
+		TOKEN_PRIVILEGES privileges = {};
+		privileges.PrivilegeCount = 1;
+		privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+		if (LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid))
+		{
+			AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr);
+		}
+		if (GetLastError() != ERROR_SUCCESS)
+		{
+			printf("the lock pages in memory privilege is not granted, large pages are not available\n");
+		}
+		CloseHandle(token);
+	}
+#elif defined(__linux__)
+	std::ifstream thp_file("/sys/kernel/mm/transparent_hugepage/enabled");
+	std::string thp_mode;
+	std::getline(thp_file, thp_mode);
+	if (thp_mode.find("[never]") != std::string::npos)
+	{
+		printf("transparent huge pages are disabled, only the hugetlbfs pool is used\n");
+	}
+#endif
+}
+
+bool hugePagesEnabled()
+{
+	return huge_pages_enabled;
+}
+
+void* allocateLarge(size_t bytes)
+{
+#if defined(_WIN32)
+	if (huge_pages_enabled)
+	{
+		size_t large_page_size = GetLargePageMinimum();
+		if (large_page_size != 0)
+		{
+			void* ptr = VirtualAlloc(nullptr, roundUp(bytes, large_page_size), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (ptr)
+			{
+				huge_page_pool_bytes += roundUp(bytes, large_page_size);
+				return ptr;
+			}
+		}
+	}
+
+	void* ptr = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!ptr)
+	{
+		throw std::bad_alloc();
+	}
+	return ptr;
+#elif defined(__linux__)
+	size_t mapped_bytes = roundUp(bytes, large_allocation_size);
+	if (huge_pages_enabled)
+	{
+		void* ptr = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (ptr != MAP_FAILED)
+		{
+			huge_page_pool_bytes += mapped_bytes;
+			return ptr;
+		}
+	}
+
+	// transparent huge pages only back 2 MB aligned ranges, so map one page
+	// more than needed and trim the mapping to an aligned range
+	size_t reserved_bytes = mapped_bytes + large_allocation_size;
+	void* reserved = mmap(nullptr, reserved_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (reserved == MAP_FAILED)
+	{
+		throw std::bad_alloc();
+	}
+
+	char* reserved_begin = static_cast<char*>(reserved);
+	char* aligned_begin = reinterpret_cast<char*>(roundUp(reinterpret_cast<uintptr_t>(reserved_begin), large_allocation_size));
+	char* aligned_end = aligned_begin + mapped_bytes;
+	if (aligned_begin != reserved_begin)
+	{
+		munmap(reserved_begin, aligned_begin - reserved_begin);
+	}
+	if (aligned_end != reserved_begin + reserved_bytes)
+	{
+		munmap(aligned_end, reserved_begin + reserved_bytes - aligned_end);
+	}
+
+	if (huge_pages_enabled && madvise(aligned_begin, mapped_bytes, MADV_HUGEPAGE) == 0)
+	{
+		huge_page_advised_bytes += mapped_bytes;
+	}
+	return aligned_begin;
+#else
+	return ::operator new(bytes, std::align_val_t(large_allocation_size));
+#endif
+}
+
+void freeLarge(void* ptr, size_t bytes)
+{
+	if (!ptr)
+	{
+		return;
+	}
+
+#if defined(_WIN32)
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#elif defined(__linux__)
+	munmap(ptr, roundUp(bytes, large_allocation_size));
+#else
+	::operator delete(ptr, std::align_val_t(large_allocation_size));
+#endif
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+enum EMemoryCategory
+{
+	MC_Parser,
+	MC_Meshes,
+	MC_Embree,
+	MC_BVH,
+	MC_Film,
+	MC_SPPM,
+	MC_Count,
+};
+
+// 0 means no budget
+void setMemoryBudget(size_t budget_bytes);
+size_t getMemoryBudget();
+
+// Records an allocation (bytes > 0) or a release (bytes < 0). With enforce_budget
+// an allocation that would exceed the budget is not recorded and false is returned.
+bool trackMemory(EMemoryCategory category, int64_t bytes, bool enforce_budget = true);
+
+// prints the report and exits without running destructors, worker threads may still be running
+[[noreturn]] void memoryBudgetExceeded(EMemoryCategory category, size_t bytes);
+
+size_t getTrackedMemory();
+size_t getTrackedMemory(EMemoryCategory category);
+void printMemoryReport();
+
+// Allocations of at least large_allocation_size bytes are page mapped and 2 MB
+// aligned. With huge pages enabled they are backed by the hugetlbfs pool if it
+// has free pages (large pages on Windows), and are otherwise advised for
+// transparent huge pages.
+constexpr size_t large_allocation_size = size_t(2) * 1024 * 1024;
+
+void enableHugePages();
+bool hugePagesEnabled();
+
+void* allocateLarge(size_t bytes);
+void freeLarge(void* ptr, size_t bytes);
+
+template<typename T, EMemoryCategory category>
+class CTrackedAllocator
+{
+public:
+	using value_type = T;
+
+	template<typename U>
+	struct rebind
+	{
+		using other = CTrackedAllocator<U, category>;
+	};
+
+	CTrackedAllocator() = default;
+
+	template<typename U>
+	CTrackedAllocator(const CTrackedAllocator<U, category>&) {}
+
+	T* allocate(size_t n)
+	{
+		if (!trackMemory(category, int64_t(n * sizeof(T))))
+		{
+			memoryBudgetExceeded(category, n * sizeof(T));
+		}
+		if (n * sizeof(T) >= large_allocation_size)
+		{
+			return static_cast<T*>(allocateLarge(n * sizeof(T)));
+		}
+		return std::allocator<T>().allocate(n);
+	}
+
+	void deallocate(T* p, size_t n)
+	{
+		if (n * sizeof(T) >= large_allocation_size)
+		{
+			freeLarge(p, n * sizeof(T));
+		}
+		else
+		{
+			std::allocator<T>().deallocate(p, n);
+		}
+		trackMemory(category, -int64_t(n * sizeof(T)));
+	}
+
+	template<typename U>
+	bool operator==(const CTrackedAllocator<U, category>&)const { return true; }
+	template<typename U>
+	bool operator!=(const CTrackedAllocator<U, category>&)const { return false; }
+};
+
+template<typename T, EMemoryCategory category>
+using TrackedVector = std::vector<T, CTrackedAllocator<T, category>>;
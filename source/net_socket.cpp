@@ -0,0 +1,284 @@
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#endif
+#include "net_socket.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+static bool initSockets()
+{
+#if defined(_WIN32)
+	static bool initialized = false;
+	if (!initialized)
+	{
+		WSADATA wsa_data;
+		initialized = WSAStartup(MAKEWORD(2, 2), &wsa_data) == 0;
+	}
+	return initialized;
+#else
+	return true;
+#endif
+}
+
+#if !defined(_WIN32)
+static const char unix_prefix[] = "unix:";
+
+static bool isUnixAddress(const std::string& address)
+{
+	return address.compare(0, sizeof(unix_prefix) - 1, unix_prefix) == 0;
+}
+
+static bool unixAddress(const std::string& address, sockaddr_un& socket_address)
+{
+	std::string path = address.substr(sizeof(unix_prefix) - 1);
+	memset(&socket_address, 0, sizeof(socket_address));
+	socket_address.sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(socket_address.sun_path))
+	{
+		printf("invalid socket path %s\n", path.c_str());
+		return false;
+	}
+	memcpy(socket_address.sun_path, path.c_str(), path.size() + 1);
+	return true;
+}
+#endif
+
+static addrinfo* resolveTcpAddress(const std::string& address, bool passive)
+{
+	size_t colon_pos = address.rfind(':');
+	if (colon_pos == std::string::npos)
+	{
+		printf("invalid address %s, expected host:port\n", address.c_str());
+		return nullptr;
+	}
+
+	std::string host = address.substr(0, colon_pos);
+	std::string port = address.substr(colon_pos + 1);
+
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	addrinfo* result = nullptr;
+	if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0)
+	{
+		printf("cannot resolve %s\n", address.c_str());
+		return nullptr;
+	}
+	return result;
+}
+
+// tiles are sent in one piece, small messages should not wait for more data
+static void disableNagle(socket_t socket)
+{
+	int enable = 1;
+	setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&enable, sizeof(enable));
+}
+
+socket_t listenSocket(const std::string& address)
+{
+	if (!initSockets())
+	{
+		return invalid_socket;
+	}
+
+#if !defined(_WIN32)
+	if (isUnixAddress(address))
+	{
+		sockaddr_un socket_address;
+		if (!unixAddress(address, socket_address))
+		{
+			return invalid_socket;
+		}
+
+		// a socket file left by a previous coordinator would make bind fail
+		unlink(socket_address.sun_path);
+		socket_t listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listen_socket == invalid_socket || bind(listen_socket, (sockaddr*)&socket_address, sizeof(socket_address)) != 0 || listen(listen_socket, SOMAXCONN) != 0)
+		{
+			printf("cannot listen on %s\n", address.c_str());
+			closeSocket(listen_socket);
+			return invalid_socket;
+		}
+		return listen_socket;
+	}
+#endif
+
+	addrinfo* address_info = resolveTcpAddress(address, true);
+	if (!address_info)
+	{
+		return invalid_socket;
+	}
+
+	socket_t listen_socket = socket(address_info->ai_family, address_info->ai_socktype, address_info->ai_protocol);
+	if (listen_socket != invalid_socket)
+	{
+		int enable = 1;
+		setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&enable, sizeof(enable));
+		if (bind(listen_socket, address_info->ai_addr, int(address_info->ai_addrlen)) != 0 || listen(listen_socket, SOMAXCONN) != 0)
+		{
+			closeSocket(listen_socket);
+			listen_socket = invalid_socket;
+		}
+	}
+	freeaddrinfo(address_info);
+
+	if (listen_socket == invalid_socket)
+	{
+		printf("cannot listen on %s\n", address.c_str());
+	}
+	return listen_socket;
+}
+
+socket_t connectSocket(const std::string& address)
+{
+	if (!initSockets())
+	{
+		return invalid_socket;
+	}
+
+#if !defined(_WIN32)
+	if (isUnixAddress(address))
+	{
+		sockaddr_un socket_address;
+		if (!unixAddress(address, socket_address))
+		{
+			return invalid_socket;
+		}
+
+		socket_t connected_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (connected_socket != invalid_socket && connect(connected_socket, (sockaddr*)&socket_address, sizeof(socket_address)) != 0)
+		{
+			closeSocket(connected_socket);
+			connected_socket = invalid_socket;
+		}
+		return connected_socket;
+	}
+#endif
+
+	addrinfo* address_info = resolveTcpAddress(address, false);
+	if (!address_info)
+	{
+		return invalid_socket;
+	}
+
+	socket_t connected_socket = invalid_socket;
+	for (addrinfo* info = address_info; info != nullptr && connected_socket == invalid_socket; info = info->ai_next)
+	{
+		connected_socket = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+		if (connected_socket != invalid_socket && connect(connected_socket, info->ai_addr, int(info->ai_addrlen)) != 0)
+		{
+			closeSocket(connected_socket);
+			connected_socket = invalid_socket;
+		}
+	}
+	freeaddrinfo(address_info);
+
+	if (connected_socket != invalid_socket)
+	{
+		disableNagle(connected_socket);
+	}
+	return connected_socket;
+}
+
+socket_t acceptSocket(socket_t listen_socket)
+{
+	socket_t accepted_socket = accept(listen_socket, nullptr, nullptr);
+	if (accepted_socket != invalid_socket)
+	{
+		disableNagle(accepted_socket);
+	}
+	return accepted_socket;
+}
+
+void closeSocket(socket_t socket)
+{
+	if (socket == invalid_socket)
+	{
+		return;
+	}
+#if defined(_WIN32)
+	closesocket(socket);
+#else
+	close(socket);
+#endif
+}
+
+bool sendAll(socket_t socket, const void* data, size_t bytes)
+{
+	const char* ptr = (const char*)data;
+	while (bytes > 0)
+	{
+		int chunk_size = int((std::min)(bytes, size_t(1) << 30));
+#if defined(_WIN32)
+		int sent = send(socket, ptr, chunk_size, 0);
+#else
+		// a closed peer must not raise SIGPIPE
+		int sent = int(send(socket, ptr, chunk_size, MSG_NOSIGNAL));
+#endif
+		if (sent <= 0)
+		{
+			return false;
+		}
+		ptr += sent;
+		bytes -= sent;
+	}
+	return true;
+}
+
+bool receiveAll(socket_t socket, void* data, size_t bytes)
+{
+	char* ptr = (char*)data;
+	while (bytes > 0)
+	{
+		int chunk_size = int((std::min)(bytes, size_t(1) << 30));
+		int received = int(recv(socket, ptr, chunk_size, 0));
+		if (received <= 0)
+		{
+			return false;
+		}
+		ptr += received;
+		bytes -= received;
+	}
+	return true;
+}
+
+std::vector<socket_t> waitReadable(const std::vector<socket_t>& sockets, int timeout_ms)
+{
+	fd_set read_set;
+	FD_ZERO(&read_set);
+	socket_t max_socket = 0;
+	for (socket_t socket : sockets)
+	{
+		FD_SET(socket, &read_set);
+		max_socket = (std::max)(max_socket, socket);
+	}
+
+	timeval timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+	std::vector<socket_t> readable_sockets;
+	if (select(int(max_socket + 1), &read_set, nullptr, nullptr, &timeout) > 0)
+	{
+		for (socket_t socket : sockets)
+		{
+			if (FD_ISSET(socket, &read_set))
+			{
+				readable_sockets.push_back(socket);
+			}
+		}
+	}
+	return readable_sockets;
+}
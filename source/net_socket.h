@@ -0,0 +1,31 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+// SOCKET, without pulling winsock2.h into every includer
+typedef uintptr_t socket_t;
+static const socket_t invalid_socket = ~socket_t(0);
+#else
+typedef int socket_t;
+static const socket_t invalid_socket = -1;
+#endif
+
+// Blocking stream sockets for the tile coordinator. An address is either
+// "host:port" for TCP or, outside Windows, "unix:<path>" for a Unix domain
+// socket.
+
+socket_t listenSocket(const std::string& address);
+socket_t connectSocket(const std::string& address);
+socket_t acceptSocket(socket_t listen_socket);
+void closeSocket(socket_t socket);
+
+// false if the connection was closed or failed before every byte was transferred
+bool sendAll(socket_t socket, const void* data, size_t bytes);
+bool receiveAll(socket_t socket, void* data, size_t bytes);
+
+// waits up to timeout_ms for the sockets to become readable, the readable
+// ones are returned
+std::vector<socket_t> waitReadable(const std::vector<socket_t>& sockets, int timeout_ms);
@@ -1,26 +1,56 @@
 #include "parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
 
 CThreadPool* CParallelJob::thread_pool;
 
+static thread_local int current_numa_node = 0;
+
+// The rows are split into one band per NUMA node. Threads take tiles from
+// their own node's band and only help with other bands once it is done.
 class CParallelJob2D : public CParallelJob
 {
 public:
-	CParallelJob2D(glm::u32vec2 bound_min, glm::u32vec2 bound_max, glm::uint32 chunk_size, std::function<void(glm::u32vec2, glm::u32vec2)> func)
+	CParallelJob2D(glm::u32vec2 bound_min, glm::u32vec2 bound_max, glm::uint32 chunk_size, int band_num, std::function<void(glm::u32vec2, glm::u32vec2)> func)
 		: bound_min(bound_min)
 		, bound_max(bound_max)
-		, next_start(bound_min)
 		, chunk_size(chunk_size)
-		, func(func) {}
+		, func(func) 
+	{
+		// bands start on tile boundaries so that tiles never overlap
+		glm::uint32 tile_rows = (bound_max.y - bound_min.y + chunk_size - 1) / chunk_size;
+		glm::uint32 band_rows = (tile_rows + band_num - 1) / band_num;
+		for (int band_idx = 0; band_idx < band_num; band_idx++)
+		{
+			glm::uint32 band_start = (std::min)(bound_min.y + band_idx * band_rows * chunk_size, bound_max.y);
+			next_starts.push_back(glm::u32vec2(bound_min.x, band_start));
+			band_ends.push_back((std::min)(band_start + band_rows * chunk_size, bound_max.y));
+		}
+	}
 
-	bool haveWork() const override{ return next_start.y < bound_max.y; }
+	bool haveWork() const override
+	{ 
+		for (size_t band_idx = 0; band_idx < next_starts.size(); band_idx++)
+		{
+			if (bandHaveWork(band_idx))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
 	
 	void runStep(std::unique_lock<std::mutex>* lock)override;
 
 private:
+	bool bandHaveWork(size_t band_idx) const { return next_starts[band_idx].y < band_ends[band_idx]; }
+
 	glm::u32vec2 bound_min;
 	glm::u32vec2 bound_max;
 
-	glm::u32vec2 next_start;
+	std::vector<glm::u32vec2> next_starts;
+	std::vector<glm::uint32> band_ends;
 	
 	glm::uint32 chunk_size;
 	
@@ -29,13 +59,20 @@ private:
 
 void CParallelJob2D::runStep(std::unique_lock<std::mutex>* lock)
 {
+	size_t band_idx = size_t(current_numa_node) < next_starts.size() ? size_t(current_numa_node) : 0;
+	for (size_t idx = 0; !bandHaveWork(band_idx) && idx < next_starts.size(); idx++)
+	{
+		band_idx = idx;
+	}
+
+	glm::u32vec2& next_start = next_starts[band_idx];
 	glm::u32vec2 min_pixel = next_start;
 	glm::u32vec2 max_pixel = next_start + glm::u32vec2(chunk_size, chunk_size);
 
 	next_start.x += chunk_size;
 	if (next_start.x >= bound_max.x) 
 	{
-		next_start.x = bound_max.x;
+		next_start.x = bound_min.x;
 		next_start.y += chunk_size;
 	}
 
@@ -56,10 +93,13 @@ void parallelFor2D(glm::u32vec2 bound_min, glm::u32vec2 bound_max, std::function
 	}
 
 	glm::uint32 total_are = (bound_max.y - bound_min.y) * (bound_max.x - bound_min.x);
-	glm::uint32 per_thread_are = total_are / (CParallelJob::thread_pool ? CParallelJob::thread_pool->size() : 1);
+	// the calling thread works on the tiles as well
+	glm::uint32 per_thread_are = total_are / (CParallelJob::thread_pool ? CParallelJob::thread_pool->size() + 1 : 1);
 	glm::uint32 tile_size = (std::sqrt)(per_thread_are);
 
-	CParallelJob2D loop(bound_min, bound_max, tile_size, std::move(func));
+	tile_size = (std::max)(tile_size, glm::uint32(1));
+
+	CParallelJob2D loop(bound_min, bound_max, tile_size, getNumaNodeCount(), std::move(func));
 	std::unique_lock<std::mutex> lock = CParallelJob::thread_pool->addToJobList(&loop);
 	while (!loop.finished())
 	{
@@ -93,8 +133,23 @@ void CThreadPool::workOrWait(std::unique_lock<std::mutex>* lock)
 	}
 }
 
-void CThreadPool::worker()
+void CThreadPool::waitForJob(CParallelJob* job)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!job->finished())
+	{
+		workOrWait(&lock);
+	}
+}
+
+void CThreadPool::worker(int numa_node, std::vector<int> pin_cpus)
 {
+	if (!pin_cpus.empty() && !pinCurrentThread(pin_cpus))
+	{
+		printf("unable to pin a worker thread to processor %d, it is left to the OS\n", pin_cpus[0]);
+	}
+	current_numa_node = numa_node;
+
 	std::unique_lock<std::mutex> lock(mutex);
 	while (!shut_down_threads)
 	{
@@ -103,17 +158,65 @@ void CThreadPool::worker()
 }
 
 
-CThreadPool::CThreadPool(int num_threads)
+CThreadPool::CThreadPool(int num_threads, bool numa_aware, EThreadAffinity affinity)
 {
-	for (int i = 0; i < num_threads - 1; ++i)
+	const std::vector<std::vector<int>>& node_cpus = getCpuTopology().node_cpus;
+	if (numa_aware)
+	{
+		numa_node_num = int(node_cpus.size());
+	}
+
+	int cpu_num = 0;
+	for (const std::vector<int>& cpus : node_cpus)
+	{
+		cpu_num += int(cpus.size());
+	}
+
+	// The calling thread is not pinned: threads it creates later, like the
+	// TBB workers of the Embree BVH build, inherit its affinity mask on Linux.
+	// Slot 0 of the affinity order is still kept free for it.
+	std::vector<int> cpu_order = getAffinityCpuOrder(affinity);
+
+	for (int i = 1; i < num_threads; ++i)
 	{
-		threads.push_back(std::thread(&CThreadPool::worker, this));
+		int numa_node = 0;
+		std::vector<int> pin_cpus;
+		if (!cpu_order.empty())
+		{
+			int cpu = cpu_order[i % cpu_order.size()];
+			pin_cpus.push_back(cpu);
+			if (numa_node_num > 1)
+			{
+				numa_node = getCpuNumaNode(cpu);
+			}
+		}
+		else if (numa_node_num > 1)
+		{
+			// spread over the nodes in proportion to their processor counts
+			int cpu_idx = int(int64_t(i) * cpu_num / num_threads);
+			while (cpu_idx >= int(node_cpus[numa_node].size()))
+			{
+				cpu_idx -= int(node_cpus[numa_node].size());
+				numa_node++;
+			}
+			pin_cpus = node_cpus[numa_node];
+		}
+		threads.push_back(std::thread(&CThreadPool::worker, this, numa_node, pin_cpus));
 	}
 }
 
 CThreadPool::~CThreadPool()
 {
-	assert_t(false);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		shut_down_threads = true;
+		job_list_condition.notify_all();
+	}
+
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
 }
 
 std::unique_lock<std::mutex> CThreadPool::addToJobList(CParallelJob* job)
@@ -148,4 +251,81 @@ void CThreadPool::removeFromJobList(CParallelJob* job)
 	{
 		job->next->prev = job->prev;
 	}
-}
\ No newline at end of file
+}
+void CAsyncJob::runStep(std::unique_lock<std::mutex>* lock)
+{
+	started = true;
+	CParallelJob::thread_pool->removeFromJobList(this);
+	lock->unlock();
+	func();
+}
+
+void CAsyncJob::wait()
+{
+	if (CParallelJob::thread_pool)
+	{
+		CParallelJob::thread_pool->waitForJob(this);
+	}
+}
+
+std::unique_ptr<CAsyncJob> runAsync(std::function<void()> func)
+{
+	std::unique_ptr<CAsyncJob> job = std::make_unique<CAsyncJob>(std::move(func));
+	if (CParallelJob::thread_pool)
+	{
+		CParallelJob::thread_pool->addToJobList(job.get());
+	}
+	else
+	{
+		job->started = true;
+		job->func();
+	}
+	return job;
+}
+
+void parallelInit(int num_threads, bool numa_aware, EThreadAffinity affinity)
+{
+	if (num_threads <= 0)
+	{
+		// the processors of the process affinity mask, not all of the machine's
+		num_threads = 0;
+		for (const std::vector<int>& cpus : getCpuTopology().node_cpus)
+		{
+			num_threads += int(cpus.size());
+		}
+		if (affinity == TA_PhysicalCores)
+		{
+			num_threads = int(getCpuTopology().core_cpus.size());
+		}
+	}
+	CParallelJob::thread_pool = new CThreadPool(num_threads, numa_aware, affinity);
+}
+
+void parallelCleanup()
+{
+	delete CParallelJob::thread_pool;
+	CParallelJob::thread_pool = nullptr;
+}
+
+int getNumaNodeCount()
+{
+	return CParallelJob::thread_pool ? CParallelJob::thread_pool->numaNodeCount() : 1;
+}
+
+int getCurrentNumaNode()
+{
+	return current_numa_node;
+}
+
+void runOnNumaNode(int numa_node, std::function<void()> func)
+{
+	std::thread node_thread([&]() {
+		if (!pinCurrentThread(getCpuTopology().node_cpus[numa_node]))
+		{
+			printf("unable to pin a thread to NUMA node %d, it is left to the OS\n", numa_node);
+		}
+		current_numa_node = numa_node;
+		func();
+		});
+	node_thread.join();
+}
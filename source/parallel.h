@@ -2,9 +2,12 @@
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <functional>
+#include <memory>
 #include <glm/vec2.hpp>
 #include "common.h"
+#include "cpu_topology.h"
 
 class CThreadPool;
 
@@ -27,20 +30,23 @@ private:
 class CThreadPool
 {
 public:
-	explicit CThreadPool(int num_threads);
+	CThreadPool(int num_threads, bool numa_aware = false, EThreadAffinity affinity = TA_None);
 	~CThreadPool();
 
 	size_t size() const { return threads.size(); }
+	int numaNodeCount() const { return numa_node_num; }
 
 	std::unique_lock<std::mutex> addToJobList(CParallelJob* job);
 	void removeFromJobList(CParallelJob* job);
 	
 	void workOrWait(std::unique_lock<std::mutex>* lock);
+	void waitForJob(CParallelJob* job);
 
 private:
-	void worker();
+	void worker(int numa_node, std::vector<int> pin_cpus);
 
 	std::vector<std::thread> threads;
+	int numa_node_num = 1;
 	mutable std::mutex mutex;
 	CParallelJob* job_list = nullptr;
 	std::condition_variable job_list_condition;
@@ -48,5 +54,43 @@ private:
 };
 
 
+class CAsyncJob : public CParallelJob
+{
+public:
+	CAsyncJob(std::function<void()> func)
+		: func(std::move(func)) {}
+
+	bool haveWork() const override { return !started; }
+	void runStep(std::unique_lock<std::mutex>* lock) override;
+
+	// helps with other jobs until this one has run
+	void wait();
+
+private:
+	friend std::unique_ptr<CAsyncJob> runAsync(std::function<void()> func);
+
+	std::function<void()> func;
+	bool started = false;
+};
+
+// numa_aware: workers are pinned to the NUMA nodes in proportion to their
+// processors, and parallelFor2D hands out tiles of a node's own band first
+// affinity: every worker is pinned to a single logical processor in the
+// order of the policy; the calling thread is left unpinned
+void parallelInit(int num_threads = 0, bool numa_aware = false, EThreadAffinity affinity = TA_None);
+void parallelCleanup();
+
+// nodes the thread pool spreads its workers over, 1 unless NUMA mode is on
+int getNumaNodeCount();
+
+// node of the calling pool worker, 0 for every other thread
+int getCurrentNumaNode();
+
+// runs func on a temporary thread pinned to the node, so that memory it
+// touches first is allocated there
+void runOnNumaNode(int numa_node, std::function<void()> func);
+
+// runs inline when no thread pool has been created
+std::unique_ptr<CAsyncJob> runAsync(std::function<void()> func);
 
 void parallelFor2D(glm::u32vec2 bound_min, glm::u32vec2 bound_max, std::function<void(glm::u32vec2 bound_min, glm::u32vec2 bound_max)> func);
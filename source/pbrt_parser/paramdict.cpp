@@ -3,6 +3,9 @@
 // SPDX: Apache-2.0
 
 #include "paramdict.h"
+#include <assert.h>
+#include <type_traits>
+#include <utility>
 
 namespace pbrt
 {
@@ -269,6 +272,60 @@ std::vector<std::string> ParameterDictionary::GetStringArray(
     return lookupArray<ParameterType::String>(name);
 }
 
+template <ParameterType PT>
+std::span<const typename ParameterTypeTraits<PT>::ReturnType>
+ParameterDictionary::lookupSpan(const std::string& name) const {
+    using traits = ParameterTypeTraits<PT>;
+    using ReturnType = typename traits::ReturnType;
+    using ValueType = typename std::decay_t<decltype(traits::GetValues(std::declval<const ParsedParameter&>()))>::value_type;
+    static_assert(sizeof(ReturnType) == traits::nPerItem * sizeof(ValueType),
+        "span lookups reinterpret the parsed values in place");
+
+    for (const ParsedParameter* p : params) {
+        if (p->name != name || p->type != traits::typeName)
+            continue;
+
+        const auto& values = traits::GetValues(*p);
+        if (values.empty())
+            assert(false);
+        if (values.size() % traits::nPerItem)
+            assert(false);
+
+        p->lookedUp = true;
+        return std::span<const ReturnType>(
+            reinterpret_cast<const ReturnType*>(values.data()), values.size() / traits::nPerItem);
+    }
+
+    return {};
+}
+
+std::span<const float> ParameterDictionary::GetFloatSpan(const std::string& name) const {
+    return lookupSpan<ParameterType::Float>(name);
+}
+
+std::span<const int> ParameterDictionary::GetIntSpan(const std::string& name) const {
+    return lookupSpan<ParameterType::Integer>(name);
+}
+
+std::span<const glm::vec2> ParameterDictionary::GetPoint2fSpan(const std::string& name) const {
+    return lookupSpan<ParameterType::Point2f>(name);
+}
+
+std::span<const glm::vec3> ParameterDictionary::GetPoint3fSpan(const std::string& name) const {
+    return lookupSpan<ParameterType::Point3f>(name);
+}
+
+std::span<const glm::vec3> ParameterDictionary::GetNormal3fSpan(const std::string& name) const {
+    return lookupSpan<ParameterType::Normal3f>(name);
+}
+
+void ParameterDictionary::releaseParameters()
+{
+    for (ParsedParameter* p : params)
+        delete p;
+    params.clear();
+}
+
 glm::vec3 ParameterDictionary::GetRGBColor(const std::string& name) const
 {
     for (const ParsedParameter* p : params)
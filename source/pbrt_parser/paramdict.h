@@ -11,11 +11,22 @@
 #include <string>
 #include <vector>
 #include <array>
+#include <span>
 
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 
+//A7x:[BEGIN]
+#include "memory_tracker.h"
+//A7x:[END]
+
 namespace pbrt {
+    //A7x:[BEGIN]
+    // numeric payloads are the bulk of the parser's memory
+    using ParsedFloatVector = TrackedVector<float, MC_Parser>;
+    using ParsedIntVector = TrackedVector<int, MC_Parser>;
+    //A7x:[END]
+
     // ParsedParameter Definition
     class ParsedParameter {
     public:
@@ -31,8 +42,8 @@ namespace pbrt {
 
         // ParsedParameter Public Members
         std::string type, name;
-        std::vector<float> floats;
-        std::vector<int> ints;
+        ParsedFloatVector floats;
+        ParsedIntVector ints;
         std::vector<std::string> strings;
         std::vector<uint8_t> bools;
         mutable bool lookedUp = false;
@@ -88,9 +99,21 @@ namespace pbrt {
         std::vector< glm::vec3> GetNormal3fArray(const std::string& name) const;
         std::vector<std::string> GetStringArray(const std::string& name) const;
 
+        // Zero-copy views of the parsed values; only valid while the parameters
+        // of this dictionary are alive.
+        std::span<const float> GetFloatSpan(const std::string& name) const;
+        std::span<const int> GetIntSpan(const std::string& name) const;
+        std::span<const glm::vec2> GetPoint2fSpan(const std::string& name) const;
+        std::span<const glm::vec3> GetPoint3fSpan(const std::string& name) const;
+        std::span<const glm::vec3> GetNormal3fSpan(const std::string& name) const;
+
         glm::vec3 GetRGBColor(const std::string& name)const;
 
         inline ParsedParameterVector& getParameters() { return params; }
+
+        // Deletes the parsed parameters. Copies of this dictionary share them,
+        // so only call this on the last user.
+        void releaseParameters();
     private:
 
         // ParameterDictionary Private Methods
@@ -103,6 +126,10 @@ namespace pbrt {
         std::vector<typename ParameterTypeTraits<PT>::ReturnType> lookupArray(
             const std::string& name) const;
 
+        template <ParameterType PT>
+        std::span<const typename ParameterTypeTraits<PT>::ReturnType> lookupSpan(
+            const std::string& name) const;
+
         template <typename ReturnType, typename G, typename C>
         std::vector<ReturnType> lookupArray(const std::string& name, ParameterType type,
             const char* typeName, int nPerItem, G getValues,
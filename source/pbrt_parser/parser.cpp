@@ -6,11 +6,28 @@
 
 #include <fstream>
 #include <assert.h>
+#include <cstring>
+#include <limits>
 #include <format>
 #include <double-conversion/double-conversion.h>
 
 //A7X:[BEGIN]
+#include <algorithm>
 #include <filesystem>
+#include "parallel.h"
+#include "decompress.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define A7X_TOKENIZER_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define A7X_TOKENIZER_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 //A7X:[END]
 
 namespace pbrt
@@ -106,6 +123,7 @@ namespace pbrt
 
 
     Tokenizer::Tokenizer(void* ptr, size_t len, std::function<void(const char*)> errorCallback)
+        : errorCallback(std::move(errorCallback))
     {
         srcDataPtr = (char*)ptr;
         pos = (const char*)ptr;
@@ -113,6 +131,35 @@ namespace pbrt
         CheckUTF(ptr, len);
     }
 
+    //A7X:[BEGIN]
+    Tokenizer::Tokenizer(std::unique_ptr<CDecompressStream> stream, std::function<void(const char*)> errorCallback)
+        : stream(std::move(stream)), errorCallback(std::move(errorCallback)), srcDataPtr(nullptr), pos(nullptr), end(nullptr)
+    {
+        refill();
+        CheckUTF(pos, int(end - pos));
+    }
+
+    bool Tokenizer::refill()
+    {
+        if (!stream)
+            return false;
+
+        prevChunk = std::move(chunk);
+        chunk = stream->nextChunk();
+        pos = chunk.data();
+        end = pos + chunk.size();
+
+        // End of the stream; drop it so prevChunk survives further calls.
+        // A damaged file must not pass for a shorter scene.
+        if (chunk.empty()) {
+            if (stream->failed())
+                errorCallback("compressed data is corrupt or truncated");
+            stream.reset();
+        }
+        return !chunk.empty();
+    }
+    //A7X:[END]
+
     Tokenizer::~Tokenizer()
     {
         free(srcDataPtr);
@@ -120,6 +167,16 @@ namespace pbrt
 
     std::unique_ptr<Tokenizer> Tokenizer::CreateFromFile(const std::string& filename, std::function<void(const char*)> errorCallback)
     {
+        //A7X:[BEGIN]
+        if (detectCompression(filename) != CP_None)
+        {
+            std::unique_ptr<CDecompressStream> stream = CDecompressStream::open(filename);
+            if (!stream)
+                return std::unique_ptr<Tokenizer>(nullptr);
+            return std::make_unique<Tokenizer>(std::move(stream), errorCallback);
+        }
+        //A7X:[END]
+
         std::ifstream file(filename, std::ios::ate);
         if (!file.is_open())
         {
@@ -133,81 +190,135 @@ namespace pbrt
         return std::make_unique<Tokenizer>(((void*)data), size_t(size), errorCallback);
     }
 
+    //A7X:[BEGIN]
+    // Vectorized character class scanning for the tokenizer. Each helper
+    // classifies 32 (AVX2) or 16 (SSE2) bytes per step into a bitmask and
+    // returns the first byte that is (or, for skipSpaces, is not) in the class;
+    // the tail of the buffer and non-x86 builds use the scalar loop.
+    static inline int countTrailingZeros(uint32_t mask) {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return int(index);
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+
+    template <bool Negate, char... Cs>
+    static inline const char* scanCharClass(const char* p, const char* end) {
+#if defined(A7X_TOKENIZER_AVX2)
+        while (end - p >= 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)p);
+            __m256i match = _mm256_setzero_si256();
+            ((match = _mm256_or_si256(match, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(Cs)))), ...);
+            uint32_t mask = uint32_t(_mm256_movemask_epi8(match));
+            if (Negate)
+                mask = ~mask;
+            if (mask)
+                return p + countTrailingZeros(mask);
+            p += 32;
+        }
+#elif defined(A7X_TOKENIZER_SSE2)
+        while (end - p >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            __m128i match = _mm_setzero_si128();
+            ((match = _mm_or_si128(match, _mm_cmpeq_epi8(v, _mm_set1_epi8(Cs)))), ...);
+            uint32_t mask = uint32_t(_mm_movemask_epi8(match));
+            if (Negate)
+                mask = ~mask & 0xFFFF;
+            if (mask)
+                return p + countTrailingZeros(mask);
+            p += 16;
+        }
+#endif
+        while (p != end && (((*p == Cs) || ...) == Negate))
+            ++p;
+        return p;
+    }
+
+    static inline const char* skipSpaces(const char* p, const char* end) {
+        return scanCharClass<true, ' ', '\n', '\t', '\r'>(p, end);
+    }
+
+    static inline const char* findTokenEnd(const char* p, const char* end) {
+        return scanCharClass<false, ' ', '\n', '\t', '\r', '"', '[', ']'>(p, end);
+    }
+
+    static inline const char* findStringSpecial(const char* p, const char* end) {
+        return scanCharClass<false, '"', '\\', '\n'>(p, end);
+    }
+
+    static inline const char* findLineEnd(const char* p, const char* end) {
+        return scanCharClass<false, '\n', '\r'>(p, end);
+    }
+    //A7X:[END]
+
     std::optional<Token> Tokenizer::Next()
     {
-        while (true) {
-            const char* tokenStart = pos;
-
-            int ch = getChar();
-            if (ch == EOF)
-                return std::nullopt;
-            else if (ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r') {
-                // nothing
-            }
-            else if (ch == '"') {
-                // scan to closing quote
-                bool haveEscaped = false;
-                while ((ch = getChar()) != '"') {
-                    if (ch == EOF) {
+        // Skip whitespace in bulk
+        pos = skipSpaces(pos, end);
+        //A7X:[BEGIN]
+        while (pos == end && refill())
+            pos = skipSpaces(pos, end);
+        //A7X:[END]
+        const char* tokenStart = pos;
+
+        int ch = getChar();
+        if (ch == EOF)
+            return std::nullopt;
+        else if (ch == '"') {
+            // scan to closing quote
+            bool haveEscaped = false;
+            while (true) {
+                pos = findStringSpecial(pos, end);
+                if ((ch = getChar()) == '"')
+                    break;
+                if (ch == EOF) {
+                    errorCallback("premature EOF");
+                    return {};
+                }
+                else if (ch == '\n') {
+                    errorCallback("unterminated string");
+                    return {};
+                }
+                else if (ch == '\\') {
+                    haveEscaped = true;
+                    // Grab the next character
+                    if ((ch = getChar()) == EOF) {
                         errorCallback("premature EOF");
                         return {};
                     }
-                    else if (ch == '\n') {
-                        errorCallback("unterminated string");
-                        return {};
-                    }
-                    else if (ch == '\\') {
-                        haveEscaped = true;
-                        // Grab the next character
-                        if ((ch = getChar()) == EOF) {
-                            errorCallback("premature EOF");
-                            return {};
-                        }
-                    }
-                }
-
-                if (!haveEscaped)
-                    return Token({ tokenStart, size_t(pos - tokenStart) });
-                else {
-                    sEscaped.clear();
-                    for (const char* p = tokenStart; p < pos; ++p) {
-                        if (*p != '\\')
-                            sEscaped.push_back(*p);
-                        else {
-                            ++p;
-                            sEscaped.push_back(decodeEscaped(*p));
-                        }
-                    }
-                    return Token({ sEscaped.data(), sEscaped.size() });
-                }
-            } else if (ch == '[' || ch == ']') {
-                return Token({ tokenStart, size_t(1) });
-            } else if (ch == '#') {
-                // comment: scan to EOL (or EOF)
-                while ((ch = getChar()) != EOF) {
-                    if (ch == '\n' || ch == '\r') {
-                        ungetChar();
-                        break;
-                    }
                 }
+            }
 
+            if (!haveEscaped)
                 return Token({ tokenStart, size_t(pos - tokenStart) });
-            }
             else {
-                // Regular statement or numeric token; scan until we hit a
-                // space, opening quote, or bracket.
-                while ((ch = getChar()) != EOF) {
-                    if (ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r' || ch == '"' ||
-                        ch == '[' || ch == ']') {
-                        ungetChar();
-                        break;
+                sEscaped.clear();
+                for (const char* p = tokenStart; p < pos; ++p) {
+                    if (*p != '\\')
+                        sEscaped.push_back(*p);
+                    else {
+                        ++p;
+                        sEscaped.push_back(decodeEscaped(*p));
                     }
                 }
-                return Token({ tokenStart, size_t(pos - tokenStart) });
+                return Token({ sEscaped.data(), sEscaped.size() });
             }
-        };
-
-        return std::nullopt;
+        } else if (ch == '[' || ch == ']') {
+            return Token({ tokenStart, size_t(1) });
+        } else if (ch == '#') {
+            // comment: scan to EOL (or EOF)
+            pos = findLineEnd(pos, end);
+            return Token({ tokenStart, size_t(pos - tokenStart) });
+        }
+        else {
+            // Regular statement or numeric token; scan until we hit a
+            // space, opening quote, or bracket.
+            pos = findTokenEnd(pos, end);
+            return Token({ tokenStart, size_t(pos - tokenStart) });
+        }
     }
 
     static int parseInt(const Token& t) {
@@ -281,6 +392,223 @@ namespace pbrt
         return val;
     }
 
+    //A7X:[BEGIN]
+    // Numeric array fast path. Inline meshes are almost entirely plain decimal
+    // literals, so those are decoded directly from the file buffer; anything
+    // else (hex, very long mantissas, large exponents) goes through parseFloat.
+
+    static inline bool isArraySpace(char ch) {
+        return ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r';
+    }
+
+    static inline bool isArrayDelimiter(char ch) {
+        return isArraySpace(ch) || ch == '"' || ch == '[' || ch == ']';
+    }
+
+    static inline bool isDigit(char ch) { return ch >= '0' && ch <= '9'; }
+
+    // SWAR digit scanning: test and convert eight ASCII digits at once.
+    static inline uint64_t loadEightChars(const char* p) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(uint64_t));
+        return v;
+    }
+
+    static inline bool isEightDigits(uint64_t v) {
+        return (((v & 0xF0F0F0F0F0F0F0F0ull) |
+                 (((v + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) >> 4)) ==
+                0x3333333333333333ull);
+    }
+
+    static inline uint32_t parseEightDigits(uint64_t v) {
+        v = (v & 0x0F0F0F0F0F0F0F0Full) * 2561 >> 8;
+        v = (v & 0x00FF00FF00FF00FFull) * 6553601 >> 16;
+        return uint32_t((v & 0x0000FFFF0000FFFFull) * 42949672960001ull >> 32);
+    }
+
+    static inline const char* scanDigits(const char* p, const char* end, uint64_t& mantissa) {
+        while (end - p >= 8) {
+            uint64_t v = loadEightChars(p);
+            if (!isEightDigits(v))
+                break;
+            mantissa = mantissa * 100000000 + parseEightDigits(v);
+            p += 8;
+        }
+        while (p != end && isDigit(*p)) {
+            mantissa = mantissa * 10 + uint64_t(*p - '0');
+            ++p;
+        }
+        return p;
+    }
+
+    // Decodes a plain decimal literal starting at _p_. Uses the exact double
+    // path (mantissa < 2^53, |exponent| <= 22) and rounds that to float; the
+    // only case where this double rounding could differ from double_conversion's
+    // StringToFloat is a result landing exactly on a float midpoint, which is
+    // rejected so the caller falls back to parseFloat.
+    static bool fastParseFloat(const char* p, const char* end, float* value, const char** next) {
+        static constexpr double powersOfTen[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                                 1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                                 1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                                 1e18, 1e19, 1e20, 1e21, 1e22};
+
+        bool negate = false;
+        if (p != end && (*p == '-' || *p == '+')) {
+            negate = *p == '-';
+            ++p;
+        }
+
+        uint64_t mantissa = 0;
+        const char* intBegin = p;
+        p = scanDigits(p, end, mantissa);
+        int nDigits = int(p - intBegin);
+
+        int exponent = 0;
+        if (p != end && *p == '.') {
+            ++p;
+            const char* fracBegin = p;
+            p = scanDigits(p, end, mantissa);
+            exponent = -int(p - fracBegin);
+            nDigits += int(p - fracBegin);
+        }
+
+        // More than 19 digits may have overflowed the mantissa.
+        if (nDigits == 0 || nDigits > 19)
+            return false;
+
+        if (p != end && (*p == 'e' || *p == 'E')) {
+            ++p;
+            bool negateExp = false;
+            if (p != end && (*p == '-' || *p == '+')) {
+                negateExp = *p == '-';
+                ++p;
+            }
+            if (p == end || !isDigit(*p))
+                return false;
+            int e = 0;
+            while (p != end && isDigit(*p)) {
+                if (e < 10000)
+                    e = e * 10 + (*p - '0');
+                ++p;
+            }
+            exponent += negateExp ? -e : e;
+        }
+
+        if (p != end && !isArrayDelimiter(*p))
+            return false;
+        if (mantissa > (uint64_t(1) << 53) || exponent < -22 || exponent > 22)
+            return false;
+
+        double d = double(mantissa);
+        d = exponent < 0 ? d / powersOfTen[-exponent] : d * powersOfTen[exponent];
+
+        uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(double));
+        if ((bits & 0x1FFFFFFFull) == 0x10000000ull)
+            return false;
+
+        float v = float(d);
+        *value = negate ? -v : v;
+        *next = p;
+        return true;
+    }
+
+    size_t Tokenizer::countArrayValues() const {
+        size_t count = 0;
+        bool inValue = false;
+        for (const char* p = pos; p != end && *p != ']'; ++p) {
+            bool space = isArraySpace(*p);
+            count += (!space && !inValue);
+            inValue = !space;
+        }
+        return count;
+    }
+
+    // Every refilled chunk reserves room for its values; growing at least
+    // geometrically keeps a large compressed array from being copied per chunk.
+    template <typename Vector>
+    static void reserveArrayValues(Vector& values, size_t count) {
+        size_t needed = values.size() + count;
+        if (needed > values.capacity())
+            values.reserve((std::max)(needed, 2 * values.capacity()));
+    }
+
+    bool Tokenizer::ScanFloatArray(ParsedFloatVector& values) {
+        reserveArrayValues(values, countArrayValues());
+
+        while (true) {
+            while (pos != end && isArraySpace(*pos))
+                ++pos;
+            if (pos == end) {
+                if (!refill())
+                    return false;
+                reserveArrayValues(values, countArrayValues());
+                continue;
+            }
+            if (*pos == ']') {
+                ++pos;
+                return true;
+            }
+            if (*pos == '"' || *pos == '[' || *pos == '#')
+                return false;
+
+            float v;
+            const char* next;
+            if (!fastParseFloat(pos, end, &v, &next)) {
+                next = pos;
+                while (next != end && !isArrayDelimiter(*next))
+                    ++next;
+                std::string_view token(pos, size_t(next - pos));
+                if (token == "true" || token == "false")
+                    return false;
+                v = float(parseFloat(Token(token)));
+            }
+            values.push_back(v);
+            pos = next;
+        }
+    }
+
+    bool Tokenizer::ScanIntArray(ParsedIntVector& values) {
+        reserveArrayValues(values, countArrayValues());
+
+        while (true) {
+            while (pos != end && isArraySpace(*pos))
+                ++pos;
+            if (pos == end) {
+                if (!refill())
+                    return false;
+                reserveArrayValues(values, countArrayValues());
+                continue;
+            }
+            if (*pos == ']') {
+                ++pos;
+                return true;
+            }
+            if (*pos == '"' || *pos == '[' || *pos == '#')
+                return false;
+
+            const char* tokenStart = pos;
+            bool negate = false;
+            if (*pos == '-' || *pos == '+') {
+                negate = *pos == '-';
+                ++pos;
+            }
+
+            uint64_t value = 0;
+            const char* digitBegin = pos;
+            pos = scanDigits(pos, end, value);
+            if (pos == digitBegin || pos - digitBegin > 10 ||
+                (pos != end && !isArrayDelimiter(*pos)) ||
+                value > uint64_t(std::numeric_limits<int>::max())) {
+                // Leave malformed or out-of-range values to parseInt().
+                pos = tokenStart;
+                return false;
+            }
+            values.push_back(negate ? -int(value) : int(value));
+        }
+    }
+    //A7X:[END]
+
     inline bool isQuotedString(std::string_view str) {
         return str.size() >= 2 && str[0] == '"' && str.back() == '"';
     }
@@ -298,9 +626,18 @@ namespace pbrt
     constexpr int TokenOptional = 0;
     constexpr int TokenRequired = 1;
 
-    template <typename Next, typename Unget>
+    //A7X:[BEGIN]
+    static bool isNumericArrayType(const std::string& type) {
+        return type == "float" || type == "point2" || type == "vector2" ||
+               type == "point3" || type == "vector3" || type == "normal" ||
+               type == "normal3" || type == "point" || type == "vector" ||
+               type == "rgb" || type == "color" || type == "blackbody";
+    }
+    //A7X:[END]
+
+    template <typename Next, typename Unget, typename ScanArray>
     static ParsedParameterVector parseParameters(
-        Next nextToken, Unget ungetToken, bool formatting,
+        Next nextToken, Unget ungetToken, ScanArray scanArray, bool formatting,
         const std::function<void(const Token& token, const char*)>& errorCallback) {
         ParsedParameterVector parameterVector;
 
@@ -436,7 +773,17 @@ namespace pbrt
             Token val = *nextToken(TokenRequired);
 
             if (val.token == "[") {
-                while (true) {
+                //A7X:[BEGIN]
+                // Numeric payloads are scanned in bulk; if the scanner stops early
+                // the per-token loop below picks up where it left off.
+                if (valType == Int || isNumericArrayType(param->type)) {
+                    if (valType == Unknown)
+                        valType = Float;
+                    if (scanArray(param, valType == Int))
+                        val = Token("]");
+                }
+                //A7X:[END]
+                while (val.token != "]") {
                     val = *nextToken(TokenRequired);
                     if (val.token == "]")
                         break;
@@ -465,9 +812,33 @@ namespace pbrt
         return parameterVector;
     }
 
+    //A7X:[BEGIN]
+    static std::filesystem::path searchDirectory;
+
+    static std::string resolveFilename(const std::string& filename) {
+        std::filesystem::path path(filename);
+        if (searchDirectory.empty() || path.is_absolute())
+            return filename;
+        return (searchDirectory / path).string();
+    }
+    //A7X:[END]
+
     void parse(ParserTarget* target, std::unique_ptr<pbrt::Tokenizer> t)
     {
-        std::unique_ptr<Tokenizer> fileTokenizer = std::move(t);
+        //A7X:[BEGIN]
+        // Include'd files are pushed onto the file stack and popped at EOF.
+        // Import'ed files are parsed concurrently into their own targets, which
+        // are merged in statement order once this file has been parsed.
+        std::vector<std::unique_ptr<Tokenizer>> fileStack;
+        fileStack.push_back(std::move(t));
+
+        std::vector<std::unique_ptr<ParserTarget>> importedTargets;
+        std::vector<std::unique_ptr<CAsyncJob>> importJobs;
+
+        auto tokError = [](const char* msg) {
+            printf("%s\n", msg);
+            };
+        //A7X:[END]
 
         std::optional<Token> ungetToken;
 
@@ -479,10 +850,17 @@ namespace pbrt
             if (ungetToken.has_value())
                 return std::exchange(ungetToken, {});
 
-            std::optional<Token> tok = fileTokenizer->Next();
+            if (fileStack.empty())
+                return std::optional<Token>();
+
+            std::optional<Token> tok = fileStack.back()->Next();
 
             if (!tok) {
-                return std::optional<Token>();
+                // We've reached EOF in the current file. Anything more to parse?
+                fileStack.pop_back();
+                if (fileStack.empty())
+                    return std::optional<Token>();
+                return nextToken(flags);
             }
             else if (tok->token[0] == '#') {
                 return nextToken(flags);
@@ -497,6 +875,15 @@ namespace pbrt
             ungetToken = t;
             };
 
+        //A7X:[BEGIN]
+        auto scanArray = [&](ParsedParameter* param, bool isInt) {
+            if (ungetToken.has_value())
+                return false;
+            return isInt ? fileStack.back()->ScanIntArray(param->ints)
+                         : fileStack.back()->ScanFloatArray(param->floats);
+            };
+        //A7X:[END]
+
         bool formatting = false;
         // Helper function for pbrt API entrypoints that take a single string
         // parameter and a ParameterVector (e.g. pbrtShape()).
@@ -506,7 +893,7 @@ namespace pbrt
             std::string_view dequoted = dequoteString(t);
             std::string n = toString(dequoted);
             ParsedParameterVector parameterVector = parseParameters(
-                nextToken, unget, formatting, [&](const Token& t, const char* msg) {
+                nextToken, unget, scanArray, formatting, [&](const Token& t, const char* msg) {
                     std::string token = toString(t.token);
                     printf(token.c_str());
                 });
@@ -591,6 +978,36 @@ namespace pbrt
                     basicParamListEntrypoint(&ParserTarget::Integrator);
                 else if (tok->token == "Identity")
                     target->Identity();
+                //A7X:[BEGIN]
+                else if (tok->token == "Include") {
+                    std::string filename = resolveFilename(toString(dequoteString(*nextToken(TokenRequired))));
+                    std::unique_ptr<Tokenizer> tinc = Tokenizer::CreateFromFile(filename, tokError);
+                    if (tinc) {
+                        target->IncludedFile(filename);
+                        fileStack.push_back(std::move(tinc));
+                    }
+                    else
+                        printf("%s: unable to open included file\n", filename.c_str());
+                }
+                else if (tok->token == "Import") {
+                    std::string filename = resolveFilename(toString(dequoteString(*nextToken(TokenRequired))));
+                    std::unique_ptr<ParserTarget> importTarget(target->CopyForImport());
+                    std::unique_ptr<Tokenizer> timport = Tokenizer::CreateFromFile(filename, tokError);
+                    if (!importTarget)
+                        printf("Import statement only allowed inside world definition block.\n");
+                    else if (!timport)
+                        printf("%s: unable to open imported file\n", filename.c_str());
+                    else {
+                        target->IncludedFile(filename);
+                        ParserTarget* importTargetPtr = importTarget.get();
+                        Tokenizer* timportPtr = timport.release();
+                        importJobs.push_back(runAsync([importTargetPtr, timportPtr]() {
+                            parse(importTargetPtr, std::unique_ptr<Tokenizer>(timportPtr));
+                            }));
+                        importedTargets.push_back(std::move(importTarget));
+                    }
+                }
+                //A7X:[END]
                 else
                     syntaxError(*tok);
                 break;
@@ -742,7 +1159,7 @@ namespace pbrt
                     std::string_view dequoted = dequoteString(t);
                     std::string texName = toString(dequoted);
                     ParsedParameterVector params = parseParameters(
-                        nextToken, unget, formatting, [&](const Token& t, const char* msg) {
+                        nextToken, unget, scanArray, formatting, [&](const Token& t, const char* msg) {
                             std::string token = toString(t.token);
                             std::string str = std::format("%s: %s", token, msg);
                             printf(str.c_str());
@@ -768,6 +1185,13 @@ namespace pbrt
             };
                     
         };
+
+        //A7X:[BEGIN]
+        for (std::unique_ptr<CAsyncJob>& job : importJobs)
+            job->wait();
+        for (std::unique_ptr<ParserTarget>& imported : importedTargets)
+            target->MergeImported(imported.get());
+        //A7X:[END]
     }
 
     void ParseFile(ParserTarget* target, const std::string& filename)
@@ -785,6 +1209,7 @@ namespace pbrt
         //A7X:[END]
 
         target->SetSearchPath(path.string());
+        searchDirectory = path;
         std::unique_ptr<Tokenizer> t = Tokenizer::CreateFromFile(filename, tokError);
         parse(target, std::move(t));
         target->EndOfFiles();
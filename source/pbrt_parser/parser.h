@@ -17,6 +17,10 @@
 #include <optional>
 #include "paramdict.h"
 
+//A7x:[BEGIN]
+class CDecompressStream;
+//A7x:[END]
+
 namespace pbrt {
 
 	// ParserTarget Definition
@@ -75,6 +79,15 @@ namespace pbrt {
 
 		//A7x:[BEGIN]
 		virtual void SetSearchPath(const std::filesystem::path searchpath) = 0;
+
+		// Import support: returns a new target that an imported file is parsed
+		// into (possibly on another thread), or nullptr if Import is not allowed
+		// here. The parser merges it back with MergeImported() in statement order.
+		virtual ParserTarget* CopyForImport() = 0;
+		virtual void MergeImported(ParserTarget* imported) = 0;
+
+		// Called with the resolved name of every file opened by Include or Import.
+		virtual void IncludedFile(const std::string& filename) = 0;
 		//A7x:[END]
 
 	protected:
@@ -96,6 +109,10 @@ namespace pbrt {
 	public:
 		Tokenizer(void* ptr, size_t len,
 			std::function<void(const char*)> errorCallback);
+		//A7x:[BEGIN]
+		Tokenizer(std::unique_ptr<CDecompressStream> stream,
+			std::function<void(const char*)> errorCallback);
+		//A7x:[END]
 
 		~Tokenizer();
 
@@ -104,7 +121,29 @@ namespace pbrt {
 			std::function<void(const char*)> errorCallback);
 		
 		std::optional<Token> Next();
+
+		//A7x:[BEGIN]
+		// Bulk fast path for the payload of a "[ ... ]" block, called right after
+		// the opening bracket has been returned by Next(). Numbers are converted
+		// straight from the file buffer and appended to _values_. Returns true if
+		// the closing bracket was consumed; otherwise the tokenizer is left at the
+		// first token it could not handle so Next() can continue from there.
+		bool ScanFloatArray(ParsedFloatVector& values);
+		bool ScanIntArray(ParsedIntVector& values);
+		//A7x:[END]
 	private:
+		//A7x:[BEGIN]
+		size_t countArrayValues() const;
+
+		// Compressed files are tokenized chunk by chunk while they are being
+		// decompressed. Chunks end on a line break, so tokens never straddle
+		// two chunks; the previous chunk is kept so the last token stays valid.
+		bool refill();
+
+		std::unique_ptr<CDecompressStream> stream;
+		std::vector<char> chunk, prevChunk;
+		//A7x:[END]
+
 		// Tokenizer Private Methods
 		void CheckUTF(const void* ptr, int len) const;
 
@@ -0,0 +1,214 @@
+#include "preview_stream.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+enum ETevPacketType
+{
+	TP_CreateImage = 4,
+	TP_UpdateImageV2 = 5,
+};
+
+static const char* const preview_channel_names[3] = { "R", "G", "B" };
+
+static void appendBytes(std::vector<uint8_t>& dst, const void* data, size_t size)
+{
+	dst.insert(dst.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+}
+
+static void appendInt(std::vector<uint8_t>& dst, int32_t value)
+{
+	appendBytes(dst, &value, sizeof(value));
+}
+
+static void appendString(std::vector<uint8_t>& dst, const std::string& value)
+{
+	appendBytes(dst, value.c_str(), value.size() + 1);
+}
+
+// reserves the length field and writes the type
+static void beginPacket(std::vector<uint8_t>& packet, ETevPacketType type)
+{
+	packet.assign(sizeof(uint32_t), 0);
+	packet.push_back(uint8_t(type));
+	packet.push_back(0); // don't grab focus
+}
+
+static bool sendPacket(socket_t socket, std::vector<uint8_t>& packet)
+{
+	uint32_t packet_size = uint32_t(packet.size());
+	memcpy(packet.data(), &packet_size, sizeof(packet_size));
+	return sendAll(socket, packet.data(), packet.size());
+}
+
+CPreviewStream::CPreviewStream(const std::string& address, const std::string& image_name, uint32_t width, uint32_t height, float min_interval)
+	: address(address)
+	, image_name(image_name)
+	, width(width)
+	, height(height)
+	, min_interval(min_interval)
+{
+	// the first update goes out right away
+	last_submit_time = SClock::now() - std::chrono::duration_cast<SClock::duration>(std::chrono::duration<float>(min_interval));
+	sender_thread = std::thread(&CPreviewStream::streamImages, this);
+}
+
+CPreviewStream::~CPreviewStream()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		// the final image is usually the last update, let it go out
+		condition.wait(lock, [&]() { return (!has_pending && !sending) || failed; });
+		shut_down = true;
+		condition.notify_all();
+	}
+	sender_thread.join();
+	closeSocket(viewer_socket);
+}
+
+bool CPreviewStream::ready()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return !failed && !has_pending && !sending &&
+		std::chrono::duration<float>(SClock::now() - last_submit_time).count() >= min_interval;
+}
+
+void CPreviewStream::submit(TrackedVector<float, MC_Film>&& pixels)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (failed)
+	{
+		return;
+	}
+	pending_pixels = std::move(pixels);
+	has_pending = true;
+	last_submit_time = SClock::now();
+	condition.notify_all();
+}
+
+void CPreviewStream::streamImages()
+{
+	viewer_socket = connectSocket(address);
+	if (viewer_socket == invalid_socket || !sendCreateImage())
+	{
+		printf("cannot stream the preview to a viewer at %s\n", address.c_str());
+		std::lock_guard<std::mutex> lock(mutex);
+		failed = true;
+		condition.notify_all();
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		condition.wait(lock, [&]() { return has_pending || shut_down; });
+		if (!has_pending)
+		{
+			return;
+		}
+
+		TrackedVector<float, MC_Film> pixels = std::move(pending_pixels);
+		has_pending = false;
+		sending = true;
+
+		lock.unlock();
+		bool sent = sendChangedTiles(pixels);
+		lock.lock();
+
+		sending = false;
+		if (!sent)
+		{
+			printf("preview viewer at %s disconnected\n", address.c_str());
+			failed = true;
+		}
+		condition.notify_all();
+		if (failed)
+		{
+			return;
+		}
+	}
+}
+
+bool CPreviewStream::sendCreateImage()
+{
+	beginPacket(packet, TP_CreateImage);
+	appendString(packet, image_name);
+	appendInt(packet, int32_t(width));
+	appendInt(packet, int32_t(height));
+	appendInt(packet, 3);
+	for (const char* channel_name : preview_channel_names)
+	{
+		appendString(packet, channel_name);
+	}
+	return sendPacket(viewer_socket, packet);
+}
+
+bool CPreviewStream::sendChangedTiles(const TrackedVector<float, MC_Film>& pixels)
+{
+	const bool first_update = sent_pixels.empty();
+	if (first_update)
+	{
+		sent_pixels.assign(pixels.size(), 0.0f);
+	}
+
+	std::vector<float> tile_values;
+	for (uint32_t tile_y = 0; tile_y < height; tile_y += tile_size)
+	{
+		for (uint32_t tile_x = 0; tile_x < width; tile_x += tile_size)
+		{
+			const uint32_t tile_width = (std::min)(tile_size, width - tile_x);
+			const uint32_t tile_height = (std::min)(tile_size, height - tile_y);
+			const size_t row_bytes = size_t(tile_width) * 3 * sizeof(float);
+
+			bool changed = first_update;
+			for (uint32_t y = tile_y; y < tile_y + tile_height && !changed; y++)
+			{
+				size_t row_begin = (size_t(y) * width + tile_x) * 3;
+				changed = memcmp(&pixels[row_begin], &sent_pixels[row_begin], row_bytes) != 0;
+			}
+			if (!changed)
+			{
+				continue;
+			}
+
+			beginPacket(packet, TP_UpdateImageV2);
+			appendString(packet, image_name);
+			appendInt(packet, 3);
+			for (const char* channel_name : preview_channel_names)
+			{
+				appendString(packet, channel_name);
+			}
+			appendInt(packet, int32_t(tile_x));
+			appendInt(packet, int32_t(tile_y));
+			appendInt(packet, int32_t(tile_width));
+			appendInt(packet, int32_t(tile_height));
+
+			// planar: all values of R, then G, then B
+			tile_values.clear();
+			for (int channel_idx = 0; channel_idx < 3; channel_idx++)
+			{
+				for (uint32_t y = tile_y; y < tile_y + tile_height; y++)
+				{
+					const float* row = &pixels[(size_t(y) * width + tile_x) * 3];
+					for (uint32_t x = 0; x < tile_width; x++)
+					{
+						tile_values.push_back(row[x * 3 + channel_idx]);
+					}
+				}
+			}
+			appendBytes(packet, tile_values.data(), tile_values.size() * sizeof(float));
+
+			if (!sendPacket(viewer_socket, packet))
+			{
+				return false;
+			}
+
+			for (uint32_t y = tile_y; y < tile_y + tile_height; y++)
+			{
+				size_t row_begin = (size_t(y) * width + tile_x) * 3;
+				memcpy(&sent_pixels[row_begin], &pixels[row_begin], row_bytes);
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "memory_tracker.h"
+#include "net_socket.h"
+
+// Streams the film to an image viewer speaking the tev IPC protocol
+// (https://github.com/Tom94/tev), by default at 127.0.0.1:14158. Every packet
+// is a little endian uint32 length including the length field, a packet type
+// byte and the payload; strings are null terminated:
+//   CreateImage (4):   grab focus byte, image name, int32 width, height,
+//                      channel count, channel names "R" "G" "B"
+//   UpdateImageV2 (5): grab focus byte, image name, int32 channel count,
+//                      channel names, int32 x, y, width, height of the tile,
+//                      then the tile's float values one channel after another
+// The image is created once, afterwards only the tiles whose values changed
+// since the last update are sent.
+class CPreviewStream
+{
+public:
+	static constexpr uint32_t tile_size = 64;
+
+	CPreviewStream(const std::string& address, const std::string& image_name, uint32_t width, uint32_t height, float min_interval);
+	~CPreviewStream();
+
+	// true if an update would be sent right away: the interval has passed, the
+	// previous update is out and the viewer is still connected
+	bool ready();
+
+	// Linear RGB rows top to bottom. Never waits for the socket; an update
+	// arriving while the previous one is being sent replaces the pending one.
+	void submit(TrackedVector<float, MC_Film>&& pixels);
+
+private:
+	using SClock = std::chrono::steady_clock;
+
+	void streamImages();
+	bool sendCreateImage();
+	bool sendChangedTiles(const TrackedVector<float, MC_Film>& pixels);
+
+	std::string address;
+	std::string image_name;
+	uint32_t width;
+	uint32_t height;
+	float min_interval;
+
+	socket_t viewer_socket = invalid_socket;
+	TrackedVector<float, MC_Film> sent_pixels;
+	std::vector<uint8_t> packet;
+
+	std::thread sender_thread;
+	std::mutex mutex;
+	std::condition_variable condition;
+	TrackedVector<float, MC_Film> pending_pixels;
+	bool has_pending = false;
+	bool sending = false;
+	bool failed = false;
+	bool shut_down = false;
+	SClock::time_point last_submit_time;
+};
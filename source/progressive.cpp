@@ -0,0 +1,96 @@
+#include "progressive.h"
+#include <climits>
+#include <csignal>
+#include <cstdio>
+
+static volatile std::sig_atomic_t interrupt_requested = 0;
+
+static void interruptHandler(int signal_number)
+{
+	interrupt_requested = 1;
+	std::signal(signal_number, SIG_DFL);
+}
+
+void installInterruptHandler()
+{
+	std::signal(SIGINT, interruptHandler);
+}
+
+bool renderInterrupted()
+{
+	return interrupt_requested != 0;
+}
+
+CProgressiveControl::CProgressiveControl(const SProgressiveSettings& settings, int sampler_spp)
+	: settings(settings)
+{
+	target_passes = settings.target_spp > 0 ? settings.target_spp : (settings.time_budget > 0.0f ? INT_MAX : sampler_spp);
+	begin_time = SClock::now();
+	last_preview_time = begin_time;
+	last_checkpoint_time = begin_time;
+}
+
+void CProgressiveControl::resumeFrom(int passes)
+{
+	completed_passes = passes;
+	resumed_passes = passes;
+	finished = completed_passes >= target_passes;
+}
+
+bool CProgressiveControl::passCompleted()
+{
+	completed_passes++;
+	if (completed_passes >= target_passes)
+	{
+		finished = true;
+	}
+	else if (renderInterrupted())
+	{
+		printf("render interrupted after %d passes\n", completed_passes);
+		finished = true;
+	}
+	else if (settings.time_budget > 0.0f)
+	{
+		// stop if the next pass, taking as long as the average one, would exceed the budget
+		float elapsed = std::chrono::duration<float>(SClock::now() - begin_time).count();
+		float pass_time = elapsed / (completed_passes - resumed_passes);
+		if (elapsed + pass_time > settings.time_budget)
+		{
+			printf("time budget of %.1f s reached after %d passes\n", settings.time_budget, completed_passes);
+			finished = true;
+		}
+	}
+	return !finished;
+}
+
+bool CProgressiveControl::previewDue()
+{
+	if (finished || settings.preview_interval <= 0.0f)
+	{
+		return false;
+	}
+
+	SClock::time_point now = SClock::now();
+	if (std::chrono::duration<float>(now - last_preview_time).count() < settings.preview_interval)
+	{
+		return false;
+	}
+	last_preview_time = now;
+	return true;
+}
+
+bool CProgressiveControl::checkpointDue()
+{
+	if (finished || !checkpointsEnabled())
+	{
+		return false;
+	}
+
+	SClock::time_point now = SClock::now();
+	if (std::chrono::duration<float>(now - last_checkpoint_time).count() < settings.checkpoint_interval)
+	{
+		return false;
+	}
+	last_checkpoint_time = now;
+	return true;
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+struct SProgressiveSettings
+{
+	// passes over the image, 0 means the sampler's samples per pixel, or no
+	// limit if there is a time budget
+	int target_spp = 0;
+
+	// wall clock seconds for the passes, 0 means no budget
+	float time_budget = 0.0f;
+
+	// seconds between preview images, 0 means only the final image is written
+	float preview_interval = 0.0f;
+
+	// Adaptive sampling: a pixel stops receiving samples once the relative
+	// standard error of its mean luminance, and that of its neighbours, is
+	// below the threshold. 0 disables it.
+	float adaptive_threshold = 0.0f;
+
+	// samples every pixel gets before its error estimate is trusted
+	int adaptive_min_spp = 16;
+
+	// Seconds between checkpoints of the accumulated state, 0 disables them.
+	// A stop before the target (time budget, SIGINT) also writes one, a
+	// finished render removes it.
+	float checkpoint_interval = 0.0f;
+
+	// continue from checkpoint_file if it belongs to the same scene_hash
+	bool resume = false;
+	std::string checkpoint_file;
+	uint64_t scene_hash = 0;
+
+	// Renders only the sample indices [spp_range_begin, spp_range_end) and
+	// writes the accumulated film as a shard instead of an image. 0 and 0
+	// render everything.
+	int spp_range_begin = 0;
+	int spp_range_end = 0;
+
+	inline bool hasSppRange()const { return spp_range_end > 0; }
+};
+
+// The first SIGINT asks the render to stop after the current pass and still
+// write the image; a second one terminates right away.
+void installInterruptHandler();
+bool renderInterrupted();
+
+// Decides after every full pass over the image whether the render goes on and
+// whether a preview is due. Stopping only happens between passes, so the film
+// always holds the same number of samples in every pixel.
+class CProgressiveControl
+{
+public:
+	CProgressiveControl(const SProgressiveSettings& settings, int sampler_spp);
+
+	inline int targetPasses()const { return target_passes; }
+	inline int completedPasses()const { return completed_passes; }
+
+	// adaptive sampling runs more passes than the spp, on fewer pixels
+	inline void setTargetPasses(int passes) { target_passes = passes; }
+
+	// continues the pass count of a checkpoint
+	void resumeFrom(int passes);
+
+	// the render is done before the target pass count, e.g. every adaptive pixel converged
+	inline void markComplete() { complete = true; finished = true; }
+	inline bool isComplete()const { return complete || completed_passes >= target_passes; }
+
+	// false once the target, the time budget or an interrupt ends the render
+	bool passCompleted();
+
+	// true at most once per preview interval; never for the last pass, which
+	// is written as the final image anyway
+	bool previewDue();
+
+	inline bool checkpointsEnabled()const { return settings.checkpoint_interval > 0.0f; }
+
+	// true at most once per checkpoint interval while the render goes on
+	bool checkpointDue();
+
+private:
+	using SClock = std::chrono::steady_clock;
+
+	SProgressiveSettings settings;
+	int target_passes;
+	int completed_passes = 0;
+	int resumed_passes = 0;
+	bool finished = false;
+	bool complete = false;
+	SClock::time_point begin_time;
+	SClock::time_point last_preview_time;
+	SClock::time_point last_checkpoint_time;
+};
@@ -1,12 +1,379 @@
 #include "render.h"
 #include "integrators.h"
+#include "material.h"
+#include "progressive.h"
+#include "pbrt_parser/parser.h"
+#include "pbrt/hash.h"
+#include <chrono>
+#include <cstring>
+#include <limits>
+
+// The main camera and the named views share the accelerator and the lights.
+// Integrators that trace a single camera render the views one after another.
+static void renderViews(CAlpa7XScene& a7x_scene, CAccelerator* accel, const std::vector<std::shared_ptr<CLight>>& lights)
+{
+	CSampler* sampler = a7x_scene.getSampler();
+	std::unique_ptr<CIntegrator> integrator = a7x_scene.createIntegrator(a7x_scene.getCamera(), sampler, accel, lights);
+	std::vector<CPerspectiveCamera*> separate_views;
+	for (CPerspectiveCamera* view_camera : a7x_scene.getViewCameras())
+	{
+		if (!integrator->addView(view_camera))
+		{
+			separate_views.push_back(view_camera);
+		}
+	}
+	integrator->render();
+	integrator.reset();
+
+	for (CPerspectiveCamera* view_camera : separate_views)
+	{
+		if (renderInterrupted())
+		{
+			break;
+		}
+		a7x_scene.createIntegrator(view_camera, sampler, accel, lights)->render();
+	}
+}
 
 void renderScene(CAlpa7XScene& a7x_scene)
 {
 	std::vector<std::shared_ptr<CLight>> lights;
-	CPerspectiveCamera* camera = a7x_scene.getCamera();
-	CSampler* sampler = a7x_scene.getSampler();
 	CAccelerator* accel = a7x_scene.createAccelerator(lights);
-	std::unique_ptr<CIntegrator> integrator = a7x_scene.createIntegrator(camera, sampler, accel, lights);
+	renderViews(a7x_scene, accel, lights);
+}
+
+struct SBatchFrame
+{
+	std::unique_ptr<CAlpa7XScene> scene;
+	std::vector<std::shared_ptr<CLight>> lights;
+	CAccelerator* accel = nullptr;
+};
+
+void renderBatch(const std::vector<std::string>& scene_files, std::function<void(CAlpa7XScene& scene, const std::string& scene_file)> configure_scene)
+{
+	CMeshBufferCache mesh_cache;
+
+	// the jobs are std::functions, the frames are handed over through shared_ptr
+	auto loadFrame = [&](const std::string& scene_file, std::shared_ptr<SBatchFrame> frame) {
+		auto load_begin = std::chrono::steady_clock::now();
+		mesh_cache.beginFrame();
+		frame->scene = std::make_unique<CAlpa7XScene>();
+		configure_scene(*frame->scene, scene_file);
+		frame->scene->setMeshBufferCache(&mesh_cache);
+
+		Alpha7XSceneBuilder builder(frame->scene.get());
+		pbrt::ParseFile(&builder, scene_file);
+		frame->accel = frame->scene->createAccelerator(frame->lights);
+		printf("%s loaded: %.3f s, %d shapes reused from the previous frame\n", scene_file.c_str(),
+			std::chrono::duration<float>(std::chrono::steady_clock::now() - load_begin).count(), frame->accel->getMeshDedupStats().cached_shape_num);
+	};
+
+	auto batch_begin = std::chrono::steady_clock::now();
+	std::shared_ptr<SBatchFrame> next_frame = std::make_shared<SBatchFrame>();
+	std::unique_ptr<CAsyncJob> load_job = runAsync([&, next_frame]() { loadFrame(scene_files[0], next_frame); });
+	std::unique_ptr<CAsyncJob> release_job;
+	size_t rendered_frames = 0;
+	for (size_t frame_idx = 0; frame_idx < scene_files.size(); frame_idx++)
+	{
+		load_job->wait();
+		std::shared_ptr<SBatchFrame> frame = std::move(next_frame);
+
+		// the cache only serves one build at a time, so the next load starts after this one finished
+		if (frame_idx + 1 < scene_files.size() && !renderInterrupted())
+		{
+			next_frame = std::make_shared<SBatchFrame>();
+			load_job = runAsync([&, next_frame, frame_idx]() { loadFrame(scene_files[frame_idx + 1], next_frame); });
+		}
+
+		renderViews(*frame->scene, frame->accel, frame->lights);
+		rendered_frames++;
+
+		// the film's destructor waits for the image writer
+		if (release_job)
+		{
+			release_job->wait();
+		}
+		release_job = runAsync([frame]() mutable { frame.reset(); });
+		frame.reset();
+
+		if (renderInterrupted())
+		{
+			break;
+		}
+	}
+
+	load_job->wait();
+	if (release_job)
+	{
+		release_job->wait();
+	}
+	next_frame.reset();
+	printf("batch: %zu of %zu frames in %.3f s\n", rendered_frames, scene_files.size(), std::chrono::duration<float>(std::chrono::steady_clock::now() - batch_begin).count());
+}
+
+struct SAcceleratorBenchmark
+{
+	const char* name;
+	EAcceleratorBackend backend;
+
+	// per pixel, max float for a camera ray that missed
+	std::vector<float> hit_t;
+	std::vector<uint8_t> visible;
+};
+
+void benchmarkAccelerators(const std::string& scene_file, std::function<void(CAlpa7XScene& scene, const std::string& scene_file)> configure_scene)
+{
+	const int timed_pass_num = 4;
+	SAcceleratorBenchmark benchmarks[2] = { { "embree", AB_Embree, {}, {} }, { "wide bvh", AB_WideBVH, {}, {} } };
+	for (SAcceleratorBenchmark& benchmark : benchmarks)
+	{
+		CAlpa7XScene scene;
+		configure_scene(scene, scene_file);
+		scene.setAcceleratorBackend(benchmark.backend);
+		Alpha7XSceneBuilder builder(&scene);
+		pbrt::ParseFile(&builder, scene_file);
+
+		std::vector<std::shared_ptr<CLight>> lights;
+		auto build_begin = std::chrono::steady_clock::now();
+		CAccelerator* accel = scene.createAccelerator(lights);
+		float build_time = std::chrono::duration<float>(std::chrono::steady_clock::now() - build_begin).count();
+
+		CPerspectiveCamera* camera = scene.getCamera();
+		glm::u32vec2 image_size = camera->getFilm()->getImageSize();
+		size_t pixel_num = size_t(image_size.x) * image_size.y;
+		benchmark.hit_t.assign(pixel_num, std::numeric_limits<float>::max());
+		benchmark.visible.assign(pixel_num, 1);
+		std::vector<glm::vec3> hit_positions(pixel_num);
+		std::vector<glm::vec3> hit_normals(pixel_num);
+
+		auto tracePass = [&](bool visibility) {
+			parallelFor2D(glm::u32vec2(0, 0), image_size, [&](glm::u32vec2 tile_min, glm::u32vec2 tile_max) {
+				for (uint32_t y = tile_min.y; y < tile_max.y; y++)
+				{
+					for (uint32_t x = tile_min.x; x < tile_max.x; x++)
+					{
+						size_t pixel_idx = size_t(y) * image_size.x + x;
+						if (!visibility)
+						{
+							CRay camera_ray(camera->getCameraPos(), camera->getPixelRayDirection(glm::vec2(x, y) + 0.5f));
+							SShapeInteraction shape_interaction = accel->intersection(camera_ray);
+							benchmark.hit_t[pixel_idx] = shape_interaction.hit_t;
+							hit_positions[pixel_idx] = shape_interaction.sface_interaction.position;
+							hit_normals[pixel_idx] = shape_interaction.sface_interaction.norm;
+						}
+						else if (benchmark.hit_t[pixel_idx] != std::numeric_limits<float>::max())
+						{
+							glm::vec2 u(pbrt::HashFloat(x, y, 0), pbrt::HashFloat(x, y, 1));
+							glm::vec3 direction = CTangentBasis::fromZ(hit_normals[pixel_idx]).fromLocal(sampleConsineHemisphere(u));
+							benchmark.visible[pixel_idx] = accel->traceVisibilityRay(CRay(hit_positions[pixel_idx], direction), std::numeric_limits<float>::max());
+						}
+					}
+				}
+			});
+		};
+
+		auto timePasses = [&](bool visibility) {
+			tracePass(visibility);
+			auto pass_begin = std::chrono::steady_clock::now();
+			for (int pass_idx = 0; pass_idx < timed_pass_num; pass_idx++)
+			{
+				tracePass(visibility);
+			}
+			return std::chrono::duration<float>(std::chrono::steady_clock::now() - pass_begin).count();
+		};
+
+		float camera_time = timePasses(false);
+		float visibility_time = timePasses(true);
+		size_t hit_num = std::count_if(benchmark.hit_t.begin(), benchmark.hit_t.end(), [](float hit_t) { return hit_t != std::numeric_limits<float>::max(); });
+		printf("%s: build %.3f s, camera rays %.2f Mrays/s, visibility rays %.2f Mrays/s, %zu of %zu pixels hit\n", benchmark.name, build_time,
+			pixel_num * timed_pass_num / (camera_time * 1e6f), hit_num * timed_pass_num / ((std::max)(visibility_time, 1e-6f) * 1e6f), hit_num, pixel_num);
+	}
+
+	// t may differ in the last bits, and rays through shared edges may hit either triangle
+	size_t camera_mismatch_num = 0;
+	size_t visibility_mismatch_num = 0;
+	for (size_t pixel_idx = 0; pixel_idx < benchmarks[0].hit_t.size(); pixel_idx++)
+	{
+		float embree_t = benchmarks[0].hit_t[pixel_idx];
+		float bvh_t = benchmarks[1].hit_t[pixel_idx];
+		if (std::abs(embree_t - bvh_t) > 1e-3f * (std::max)(embree_t, 1.0f))
+		{
+			camera_mismatch_num++;
+		}
+		else if (benchmarks[0].visible[pixel_idx] != benchmarks[1].visible[pixel_idx])
+		{
+			visibility_mismatch_num++;
+		}
+	}
+	printf("the backends disagree on %zu camera rays and %zu visibility rays\n", camera_mismatch_num, visibility_mismatch_num);
+}
+
+bool mergeFilmShards(const std::vector<std::string>& shard_files, const SFilmResolveSettings& resolve_settings, const SImageOutputSettings& output_settings)
+{
+	std::unique_ptr<CRGBFilm> film;
+	SCheckpointHeader film_header;
+	std::vector<std::pair<int, int>> spp_ranges;
+	for (const std::string& shard_file : shard_files)
+	{
+		CCheckpointReader reader;
+		SCheckpointHeader header;
+		int spp_end = 0;
+		int32_t spp_begin = 0;
+		if (!reader.readHeader(shard_file, header, spp_end) || header.integrator_type != CI_FilmShard || !reader.read(&spp_begin, sizeof(spp_begin)))
+		{
+			printf("%s is not a film shard\n", shard_file.c_str());
+			return false;
+		}
+
+		if (!film)
+		{
+			film_header = header;
+			film = std::make_unique<CRGBFilm>(glm::u32vec2(header.width, header.height), resolve_settings);
+			film->enableSampleStatistics();
+		}
+		else if (header.scene_hash != film_header.scene_hash || header.width != film_header.width || header.height != film_header.height)
+		{
+			printf("%s belongs to another scene than %s\n", shard_file.c_str(), shard_files[0].c_str());
+			return false;
+		}
+
+		if (!film->mergeState(reader) || !reader.finish())
+		{
+			printf("film shard %s is damaged\n", shard_file.c_str());
+			return false;
+		}
+		spp_ranges.push_back(std::make_pair(int(spp_begin), spp_end));
+	}
+
+	if (!film)
+	{
+		return false;
+	}
+
+	// overlapping ranges would count the same samples twice, gaps only lower the spp
+	std::sort(spp_ranges.begin(), spp_ranges.end());
+	for (size_t range_idx = 1; range_idx < spp_ranges.size(); range_idx++)
+	{
+		if (spp_ranges[range_idx].first < spp_ranges[range_idx - 1].second)
+		{
+			printf("spp ranges %d:%d and %d:%d overlap\n", spp_ranges[range_idx - 1].first, spp_ranges[range_idx - 1].second, spp_ranges[range_idx].first, spp_ranges[range_idx].second);
+			return false;
+		}
+		if (spp_ranges[range_idx].first > spp_ranges[range_idx - 1].second)
+		{
+			printf("samples %d to %d are missing\n", spp_ranges[range_idx - 1].second, spp_ranges[range_idx].first);
+		}
+	}
+
+	SImageOutputSettings settings = output_settings;
+	if (settings.file_name.empty())
+	{
+		settings.file_name = "pbrt.exr";
+	}
+	film->setOutputSettings(settings);
+	film->writeImage(0);
+	film->flushOutput();
+	printf("merged %zu shards into %s\n", shard_files.size(), settings.file_name.c_str());
+	return true;
+}
+
+CRenderSession::CRenderSession(CAlpa7XScene& scene)
+	: scene(scene)
+{
+	CAccelerator* accel = scene.createAccelerator(lights);
+	integrator = scene.createIntegrator(scene.getCamera(), scene.getSampler(), accel, lights);
+
+	// the film is rendered again after edits, an old checkpoint would not match it
+	progressive_settings = scene.getProgressiveSettings();
+	progressive_settings.checkpoint_interval = 0.0f;
+	progressive_settings.resume = false;
+	integrator->setProgressiveSettings(progressive_settings);
+}
+
+void CRenderSession::setCamera(const glm::mat4x4& camera_from_world, float fov)
+{
+	scene.getCamera()->setTransform(camera_from_world, fov);
+}
+
+bool CRenderSession::setDiffuseReflectance(const std::string& material_name, glm::vec3 reflectance)
+{
+	CDiffuseMaterial* material = dynamic_cast<CDiffuseMaterial*>(scene.findMaterial(material_name));
+	if (material == nullptr)
+	{
+		printf("no diffuse material %s\n", material_name.c_str());
+		return false;
+	}
+	material->setReflectance(reflectance);
+	return true;
+}
+
+bool CRenderSession::setDielectricEta(const std::string& material_name, float eta)
+{
+	CDielectricMaterial* material = dynamic_cast<CDielectricMaterial*>(scene.findMaterial(material_name));
+	if (material == nullptr)
+	{
+		printf("no dielectric material %s\n", material_name.c_str());
+		return false;
+	}
+	material->setEta(eta);
+	return true;
+}
+
+void CRenderSession::setSpp(int spp)
+{
+	progressive_settings.target_spp = spp;
+	integrator->setProgressiveSettings(progressive_settings);
+}
+
+void CRenderSession::render()
+{
+	auto render_begin = std::chrono::steady_clock::now();
+	CRGBFilm* rgb_film = scene.getCamera()->getFilm();
+	rgb_film->clear();
 	integrator->render();
+	rgb_film->flushOutput();
+	printf("render: %.3f s\n", std::chrono::duration<float>(std::chrono::steady_clock::now() - render_begin).count());
+}
+
+void runSessionCommands(CRenderSession& session, FILE* commands)
+{
+	char line[1024];
+	char name[256];
+	while (fgets(line, sizeof(line), commands))
+	{
+		float m[16];
+		float fov;
+		glm::vec3 reflectance;
+		float eta;
+		int spp;
+		if (sscanf(line, " camera %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f",
+			&m[0], &m[1], &m[2], &m[3], &m[4], &m[5], &m[6], &m[7], &m[8], &m[9], &m[10], &m[11], &m[12], &m[13], &m[14], &m[15], &fov) == 17)
+		{
+			session.setCamera(glm::mat4x4(glm::vec4(m[0], m[1], m[2], m[3]), glm::vec4(m[4], m[5], m[6], m[7]), glm::vec4(m[8], m[9], m[10], m[11]), glm::vec4(m[12], m[13], m[14], m[15])), fov);
+		}
+		else if (sscanf(line, " reflectance %255s %f %f %f", name, &reflectance.x, &reflectance.y, &reflectance.z) == 4)
+		{
+			session.setDiffuseReflectance(name, reflectance);
+		}
+		else if (sscanf(line, " eta %255s %f", name, &eta) == 2)
+		{
+			session.setDielectricEta(name, eta);
+		}
+		else if (sscanf(line, " spp %d", &spp) == 1 && spp > 0)
+		{
+			session.setSpp(spp);
+		}
+		else if (sscanf(line, " %255s", name) == 1 && strcmp(name, "render") == 0)
+		{
+			session.render();
+		}
+		else if (sscanf(line, " %255s", name) == 1 && strcmp(name, "quit") == 0)
+		{
+			return;
+		}
+		else if (sscanf(line, " %255s", name) == 1)
+		{
+			printf("unknown session command: %s", line);
+		}
+	}
 }
@@ -1,3 +1,53 @@
 #pragma once
+#include <cstdio>
+#include <functional>
 #include "scene.h"
-void renderScene(CAlpa7XScene& a7x_scene);
\ No newline at end of file
+void renderScene(CAlpa7XScene& a7x_scene);
+
+// Renders a sequence of pbrt files as a pipeline: while frame N renders, frame
+// N+1 is parsed and built on a pool thread, and frame N is torn down (which
+// waits for its image) in the background. Meshes byte-identical to the previous
+// frame's keep their buffers, see CMeshBufferCache. configure_scene applies the
+// command line settings to every frame before it is parsed.
+void renderBatch(const std::vector<std::string>& scene_files, std::function<void(CAlpa7XScene& scene, const std::string& scene_file)> configure_scene);
+
+// Parses the scene once per accelerator backend and prints the build time and
+// the rays per second of camera rays through the pixel centers and of one
+// visibility ray per hit in a hashed direction. Hits the backends disagree on
+// are counted; the first ray pass is not timed since it builds lazy objects.
+void benchmarkAccelerators(const std::string& scene_file, std::function<void(CAlpa7XScene& scene, const std::string& scene_file)> configure_scene);
+
+// sums the films of --spp_range shards of one scene and writes the image
+bool mergeFilmShards(const std::vector<std::string>& shard_files, const SFilmResolveSettings& resolve_settings, const SImageOutputSettings& output_settings);
+
+// Keeps the committed accelerator, materials, lights and integrator of a scene
+// alive between renders. Camera moves, material edits and spp changes are
+// applied in place and only cost the render, the BVH is built once.
+class CRenderSession
+{
+public:
+	CRenderSession(CAlpa7XScene& scene);
+
+	// camera_from_world in the layout of pbrt's Transform directive
+	void setCamera(const glm::mat4x4& camera_from_world, float fov);
+	bool setDiffuseReflectance(const std::string& material_name, glm::vec3 reflectance);
+	bool setDielectricEta(const std::string& material_name, float eta);
+	void setSpp(int spp);
+
+	// renders the current state into the cleared film and writes the image
+	void render();
+
+private:
+	CAlpa7XScene& scene;
+	std::vector<std::shared_ptr<CLight>> lights;
+	std::unique_ptr<CIntegrator> integrator;
+	SProgressiveSettings progressive_settings;
+};
+
+// Applies one command per line until "quit" or the end of the stream:
+//   camera <16 floats as in a pbrt Transform> <fov>
+//   reflectance <material> <r> <g> <b>
+//   eta <material> <eta>
+//   spp <samples per pixel>
+//   render
+void runSessionCommands(CRenderSession& session, FILE* commands);
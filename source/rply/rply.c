@@ -178,6 +178,7 @@ typedef t_ply_odriver* p_ply_odriver;
  * obj_info: obj_info items for this file
  * nobj_infos: number of obj_info items in file
  * fp: file pointer associated with ply file
+ * input_cb, input_data: optional replacement for fread on fp
  * rn: skip extra char after end_header?
  * buffer: last word/chunck of data read from ply file
  * buffer_first, buffer_last: interval of untouched good data in buffer
@@ -202,6 +203,8 @@ typedef struct t_ply_ {
     long nobj_infos;
     FILE* fp;
     int own_fp;
+    p_ply_input_cb input_cb;
+    void* input_data;
     int rn;
     char buffer[BUFFERSIZE];
     size_t buffer_first, buffer_token, buffer_last;
@@ -305,6 +308,12 @@ static int ply_read_scalar_property(p_ply ply, p_ply_element element,
 /* consumes data from buffer */
 #define BSKIP(p, s) (p->buffer_first += s)
 
+/* reads from the user callback if there is one, from fp otherwise */
+static size_t ply_fread(p_ply ply, void* buffer, size_t size) {
+    if (ply->input_cb) return ply->input_cb(ply->input_data, buffer, size);
+    return fread(buffer, 1, size, ply->fp);
+}
+
 /* refills the buffer */
 static int BREFILL(p_ply ply) {
     /* move untouched data to beginning of buffer */
@@ -313,7 +322,7 @@ static int BREFILL(p_ply ply) {
     ply->buffer_last = size;
     ply->buffer_first = ply->buffer_token = 0;
     /* fill remaining with new data */
-    size = fread(ply->buffer + size, 1, BUFFERSIZE - size - 1, ply->fp);
+    size = ply_fread(ply, ply->buffer + size, BUFFERSIZE - size - 1);
     /* increase size to account for new data */
     ply->buffer_last += size;
     /* place sentinel so we can use str* functions with buffer */
@@ -393,8 +402,33 @@ p_ply ply_open_from_file(FILE* fp, p_ply_error_cb error_cb,
     return ply;
 }
 
+p_ply ply_open_from_reader(p_ply_input_cb input_cb, void* input_data,
+    p_ply_error_cb error_cb, long idata, void* pdata) {
+    p_ply ply = NULL;
+    if (error_cb == NULL) error_cb = ply_error_cb;
+    assert(input_cb);
+    if (!ply_type_check()) {
+        error_cb(ply, "Incompatible type system");
+        return NULL;
+    }
+    ply = ply_alloc();
+    if (!ply) {
+        error_cb(NULL, "Out of memory");
+        return NULL;
+    }
+    ply->idata = idata;
+    ply->pdata = pdata;
+    ply->io_mode = PLY_READ;
+    ply->error_cb = error_cb;
+    ply->fp = NULL;
+    ply->own_fp = 0;
+    ply->input_cb = input_cb;
+    ply->input_data = input_data;
+    return ply;
+}
+
 int ply_read_header(p_ply ply) {
-    assert(ply && ply->fp && ply->io_mode == PLY_READ);
+    assert(ply && (ply->fp || ply->input_cb) && ply->io_mode == PLY_READ);
     if (!ply_read_header_magic(ply)) return 0;
     if (!ply_read_word(ply)) return 0;
     /* parse file format */
@@ -441,7 +475,7 @@ long ply_set_read_cb(p_ply ply, const char* element_name,
 int ply_read(p_ply ply) {
     long i;
     p_ply_argument argument;
-    assert(ply && ply->fp && ply->io_mode == PLY_READ);
+    assert(ply && (ply->fp || ply->input_cb) && ply->io_mode == PLY_READ);
     argument = &ply->argument;
     /* for each element type */
     for (i = 0; i < ply->nelements; i++) {
@@ -694,7 +728,7 @@ int ply_write(p_ply ply, double value) {
 
 int ply_close(p_ply ply) {
     long i;
-    assert(ply && ply->fp);
+    assert(ply && (ply->fp || ply->input_cb));
     assert(ply->element || ply->nelements == 0);
     assert(!ply->element || ply->nelements > 0);
     /* write last chunk to file */
@@ -960,7 +994,7 @@ static int ply_check_word(p_ply ply) {
 
 static int ply_read_word(p_ply ply) {
     size_t t = 0;
-    assert(ply && ply->fp && ply->io_mode == PLY_READ);
+    assert(ply && (ply->fp || ply->input_cb) && ply->io_mode == PLY_READ);
     /* skip leading blanks */
     while (1) {
         t = strspn(BFIRST(ply), " \n\r\t");
@@ -1018,7 +1052,7 @@ static int ply_check_line(p_ply ply) {
 
 static int ply_read_line(p_ply ply) {
     const char* end = NULL;
-    assert(ply && ply->fp && ply->io_mode == PLY_READ);
+    assert(ply && (ply->fp || ply->input_cb) && ply->io_mode == PLY_READ);
     /* look for a end of line */
     end = strchr(BFIRST(ply), '\n');
     /* if we didn't reach the end of the buffer, we are done */
@@ -1055,7 +1089,7 @@ static int ply_read_line(p_ply ply) {
 static int ply_read_chunk(p_ply ply, void* anybuffer, size_t size) {
     char* buffer = (char*)anybuffer;
     size_t i = 0;
-    assert(ply && ply->fp && ply->io_mode == PLY_READ);
+    assert(ply && (ply->fp || ply->input_cb) && ply->io_mode == PLY_READ);
     assert(ply->buffer_first <= ply->buffer_last);
     while (i < size) {
         if (ply->buffer_first < ply->buffer_last) {
@@ -1065,7 +1099,7 @@ static int ply_read_chunk(p_ply ply, void* anybuffer, size_t size) {
         }
         else {
             ply->buffer_first = 0;
-            ply->buffer_last = fread(ply->buffer, 1, BUFFERSIZE, ply->fp);
+            ply->buffer_last = ply_fread(ply, ply->buffer, BUFFERSIZE);
             if (ply->buffer_last <= 0) return 0;
         }
     }
@@ -1201,7 +1235,7 @@ static p_ply_property ply_grow_property(p_ply ply, p_ply_element element) {
 }
 
 static int ply_read_header_format(p_ply ply) {
-    assert(ply && ply->fp && ply->io_mode == PLY_READ);
+    assert(ply && (ply->fp || ply->input_cb) && ply->io_mode == PLY_READ);
     if (strcmp(BWORD(ply), "format")) return 0;
     if (!ply_read_word(ply)) return 0;
     ply->storage_mode = ply_find_string(BWORD(ply), ply_storage_mode_list);
@@ -1217,7 +1251,7 @@ static int ply_read_header_format(p_ply ply) {
 }
 
 static int ply_read_header_comment(p_ply ply) {
-    assert(ply && ply->fp && ply->io_mode == PLY_READ);
+    assert(ply && (ply->fp || ply->input_cb) && ply->io_mode == PLY_READ);
     if (strcmp(BWORD(ply), "comment")) return 0;
     if (!ply_read_line(ply)) return 0;
     if (!ply_add_comment(ply, BLINE(ply))) return 0;
@@ -1226,7 +1260,7 @@ static int ply_read_header_comment(p_ply ply) {
 }
 
 static int ply_read_header_obj_info(p_ply ply) {
-    assert(ply && ply->fp && ply->io_mode == PLY_READ);
+    assert(ply && (ply->fp || ply->input_cb) && ply->io_mode == PLY_READ);
     if (strcmp(BWORD(ply), "obj_info")) return 0;
     if (!ply_read_line(ply)) return 0;
     if (!ply_add_obj_info(ply, BLINE(ply))) return 0;
@@ -1265,7 +1299,7 @@ static int ply_read_header_property(p_ply ply) {
 static int ply_read_header_element(p_ply ply) {
     p_ply_element element = NULL;
     long dummy;
-    assert(ply && ply->fp && ply->io_mode == PLY_READ);
+    assert(ply && (ply->fp || ply->input_cb) && ply->io_mode == PLY_READ);
     if (strcmp(BWORD(ply), "element")) return 0;
     /* allocate room for new element */
     element = ply_grow_element(ply);
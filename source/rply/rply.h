@@ -9,6 +9,8 @@
  * at the end of this file.
  * ---------------------------------------------------------------------- */
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -71,6 +73,29 @@ extern "C" {
     p_ply ply_open(const char* name, p_ply_error_cb error_cb, long idata,
         void* pdata);
 
+    /* ----------------------------------------------------------------------
+     * Input callback prototype, used instead of fread by ply_open_from_reader
+     *
+     * input_data: user pointer given to ply_open_from_reader
+     * buffer, size: destination of at most size bytes
+     *
+     * Returns the number of bytes read, 0 at end of input or on error
+     * ---------------------------------------------------------------------- */
+    typedef size_t (*p_ply_input_cb)(void* input_data, void* buffer, size_t size);
+
+    /* ----------------------------------------------------------------------
+     * Opens a PLY stream for reading from a user supplied read callback,
+     * e.g. a decompressor (fails if the data is not a PLY file)
+     *
+     * input_cb, input_data: input callback and its user pointer
+     * error_cb: error callback function
+     * idata,pdata: contextual information available to users
+     *
+     * Returns handle to PLY stream if successful, NULL otherwise
+     * ---------------------------------------------------------------------- */
+    p_ply ply_open_from_reader(p_ply_input_cb input_cb, void* input_data,
+        p_ply_error_cb error_cb, long idata, void* pdata);
+
     /* ----------------------------------------------------------------------
      * Reads and parses the header of a PLY file returned by ply_open
      *
@@ -1,5 +1,6 @@
 #pragma once
 #include <glm/vec2.hpp>
+#include <memory>
 #include "alpha7x_math.h"
 #include "sampling.h"
 
@@ -7,6 +8,10 @@ class CSampler
 {
 public:
 	CSampler(int ipt_spp) :samplers_per_pixel(ipt_spp) {};
+	virtual ~CSampler() {};
+
+	// samplers keep per pixel state, every render thread works on its own copy
+	virtual std::unique_ptr<CSampler> clone() const = 0;
 
 	virtual void initPixelSample(glm::u32vec2 pos, int sample_index, int dim = 0) = 0;
 	virtual float get1D() = 0;
@@ -27,6 +32,11 @@ public:
 		scale = roundUpPow2(std::max(full_resolution.x, full_resolution.y));
 	};
 
+	std::unique_ptr<CSampler> clone() const
+	{
+		return std::make_unique<CSobelSampler>(*this);
+	}
+
 	inline void initPixelSample(glm::u32vec2 pos, int sample_index, int dim = 0)
 	{
 		pixel = pos;
@@ -1,15 +1,36 @@
 #include <iterator>
+#include <chrono>
+#include <fstream>
 #include "scene.h"
+#include "pbrt/hash.h"
+#include <glm/gtc/matrix_transform.hpp>
 
 static std::filesystem::path search_path;
 
 void Alpha7XSceneBuilder::Scale(float sx, float sy, float sz)
 {
+	graphics_state.transform = graphics_state.transform * glm::scale(glm::mat4x4(1.0f), glm::vec3(sx, sy, sz));
 }
 
 void Alpha7XSceneBuilder::Shape(const std::string& name, pbrt::ParsedParameterVector params)
 {
 	pbrt::ParameterDictionary dict(std::move(params));
+	if (name == "plymesh")
+	{
+		scene->mesh_files.insert((search_path / std::filesystem::path(dict.GetOneString("filename", ""))).string());
+	}
+
+	// object instances only carry geometry, as in pbrt
+	if (!object_name.empty())
+	{
+		if (!graphics_state.area_light_name.empty())
+		{
+			printf("area lights are not supported in object %s, the shape is not emissive\n", object_name.c_str());
+			graphics_state.area_light_name = std::string();
+		}
+		scene->object_definitions[object_name].push_back(SShapeSceneEntity(name, dict, graphics_state.material_name, -1));
+		return;
+	}
 
 	int areaLightIndex = -1;
 	if (!graphics_state.area_light_name.empty())
@@ -20,6 +41,16 @@ void Alpha7XSceneBuilder::Shape(const std::string& name, pbrt::ParsedParameterVe
 	}
 
 	SShapeSceneEntity shape_entity(name, dict, graphics_state.material_name, areaLightIndex);
+	submitShape(std::move(shape_entity));
+}
+
+void Alpha7XSceneBuilder::submitShape(SShapeSceneEntity&& shape_entity)
+{
+	// shapes whose material is not known yet are built with the rest of the scene
+	if (scene->isStreamingBuild() && scene->streamShape(shape_entity))
+	{
+		return;
+	}
 	shapes.push_back(std::move(shape_entity));
 }
 
@@ -34,22 +65,52 @@ void Alpha7XSceneBuilder::Option(const std::string& name, const std::string& val
 
 void Alpha7XSceneBuilder::Identity()
 {
+	graphics_state.transform = glm::mat4x4(1.0f);
 }
 
 void Alpha7XSceneBuilder::Translate(float dx, float dy, float dz)
 {
+	graphics_state.transform = graphics_state.transform * glm::translate(glm::mat4x4(1.0f), glm::vec3(dx, dy, dz));
 }
 
+// angle in degrees, as in pbrt
 void Alpha7XSceneBuilder::Rotate(float angle, float ax, float ay, float az)
 {
+	glm::vec3 axis(ax, ay, az);
+	if (glm::length(axis) == 0.0f)
+	{
+		printf("Rotate around a zero axis is ignored\n");
+		return;
+	}
+	graphics_state.transform = graphics_state.transform * glm::rotate(glm::mat4x4(1.0f), glm::radians(angle), glm::normalize(axis));
 }
 
+// pbrt's left handed look-at: the camera looks down +z with y up, the matrix
+// is camera_from_world like the one a Transform directive gives the camera
 void Alpha7XSceneBuilder::LookAt(float ex, float ey, float ez, float lx, float ly, float lz, float ux, float uy, float uz)
 {
+	glm::vec3 eye(ex, ey, ez);
+	glm::vec3 dir = glm::normalize(glm::vec3(lx, ly, lz) - eye);
+	glm::vec3 right = glm::cross(glm::normalize(glm::vec3(ux, uy, uz)), dir);
+	if (!(glm::length(right) > 0.0f))
+	{
+		printf("LookAt with the up vector along the viewing direction is ignored\n");
+		return;
+	}
+	right = glm::normalize(right);
+	glm::vec3 up = glm::cross(dir, right);
+
+	glm::mat4x4 world_from_camera(glm::vec4(right, 0.0f), glm::vec4(up, 0.0f), glm::vec4(dir, 0.0f), glm::vec4(eye, 1.0f));
+	graphics_state.transform = graphics_state.transform * glm::inverse(world_from_camera);
 }
 
 void Alpha7XSceneBuilder::ConcatTransform(float transform[16])
 {
+	glm::vec4 v0 = glm::vec4(transform[0], transform[1], transform[2], transform[3]);
+	glm::vec4 v1 = glm::vec4(transform[4], transform[5], transform[6], transform[7]);
+	glm::vec4 v2 = glm::vec4(transform[8], transform[9], transform[10], transform[11]);
+	glm::vec4 v3 = glm::vec4(transform[12], transform[13], transform[14], transform[15]);
+	graphics_state.transform = graphics_state.transform * glm::mat4x4(v0, v1, v2, v3);
 }
 
 void Alpha7XSceneBuilder::Transform(float* transform)
@@ -109,9 +170,23 @@ void Alpha7XSceneBuilder::Integrator(const std::string& name, pbrt::ParsedParame
 	integrator = SSceneEntity(name, std::move(dict));
 }
 
+// A Camera with a "string view" parameter adds a named view to the main
+// camera: the views are rendered in the same run and share the scene build,
+// each into <film filename>_<view>.<ext>. Without an unnamed Camera the first
+// view is the main camera. Every camera takes the current transformation
+// matrix as its camera_from_world.
 void Alpha7XSceneBuilder::Camera(const std::string& name, pbrt::ParsedParameterVector params)
 {
-	camera = SCameraSceneEntity(graphics_state.transform, name, params);
+	SCameraSceneEntity camera_entity(graphics_state.transform, name, params);
+	if (camera_entity.parameters.GetOneString("view", "").empty())
+	{
+		camera = camera_entity;
+		has_camera = true;
+	}
+	else
+	{
+		views.push_back(camera_entity);
+	}
 }
 
 void Alpha7XSceneBuilder::MakeNamedMedium(const std::string& name, pbrt::ParsedParameterVector params)
@@ -130,15 +205,31 @@ void Alpha7XSceneBuilder::Sampler(const std::string& name, pbrt::ParsedParameter
 
 void Alpha7XSceneBuilder::WorldBegin()
 {
-	scene->SetOptions(filter, film, camera, sampler, integrator, accelerator);
+	in_world_block = true;
+	if (!has_camera && !views.empty())
+	{
+		camera = views.front();
+		views.erase(views.begin());
+	}
+	scene->SetOptions(filter, film, camera, views, sampler, integrator, accelerator);
+	graphics_state.transform = glm::mat4x4(1.0f);
 }
 
+// the transform, material and area light are scoped to the attribute block, as in pbrt
 void Alpha7XSceneBuilder::AttributeBegin()
 {
+	pushed_graphics_states.push_back(graphics_state);
 }
 
 void Alpha7XSceneBuilder::AttributeEnd()
 {
+	if (pushed_graphics_states.empty())
+	{
+		printf("Unmatched AttributeEnd encountered, ignoring it\n");
+		return;
+	}
+	graphics_state = std::move(pushed_graphics_states.back());
+	pushed_graphics_states.pop_back();
 }
 
 void Alpha7XSceneBuilder::Attribute(const std::string& target, pbrt::ParsedParameterVector params)
@@ -178,16 +269,22 @@ void Alpha7XSceneBuilder::ReverseOrientation()
 {
 }
 
+// Shapes between ObjectBegin and ObjectEnd are in object space; every
+// ObjectInstance places the object with the current transform.
 void Alpha7XSceneBuilder::ObjectBegin(const std::string& name)
 {
+	object_name = name;
+	scene->object_definitions[name];
 }
 
 void Alpha7XSceneBuilder::ObjectEnd()
 {
+	object_name = std::string();
 }
 
 void Alpha7XSceneBuilder::ObjectInstance(const std::string& name)
 {
+	scene->object_instances.push_back(std::make_pair(name, graphics_state.transform));
 }
 
 void Alpha7XSceneBuilder::EndOfFiles()
@@ -196,6 +293,7 @@ void Alpha7XSceneBuilder::EndOfFiles()
 	{
 		std::move(std::begin(shapes), std::end(shapes), std::back_inserter(scene->shapes));
 	}
+	scene->hashSourceFiles();
 }
 
 void Alpha7XSceneBuilder::SetSearchPath(const std::filesystem::path searchpath)
@@ -203,123 +301,354 @@ void Alpha7XSceneBuilder::SetSearchPath(const std::filesystem::path searchpath)
 	search_path = searchpath;
 }
 
+pbrt::ParserTarget* Alpha7XSceneBuilder::CopyForImport()
+{
+	if (!in_world_block)
+	{
+		return nullptr;
+	}
+
+	Alpha7XSceneBuilder* import_builder = new Alpha7XSceneBuilder(nullptr);
+	import_builder->import_scene = std::make_unique<CAlpa7XScene>();
+	import_builder->scene = import_builder->import_scene.get();
+	import_builder->graphics_state = graphics_state;
+	import_builder->in_world_block = true;
+	return import_builder;
+}
+
+void Alpha7XSceneBuilder::MergeImported(pbrt::ParserTarget* imported)
+{
+	Alpha7XSceneBuilder* import_builder = static_cast<Alpha7XSceneBuilder*>(imported);
+	CAlpa7XScene* imported_scene = import_builder->scene;
+
+	// light indices of the imported shapes refer to the imported light list
+	int light_index_offset = scene->light_entities.size();
+	std::move(std::begin(imported_scene->light_entities), std::end(imported_scene->light_entities), std::back_inserter(scene->light_entities));
+	std::move(std::begin(imported_scene->named_materials), std::end(imported_scene->named_materials), std::back_inserter(scene->named_materials));
+
+	for (auto& object_definition : imported_scene->object_definitions)
+	{
+		std::vector<SShapeSceneEntity>& object_shapes = scene->object_definitions[object_definition.first];
+		std::move(std::begin(object_definition.second), std::end(object_definition.second), std::back_inserter(object_shapes));
+	}
+	std::move(std::begin(imported_scene->object_instances), std::end(imported_scene->object_instances), std::back_inserter(scene->object_instances));
+	std::move(std::begin(imported_scene->included_files), std::end(imported_scene->included_files), std::back_inserter(scene->included_files));
+	scene->mesh_files.insert(std::begin(imported_scene->mesh_files), std::end(imported_scene->mesh_files));
+
+	for (SShapeSceneEntity& shape_entity : import_builder->shapes)
+	{
+		if (shape_entity.light_index != -1)
+		{
+			shape_entity.light_index += light_index_offset;
+		}
+		submitShape(std::move(shape_entity));
+	}
+}
+
+void Alpha7XSceneBuilder::IncludedFile(const std::string& filename)
+{
+	scene->included_files.push_back(filename);
+}
+
+// The scene hash set before parsing covers the top-level file only; the bytes of
+// the included and imported files and the size and modification time of the
+// meshes are added here, so editing any of them invalidates checkpoints, shards
+// and farm workers. Farm workers need copies of the meshes that keep their
+// modification times.
+void CAlpa7XScene::hashSourceFiles()
+{
+	if (progressive_settings.scene_hash == 0)
+	{
+		return;
+	}
+
+	uint64_t scene_hash = progressive_settings.scene_hash;
+	for (const std::string& file_name : included_files)
+	{
+		std::ifstream included_file(file_name, std::ios::binary);
+		std::vector<char> file_bytes((std::istreambuf_iterator<char>(included_file)), std::istreambuf_iterator<char>());
+		scene_hash = pbrt::HashBuffer(file_bytes.data(), file_bytes.size(), scene_hash);
+	}
+	for (const std::string& file_name : mesh_files)
+	{
+		std::error_code error;
+		uint64_t file_size = std::filesystem::file_size(file_name, error);
+		int64_t write_time = std::filesystem::last_write_time(file_name, error).time_since_epoch().count();
+		scene_hash = pbrt::Hash(scene_hash, file_size, write_time);
+	}
+	progressive_settings.scene_hash = scene_hash;
+}
+
 CAlpa7XScene::~CAlpa7XScene()
 {
 	delete camera;
 	delete sampler;
 	delete rgb_film;
 	delete accelerator;
+	for (CPerspectiveCamera* view_camera : view_cameras)
+	{
+		delete view_camera->getFilm();
+		delete view_camera;
+	}
 }
 
 std::unique_ptr<CIntegrator> CAlpa7XScene::createIntegrator(CPerspectiveCamera* camera, CSampler* sampler, CAccelerator* ipt_scene_inter_cpt, std::vector<std::shared_ptr<CLight>> lights)
 {
+	std::unique_ptr<CIntegrator> integrator;
 	if (integrators.name == "path")
 	{
 		int max_depth = integrators.parameters.GetOneInt("maxdepth", 5);
-		return std::make_unique<CPathIntegrator>(max_depth, camera, sampler, ipt_scene_inter_cpt, lights);
+		integrator = std::make_unique<CPathIntegrator>(max_depth, camera, sampler, ipt_scene_inter_cpt, lights);
 	}
 	else if(integrators.name == "sppm")
 	{
 		int max_depth = integrators.parameters.GetOneInt("maxdepth", 5);
 		float initial_radius = integrators.parameters.GetOneFloat("radius", 1.0);
-		return std::make_unique<CSPPMIntegrator>(max_depth, initial_radius, camera, sampler, ipt_scene_inter_cpt, lights);
+		integrator = std::make_unique<CSPPMIntegrator>(max_depth, initial_radius, camera, sampler, ipt_scene_inter_cpt, lights);
 	}
 	else
 	{
 		assert(false);
+		return integrator;
+	}
+	SProgressiveSettings settings = progressive_settings;
+	if (settings.checkpoint_file.empty())
+	{
+		settings.checkpoint_file = camera->getFilm()->getOutputFileName() + ".ckpt";
 	}
-	return std::unique_ptr<CIntegrator>(nullptr);
+	integrator->setProgressiveSettings(settings);
+	return integrator;
 }
 
-void CAlpa7XScene::SetOptions(SSceneEntity ipt_filter, SSceneEntity ipt_film, SCameraSceneEntity ipt_camera, SSceneEntity ipt_sampler, SSceneEntity ipt_integrator, SSceneEntity ipt_accelerator)
+// image.exr and view "left" give image_left.exr
+static std::string viewFileName(const std::string& file_name, const std::string& view_name)
+{
+	if (view_name.empty())
+	{
+		return file_name;
+	}
+	std::filesystem::path file_path(file_name);
+	return (file_path.parent_path() / (file_path.stem().string() + "_" + view_name + file_path.extension().string())).string();
+}
+
+void CAlpa7XScene::SetOptions(SSceneEntity ipt_filter, SSceneEntity ipt_film, SCameraSceneEntity ipt_camera, const std::vector<SCameraSceneEntity>& ipt_views, SSceneEntity ipt_sampler, SSceneEntity ipt_integrator, SSceneEntity ipt_accelerator)
 {
 	integrators = ipt_integrator;
 	
 	int img_sz_x = ipt_film.parameters.GetOneInt("xresolution", 1280);
 	int img_sz_y = ipt_film.parameters.GetOneInt("yresolution", 720);
-	rgb_film = new CRGBFilm(glm::uvec2(img_sz_x, img_sz_y));
+	rgb_film = new CRGBFilm(glm::uvec2(img_sz_x, img_sz_y), film_resolve_settings);
+
+	SImageOutputSettings output_settings = image_output_settings;
+	if (output_settings.file_name.empty())
+	{
+		output_settings.file_name = ipt_film.parameters.GetOneString("filename", "pbrt.exr");
+	}
+	SImageOutputSettings view_settings = output_settings;
+	view_settings.file_name = viewFileName(output_settings.file_name, ipt_camera.parameters.GetOneString("view", ""));
+	rgb_film->setOutputSettings(view_settings);
 
 	float fov = ipt_camera.parameters.GetOneFloat("fov",90);
 	camera = new CPerspectiveCamera(ipt_camera.camera_trans_mat, fov,rgb_film);
 
+	// the views share the resolution, and with it the sampler
+	for (const SCameraSceneEntity& view : ipt_views)
+	{
+		CRGBFilm* view_film = new CRGBFilm(glm::uvec2(img_sz_x, img_sz_y), film_resolve_settings);
+		view_settings.file_name = viewFileName(output_settings.file_name, view.parameters.GetOneString("view", ""));
+		view_film->setOutputSettings(view_settings);
+		view_cameras.push_back(new CPerspectiveCamera(view.camera_trans_mat, view.parameters.GetOneFloat("fov", 90), view_film));
+	}
+
 	int spp = ipt_sampler.parameters.GetOneInt("pixelsamples", 4);
 	sampler = new CSobelSampler(spp, glm::ivec2(img_sz_x, img_sz_y));
 }
 
-CAccelerator* CAlpa7XScene::createAccelerator(std::vector<std::shared_ptr<CLight>>& lights)
+void CAlpa7XScene::addPendingMaterials()
 {
 	if (accelerator == nullptr)
 	{
-		accelerator = new CAccelerator();
-		for (int mat_idx = 0; mat_idx < named_materials.size(); mat_idx++)
+		accelerator = new CAccelerator(mesh_cache, accelerator_backend);
+		accelerator->mesh_dedup = mesh_dedup;
+		if (compact_geometry)
+		{
+			accelerator->enableCompactScene();
+		}
+	}
+
+	// material indices match the indices in named_materials
+	for (size_t mat_idx = accelerator->scene_materials.size(); mat_idx < named_materials.size(); mat_idx++)
+	{
+		SSceneEntity& scene_entity = named_materials[mat_idx].second;
+
+		CMaterial* new_material = nullptr;
+		std::string material_type = scene_entity.parameters.GetOneString("type", "");
+		if (material_type == "diffuse")
 		{
-			SSceneEntity& scene_entity = named_materials[mat_idx].second;
-			
-			CMaterial* new_material = nullptr;
-			std::string material_type = scene_entity.parameters.GetOneString("type", "");
-			if (material_type == "diffuse")
+			for (const pbrt::ParsedParameter* p : scene_entity.parameters.getParameters())
 			{
-				for (const pbrt::ParsedParameter* p : scene_entity.parameters.getParameters())
+				if (p->name == "reflectance" && p->type == "rgb")
 				{
-					if (p->name == "reflectance" && p->type == "rgb")
-					{
-						new_material = new CDiffuseMaterial(glm::vec3(p->floats[0], p->floats[1], p->floats[2]));
-					}
+					new_material = new CDiffuseMaterial(glm::vec3(p->floats[0], p->floats[1], p->floats[2]));
 				}
 			}
-			else
+		}
+		else
+		{
+			float eta = scene_entity.parameters.GetOneFloat("eta", 1.0);
+			float remaproughness = scene_entity.parameters.GetOneBool("remaproughness",false);
+			new_material = new CDielectricMaterial(eta, remaproughness);
+		}
+		accelerator->scene_materials.push_back(new_material);
+		accelerator->mat_name_idx_map.insert(std::pair(named_materials[mat_idx].first, int(mat_idx)));
+	}
+}
+
+// emissive shapes with identical payloads share one triangle mesh
+std::shared_ptr<STriangleMesh> CAlpa7XScene::createLightMesh(SShapeSceneEntity& shape_entity)
+{
+	std::span<const int> indices = shape_entity.parameters.GetIntSpan("indices");
+	std::span<const glm::vec3> points = shape_entity.parameters.GetPoint3fSpan("P");
+	std::span<const glm::vec3> normals = shape_entity.parameters.GetNormal3fSpan("N");
+	std::span<const glm::vec2> uvs = shape_entity.parameters.GetPoint2fSpan("uv");
+
+	std::shared_ptr<STriangleMesh> triangle_mesh = std::make_shared<STriangleMesh>();
+	triangle_mesh->init(indices, points, normals, uvs, compact_geometry);
+
+	uint64_t hash = pbrt::HashBuffer(indices.data(), indices.size_bytes());
+	hash = pbrt::HashBuffer(points.data(), points.size_bytes(), hash);
+	hash = pbrt::HashBuffer(normals.data(), normals.size_bytes(), hash);
+	hash = pbrt::HashBuffer(uvs.data(), uvs.size_bytes(), hash);
+
+	if (mesh_dedup)
+	{
+		auto range = light_meshes.equal_range(hash);
+		for (auto iter = range.first; iter != range.second; iter++)
+		{
+			if (iter->second->sameData(*triangle_mesh))
 			{
-				float eta = scene_entity.parameters.GetOneFloat("eta", 1.0);
-				float remaproughness = scene_entity.parameters.GetOneBool("remaproughness",false);
-				new_material = new CDielectricMaterial(eta, remaproughness);
+				return iter->second;
 			}
-			accelerator->scene_materials.push_back(new_material);
-			accelerator->mat_name_idx_map.insert(std::pair(named_materials[mat_idx].first, mat_idx));
 		}
+	}
+
+	scene_triangle_meshes.push_back(triangle_mesh);
+	light_meshes.emplace(hash, triangle_mesh);
+	return triangle_mesh;
+}
+
+void CAlpa7XScene::addShape(SShapeSceneEntity& shape_entity, std::vector<std::shared_ptr<CLight>>& lights)
+{
+	if (shape_entity.light_index != -1)
+	{
+		std::shared_ptr<STriangleMesh> triangle_mesh = createLightMesh(shape_entity);
 
-		for (int shape_idx = 0; shape_idx < shapes.size(); shape_idx++)
+		SSceneEntity& light_entitie = light_entities[shape_entity.light_index];
+		glm::vec3 l_emit = light_entitie.parameters.GetRGBColor("L");
+		for (size_t tri_idx = 0; tri_idx < triangle_mesh->triangleCount(); tri_idx++)
 		{
-			SShapeSceneEntity& shape_entity = shapes[shape_idx];
+			CTriangle triangle;
+			triangle.triangle_mesh = triangle_mesh;
+			triangle.tri_index = int(tri_idx);
+			std::shared_ptr<CLight> area_light = std::make_shared<CDiffuseAreaLight>(triangle, l_emit);
+			lights.push_back(area_light);
+		}
+	}
 
-			if (shape_entity.light_index != -1)
-			{
-				std::shared_ptr<STriangleMesh> triangle_mesh = std::make_shared<STriangleMesh>();
-				triangle_mesh->indices = shape_entity.parameters.GetIntArray("indices");
-				triangle_mesh->points = shape_entity.parameters.GetPoint3fArray("P");
-				triangle_mesh->normals = shape_entity.parameters.GetNormal3fArray("N");
-				triangle_mesh->uvs = shape_entity.parameters.GetPoint2fArray("uv");
+	{
+		auto mat_map_iter = accelerator->mat_name_idx_map.find(shape_entity.material_name);
+		if (mat_map_iter != accelerator->mat_name_idx_map.end())
+		{
+			// geometry IDs index scene_geometries
+			int geometry_id = accelerator->scene_geometries.size();
+			SA7XGeometry scene_geometry;
+			scene_geometry.geometry = accelerator->createRTCGeometry(&shape_entity, geometry_id, search_path);
+			scene_geometry.material_idx = mat_map_iter->second;
+			accelerator->scene_geometries.push_back(scene_geometry);
+		}
+		else
+		{
+			assert(false);
+		}
+	}
+}
 
-				scene_triangle_meshes.push_back(triangle_mesh);
+bool CAlpa7XScene::streamShape(SShapeSceneEntity& shape_entity)
+{
+	addPendingMaterials();
+	if (accelerator->mat_name_idx_map.find(shape_entity.material_name) == accelerator->mat_name_idx_map.end())
+	{
+		return false;
+	}
 
-				SSceneEntity& light_entitie = light_entities[shape_entity.light_index];
-				glm::vec3 l_emit = light_entitie.parameters.GetRGBColor("L");
-				for (int tri_idx = 0; tri_idx < triangle_mesh->indices.size() / 3; tri_idx++)
-				{
-					CTriangle triangle;
-					triangle.triangle_mesh = triangle_mesh;
-					triangle.tri_index = tri_idx;
-					std::shared_ptr<CLight> area_light = std::make_shared<CDiffuseAreaLight>(triangle, l_emit);
-					lights.push_back(area_light);
-				}
-			}
-			
+	addShape(shape_entity, streamed_lights);
+	shape_entity.parameters.releaseParameters();
+	return true;
+}
+
+CMaterial* CAlpa7XScene::findMaterial(const std::string& name)
+{
+	if (accelerator == nullptr)
+	{
+		return nullptr;
+	}
+	auto mat_map_iter = accelerator->mat_name_idx_map.find(name);
+	return mat_map_iter == accelerator->mat_name_idx_map.end() ? nullptr : accelerator->scene_materials[mat_map_iter->second];
+}
+
+CAccelerator* CAlpa7XScene::createAccelerator(std::vector<std::shared_ptr<CLight>>& lights)
+{
+	if (!accelerator_committed)
+	{
+		auto build_begin = std::chrono::steady_clock::now();
+		addPendingMaterials();
+
+		lights.insert(lights.end(), streamed_lights.begin(), streamed_lights.end());
+		streamed_lights.clear();
+
+		for (SShapeSceneEntity& shape_entity : shapes)
+		{
+			addShape(shape_entity, lights);
+			shape_entity.parameters.releaseParameters();
+		}
+		shapes.clear();
+
+		std::map<std::string, int> object_indices;
+		for (auto& object_definition : object_definitions)
+		{
+			object_indices[object_definition.first] = accelerator->addLazyObject(std::move(object_definition.second), search_path);
+		}
+		object_definitions.clear();
+		for (const std::pair<std::string, glm::mat4x4>& object_instance : object_instances)
+		{
+			auto object_iter = object_indices.find(object_instance.first);
+			if (object_iter == object_indices.end())
 			{
-				auto mat_map_iter = accelerator->mat_name_idx_map.find(shape_entity.material_name);
-				if (mat_map_iter != accelerator->mat_name_idx_map.end())
-				{
-					SA7XGeometry scene_geometry;
-					scene_geometry.geometry = accelerator->createRTCGeometry(&shape_entity, shape_idx, search_path);
-					scene_geometry.material_idx = mat_map_iter->second;
-					accelerator->scene_geometries.push_back(scene_geometry);
-				}
-				else
-				{
-					assert(false);
-				}
+				printf("instance of unknown object %s\n", object_instance.first.c_str());
+				continue;
 			}
-			
+			accelerator->addLazyInstance(object_iter->second, object_instance.second);
 		}
+		object_instances.clear();
+
 		accelerator->finalizeRtSceneCreate();
+		accelerator_committed = true;
+
+		// with a streaming build most of the geometry was created during parsing
+		float build_time = std::chrono::duration<float>(std::chrono::steady_clock::now() - build_begin).count();
+		const SMeshDedupStats& dedup_stats = accelerator->getMeshDedupStats();
+		printf("scene build: %.3f s, %d shapes (%d sharing an earlier mesh, %d kept from the previous frame), mesh buffers %.1f MB (%.1f MB without dedup)\n",
+			build_time, dedup_stats.shape_num, dedup_stats.shared_shape_num, dedup_stats.cached_shape_num,
+			(dedup_stats.buffer_bytes - dedup_stats.shared_bytes) / (1024.0 * 1024.0), dedup_stats.buffer_bytes / (1024.0 * 1024.0));
+
+		size_t light_mesh_bytes = 0, light_mesh_full_bytes = 0;
+		for (const std::shared_ptr<STriangleMesh>& triangle_mesh : scene_triangle_meshes)
+		{
+			light_mesh_bytes += triangle_mesh->memoryBytes();
+			light_mesh_full_bytes += triangle_mesh->fullPrecisionBytes();
+		}
+		printf("emissive meshes: %.1f MB (%.1f MB in the full precision layout)\n",
+			light_mesh_bytes / (1024.0 * 1024.0), light_mesh_full_bytes / (1024.0 * 1024.0));
 	}
 	
 	return accelerator;
@@ -1,8 +1,11 @@
 #pragma once
 #include <memory>
+#include <set>
+#include <unordered_map>
 #include "pbrt_parser/parser.h"
 #include "pbrt_parser/paramdict.h"
 #include "film.h"
+#include "progressive.h"
 #include "integrators.h"
 #include "cameras.h"
 #include "samplers.h"
@@ -54,12 +57,44 @@ public:
 
     std::unique_ptr<CIntegrator> createIntegrator(CPerspectiveCamera* camera,CSampler* sampler, CAccelerator* ipt_scene_inter_cpt, std::vector<std::shared_ptr<CLight>> lights);
 
-    void SetOptions(SSceneEntity ipt_filter, SSceneEntity ipt_film, SCameraSceneEntity ipt_camera, SSceneEntity ipt_sampler, SSceneEntity ipt_integrator, SSceneEntity ipt_accelerator);
+    void SetOptions(SSceneEntity ipt_filter, SSceneEntity ipt_film, SCameraSceneEntity ipt_camera, const std::vector<SCameraSceneEntity>& ipt_views, SSceneEntity ipt_sampler, SSceneEntity ipt_integrator, SSceneEntity ipt_accelerator);
 
     inline CPerspectiveCamera* getCamera() { return camera; }
+
+    // the cameras of named views besides the main one, each with its own film
+    inline const std::vector<CPerspectiveCamera*>& getViewCameras()const { return view_cameras; }
     inline CSampler* getSampler() { return sampler; }
     CAccelerator* createAccelerator(std::vector<std::shared_ptr<CLight>>& lights);
 
+    // streaming build: shapes are turned into Embree geometry as they are parsed
+    // and their parameters are released right away
+    inline void enableStreamingBuild() { streaming_build = true; }
+    inline bool isStreamingBuild()const { return streaming_build; }
+    bool streamShape(SShapeSceneEntity& shape_entity);
+
+    // identical mesh payloads share their buffers, see CAccelerator::findMeshBuffers
+    inline void disableMeshDedup() { mesh_dedup = false; }
+
+    // compact light mesh layout and Embree's compact BVH, see STriangleMesh
+    inline void enableCompactGeometry() { compact_geometry = true; }
+
+    // mesh buffers shared with the previous frame of a batch, see CMeshBufferCache
+    inline void setMeshBufferCache(CMeshBufferCache* cache) { mesh_cache = cache; }
+
+    // Embree or the in-tree wide BVH, applied when the accelerator is created
+    inline void setAcceleratorBackend(EAcceleratorBackend backend) { accelerator_backend = backend; }
+
+    // tone operator and output encoding of the film, applied when the film is created
+    inline void setFilmResolveSettings(const SFilmResolveSettings& settings) { film_resolve_settings = settings; }
+    inline void setImageOutputSettings(const SImageOutputSettings& settings) { image_output_settings = settings; }
+
+    // target spp, time budget and preview interval of the integrator
+    inline void setProgressiveSettings(const SProgressiveSettings& settings) { progressive_settings = settings; }
+    inline const SProgressiveSettings& getProgressiveSettings()const { return progressive_settings; }
+
+    // material by its name in the scene, nullptr before createAccelerator or if unknown
+    CMaterial* findMaterial(const std::string& name);
+
     CPerspectiveCamera* camera;
     CSampler* sampler;
     CRGBFilm* rgb_film;
@@ -69,8 +104,35 @@ public:
     std::vector<SShapeSceneEntity> shapes;
     std::vector<SSceneEntity> light_entities;
     std::vector<std::pair<std::string, SSceneEntity>> named_materials;
+
+    // ObjectBegin/ObjectEnd definitions and the world_from_object transforms of
+    // their ObjectInstances, built lazily, see CAccelerator::addLazyObject
+    std::map<std::string, std::vector<SShapeSceneEntity>> object_definitions;
+    std::vector<std::pair<std::string, glm::mat4x4>> object_instances;
+
+    // files the scene text pulls in, folded into the scene hash, see hashSourceFiles
+    std::vector<std::string> included_files;
+    std::set<std::string> mesh_files;
+    void hashSourceFiles();
 private:
+    void addPendingMaterials();
+    void addShape(SShapeSceneEntity& shape_entity, std::vector<std::shared_ptr<CLight>>& lights);
+    std::shared_ptr<STriangleMesh> createLightMesh(SShapeSceneEntity& shape_entity);
+
     std::vector<std::shared_ptr<STriangleMesh>> scene_triangle_meshes;
+    std::unordered_multimap<uint64_t, std::shared_ptr<STriangleMesh>> light_meshes;
+    bool mesh_dedup = true;
+    bool compact_geometry = false;
+    CMeshBufferCache* mesh_cache = nullptr;
+    EAcceleratorBackend accelerator_backend = AB_Embree;
+    std::vector<CPerspectiveCamera*> view_cameras;
+    SFilmResolveSettings film_resolve_settings;
+    SImageOutputSettings image_output_settings;
+    SProgressiveSettings progressive_settings;
+
+    bool streaming_build = false;
+    bool accelerator_committed = false;
+    std::vector<std::shared_ptr<CLight>> streamed_lights;
 };
 
 class Alpha7XSceneBuilder : public pbrt::ParserTarget
@@ -131,23 +193,36 @@ public:
 
     void SetSearchPath(const std::filesystem::path searchpath);
 
+    pbrt::ParserTarget* CopyForImport();
+    void MergeImported(pbrt::ParserTarget* imported);
+    void IncludedFile(const std::string& filename);
+
 private:
+    void submitShape(SShapeSceneEntity&& shape_entity);
+
     struct SGraphicsState
     {
-        glm::mat4x4 transform;
+        glm::mat4x4 transform = glm::mat4x4(1.0f);
         std::string material_name;
         std::string area_light_name;
         pbrt::ParameterDictionary area_light_params;
     };
     SGraphicsState graphics_state;
     std::vector<SGraphicsState> pushed_graphics_states;
+    std::string object_name; // the object being defined
     std::vector<SShapeSceneEntity> shapes;
 
     CAlpa7XScene* scene;
 
+    // imported files are parsed into a private scene and merged afterwards
+    std::unique_ptr<CAlpa7XScene> import_scene;
+    bool in_world_block = false;
+
    
 
     SSceneEntity sampler;
     SSceneEntity film, integrator, filter, accelerator;
     SCameraSceneEntity camera;
+    std::vector<SCameraSceneEntity> views;
+    bool has_camera = false;
 };
\ No newline at end of file
@@ -0,0 +1,356 @@
+#include "tile_farm.h"
+#include "net_socket.h"
+#include "progressive.h"
+#include <algorithm>
+#include <chrono>
+#include <deque>
+
+enum EFarmMessage
+{
+	FM_Hello,		// worker -> coordinator, payload SFarmHello
+	FM_Tile,		// coordinator -> worker, render the tile
+	FM_TileResult,	// worker -> coordinator, payload the packed tile accumulators
+	FM_Done,		// coordinator -> worker, the frame is finished
+};
+
+struct SFarmMessage
+{
+	uint32_t type;
+	uint32_t tile_idx;
+	uint32_t tile_min[2];
+	uint32_t tile_max[2];
+	uint64_t payload_bytes;
+};
+
+struct SFarmHello
+{
+	uint32_t protocol_version;
+	uint32_t width;
+	uint32_t height;
+	uint64_t scene_hash;
+};
+
+static const uint32_t farm_protocol_version = 1;
+
+static bool sendMessage(socket_t socket, const SFarmMessage& message, const void* payload)
+{
+	return sendAll(socket, &message, sizeof(message)) && sendAll(socket, payload, message.payload_bytes);
+}
+
+static SFarmMessage makeMessage(EFarmMessage type, uint64_t payload_bytes = 0)
+{
+	SFarmMessage message = {};
+	message.type = type;
+	message.payload_bytes = payload_bytes;
+	return message;
+}
+
+struct SFarmTile
+{
+	glm::u32vec2 tile_min;
+	glm::u32vec2 tile_max;
+	bool done = false;
+	int assigned_num = 0;
+	std::chrono::steady_clock::time_point assign_time;
+};
+
+struct SFarmWorker
+{
+	socket_t socket;
+	bool ready = false;
+	int tile_idx = -1;
+	int rendered_tiles = 0;
+};
+
+bool runTileCoordinator(const STileCoordinatorSettings& settings, const SFilmResolveSettings& resolve_settings, const SImageOutputSettings& output_settings)
+{
+	socket_t listen_socket = listenSocket(settings.address);
+	if (listen_socket == invalid_socket)
+	{
+		return false;
+	}
+	printf("waiting for workers on %s\n", settings.address.c_str());
+
+	SImageOutputSettings image_settings = output_settings;
+	if (image_settings.file_name.empty())
+	{
+		image_settings.file_name = "pbrt.exr";
+	}
+
+	// the first worker's hello decides the frame, the others have to match it
+	std::unique_ptr<CRGBFilm> film;
+	SFarmHello frame = {};
+	std::vector<SFarmTile> tiles;
+	std::deque<int> pending_tiles;
+	size_t done_tiles = 0;
+	size_t reported_tiles = 0;
+	std::vector<SFarmWorker> workers;
+	std::vector<uint8_t> payload;
+
+	auto dropWorker = [&](SFarmWorker& worker) {
+		if (worker.tile_idx >= 0)
+		{
+			SFarmTile& tile = tiles[worker.tile_idx];
+			tile.assigned_num--;
+			if (!tile.done && tile.assigned_num == 0)
+			{
+				pending_tiles.push_front(worker.tile_idx);
+			}
+		}
+		closeSocket(worker.socket);
+		worker.socket = invalid_socket;
+	};
+
+	auto receiveMessage = [&](SFarmWorker& worker) {
+		SFarmMessage message;
+		if (!receiveAll(worker.socket, &message, sizeof(message)))
+		{
+			return false;
+		}
+
+		if (message.type == FM_Hello && message.payload_bytes == sizeof(SFarmHello))
+		{
+			SFarmHello hello;
+			if (!receiveAll(worker.socket, &hello, sizeof(hello)) || hello.protocol_version != farm_protocol_version)
+			{
+				return false;
+			}
+			if (hello.width == 0 || hello.height == 0)
+			{
+				printf("a worker renders an empty image, disconnecting it\n");
+				return false;
+			}
+
+			if (!film)
+			{
+				frame = hello;
+				film = std::make_unique<CRGBFilm>(glm::u32vec2(hello.width, hello.height), resolve_settings);
+				film->enableSampleStatistics();
+				film->setOutputSettings(image_settings);
+				for (uint32_t y = 0; y < hello.height; y += settings.tile_size)
+				{
+					for (uint32_t x = 0; x < hello.width; x += settings.tile_size)
+					{
+						SFarmTile tile;
+						tile.tile_min = glm::u32vec2(x, y);
+						tile.tile_max = glm::min(tile.tile_min + glm::u32vec2(settings.tile_size), glm::u32vec2(hello.width, hello.height));
+						pending_tiles.push_back(int(tiles.size()));
+						tiles.push_back(tile);
+					}
+				}
+				printf("rendering %ux%u in %zu tiles\n", hello.width, hello.height, tiles.size());
+			}
+			else if (hello.scene_hash != frame.scene_hash || hello.width != frame.width || hello.height != frame.height)
+			{
+				printf("a worker renders another scene, disconnecting it\n");
+				return false;
+			}
+			worker.ready = true;
+			return true;
+		}
+
+		// a worker without a tile has tile_idx -1, which a stale result must not match
+		if (message.type == FM_TileResult && worker.ready && worker.tile_idx >= 0 && message.tile_idx == uint32_t(worker.tile_idx))
+		{
+			// the size comes from the peer, check it before allocating
+			SFarmTile& tile = tiles[worker.tile_idx];
+			if (message.payload_bytes != CRGBFilm::tileBytes(tile.tile_min, tile.tile_max))
+			{
+				printf("a worker sent a tile of %llu bytes, disconnecting it\n", (unsigned long long)message.payload_bytes);
+				return false;
+			}
+			payload.resize(message.payload_bytes);
+			if (!receiveAll(worker.socket, payload.data(), payload.size()))
+			{
+				return false;
+			}
+
+			// a rebalanced tile comes back twice, only the first copy counts
+			if (!tile.done)
+			{
+				if (!film->addTile(tile.tile_min, tile.tile_max, payload))
+				{
+					return false;
+				}
+				tile.done = true;
+				done_tiles++;
+			}
+			tile.assigned_num--;
+			worker.tile_idx = -1;
+			worker.rendered_tiles++;
+			return true;
+		}
+		return false;
+	};
+
+	// the tile waiting for a result the longest that nobody else renders yet
+	auto findRebalanceTile = [&]() {
+		int oldest_tile_idx = -1;
+		for (int tile_idx = 0; tile_idx < int(tiles.size()); tile_idx++)
+		{
+			const SFarmTile& tile = tiles[tile_idx];
+			if (!tile.done && tile.assigned_num == 1 && (oldest_tile_idx < 0 || tile.assign_time < tiles[oldest_tile_idx].assign_time))
+			{
+				oldest_tile_idx = tile_idx;
+			}
+		}
+		return oldest_tile_idx;
+	};
+
+	while (!film || done_tiles < tiles.size())
+	{
+		if (renderInterrupted())
+		{
+			printf("frame interrupted with %zu of %zu tiles done\n", done_tiles, tiles.size());
+			break;
+		}
+
+		std::vector<socket_t> sockets = { listen_socket };
+		for (const SFarmWorker& worker : workers)
+		{
+			sockets.push_back(worker.socket);
+		}
+
+		for (socket_t socket : waitReadable(sockets, 200))
+		{
+			if (socket == listen_socket)
+			{
+				SFarmWorker worker;
+				worker.socket = acceptSocket(listen_socket);
+				if (worker.socket != invalid_socket)
+				{
+					workers.push_back(worker);
+				}
+				continue;
+			}
+
+			for (SFarmWorker& worker : workers)
+			{
+				if (worker.socket == socket && !receiveMessage(worker))
+				{
+					dropWorker(worker);
+				}
+			}
+		}
+
+		for (SFarmWorker& worker : workers)
+		{
+			if (worker.socket == invalid_socket || !worker.ready || worker.tile_idx >= 0)
+			{
+				continue;
+			}
+
+			int tile_idx = -1;
+			if (!pending_tiles.empty())
+			{
+				tile_idx = pending_tiles.front();
+				pending_tiles.pop_front();
+			}
+			else
+			{
+				tile_idx = findRebalanceTile();
+			}
+			if (tile_idx < 0)
+			{
+				continue;
+			}
+
+			SFarmTile& tile = tiles[tile_idx];
+			SFarmMessage message = makeMessage(FM_Tile);
+			message.tile_idx = tile_idx;
+			message.tile_min[0] = tile.tile_min.x;
+			message.tile_min[1] = tile.tile_min.y;
+			message.tile_max[0] = tile.tile_max.x;
+			message.tile_max[1] = tile.tile_max.y;
+
+			tile.assigned_num++;
+			tile.assign_time = std::chrono::steady_clock::now();
+			worker.tile_idx = tile_idx;
+			if (!sendMessage(worker.socket, message, nullptr))
+			{
+				dropWorker(worker);
+			}
+		}
+
+		if (film && film->previewStreamDue())
+		{
+			film->streamPreview(0);
+		}
+
+		workers.erase(std::remove_if(workers.begin(), workers.end(), [](const SFarmWorker& worker) { return worker.socket == invalid_socket; }), workers.end());
+
+		if (film && !tiles.empty() && done_tiles * 10 / tiles.size() > reported_tiles * 10 / tiles.size())
+		{
+			printf("%zu of %zu tiles done, %zu workers\n", done_tiles, tiles.size(), workers.size());
+			reported_tiles = done_tiles;
+		}
+	}
+
+	SFarmMessage done_message = makeMessage(FM_Done);
+	for (SFarmWorker& worker : workers)
+	{
+		sendMessage(worker.socket, done_message, nullptr);
+		closeSocket(worker.socket);
+	}
+	closeSocket(listen_socket);
+
+	if (!film)
+	{
+		return false;
+	}
+
+	film->streamPreview(0);
+	film->writeImage(0);
+	film->flushOutput();
+	return done_tiles == tiles.size();
+}
+
+bool runTileWorker(const std::string& address, CAlpa7XScene& scene, uint64_t scene_hash)
+{
+	std::vector<std::shared_ptr<CLight>> lights;
+	CPerspectiveCamera* camera = scene.getCamera();
+	CSampler* sampler = scene.getSampler();
+	CAccelerator* accel = scene.createAccelerator(lights);
+	std::unique_ptr<CIntegrator> integrator = scene.createIntegrator(camera, sampler, accel, lights);
+
+	CRGBFilm* film = camera->getFilm();
+	film->enableSampleStatistics();
+
+	socket_t socket = connectSocket(address);
+	if (socket == invalid_socket)
+	{
+		printf("cannot connect to the coordinator at %s\n", address.c_str());
+		return false;
+	}
+
+	SFarmHello hello;
+	hello.protocol_version = farm_protocol_version;
+	hello.width = film->getImageSize().x;
+	hello.height = film->getImageSize().y;
+	hello.scene_hash = scene_hash;
+	bool connected = sendMessage(socket, makeMessage(FM_Hello, sizeof(hello)), &hello);
+
+	int rendered_tiles = 0;
+	std::vector<uint8_t> payload;
+	SFarmMessage message = {};
+	while (connected && receiveAll(socket, &message, sizeof(message)) && message.type == FM_Tile)
+	{
+		glm::u32vec2 tile_min(message.tile_min[0], message.tile_min[1]);
+		glm::u32vec2 tile_max(message.tile_max[0], message.tile_max[1]);
+		if (!integrator->renderTile(tile_min, tile_max))
+		{
+			printf("the integrator cannot render single tiles\n");
+			break;
+		}
+
+		film->takeTile(tile_min, tile_max, payload);
+		SFarmMessage result = makeMessage(FM_TileResult, payload.size());
+		result.tile_idx = message.tile_idx;
+		connected = sendMessage(socket, result, payload.data());
+		rendered_tiles++;
+	}
+
+	closeSocket(socket);
+	printf("rendered %d tiles\n", rendered_tiles);
+	return connected && message.type == FM_Done;
+}
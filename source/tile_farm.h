@@ -0,0 +1,24 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include "scene.h"
+
+// One frame rendered by several renderer processes: the coordinator hands out
+// crop windows of the image to the workers that connect to it and adds the
+// returned tile accumulators into its film. Workers parse the scene and build
+// the accelerator once, then render tiles until the frame is done.
+
+struct STileCoordinatorSettings
+{
+	// "host:port" or "unix:<path>", see net_socket.h
+	std::string address;
+	uint32_t tile_size = 64;
+};
+
+// waits for workers, distributes the tiles of one frame and writes the image;
+// once no tile is left, idle workers also take the oldest tile still being
+// rendered, and the first result of a tile is kept
+bool runTileCoordinator(const STileCoordinatorSettings& settings, const SFilmResolveSettings& resolve_settings, const SImageOutputSettings& output_settings);
+
+// renders the tiles handed out by the coordinator until the frame is done
+bool runTileWorker(const std::string& address, CAlpa7XScene& scene, uint64_t scene_hash);